@@ -4,68 +4,168 @@
 #include "rlist.h"
 
 #include <assert.h>
+#include <linux/futex.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include <stdio.h>
 
-struct data_vector {
+/**
+ * Ring buffer of messages. The capacity is a power of two, so a
+ * position is turned into an index with a mask. The head and
+ * tail only grow, their difference is the size.
+ */
+struct data_ring {
 	unsigned *data;
-	size_t size;
-	size_t capacity;
+	/** Capacity - 1. */
+	size_t mask;
+	/** Position of the first message. */
+	size_t head;
+	/** Position after the last message. */
+	size_t tail;
 };
 
-#if 0
+/** Allocate a ring fitting at least @a count messages. */
+static int
+data_ring_create(struct data_ring *ring, size_t count)
+{
+	size_t capacity = 1;
+	while (capacity < count)
+		capacity <<= 1;
+	ring->data = malloc(capacity * sizeof(ring->data[0]));
+	if (ring->data == NULL)
+		return -1;
+	ring->mask = capacity - 1;
+	ring->head = 0;
+	ring->tail = 0;
+	return 0;
+}
 
-/** Append @a count messages in @a data to the end of the vector. */
 static void
-data_vector_append_many(struct data_vector *vector,
-	const unsigned *data, size_t count)
+data_ring_destroy(struct data_ring *ring)
 {
-	if (vector->size + count > vector->capacity) {
-		if (vector->capacity == 0)
-			vector->capacity = 4;
-		else
-			vector->capacity *= 2;
-		if (vector->capacity < vector->size + count)
-			vector->capacity = vector->size + count;
-		vector->data = realloc(vector->data,
-			sizeof(vector->data[0]) * vector->capacity);
-	}
-	memcpy(&vector->data[vector->size], data, sizeof(data[0]) * count);
-	vector->size += count;
+	free(ring->data);
 }
 
-/** Append a single message to the vector. */
-static void
-data_vector_append(struct data_vector *vector, unsigned data)
+static inline size_t
+data_ring_size(const struct data_ring *ring)
+{
+	return ring->tail - ring->head;
+}
+
+/** Append a single message to the ring. */
+static inline void
+data_ring_push(struct data_ring *ring, unsigned data)
 {
-	data_vector_append_many(vector, &data, 1);
+	assert(data_ring_size(ring) <= ring->mask);
+	ring->data[ring->tail++ & ring->mask] = data;
 }
 
-/** Pop @a count of messages into @a data from the head of the vector. */
+/** Pop a single message from the head of the ring. */
+static inline unsigned
+data_ring_pop(struct data_ring *ring)
+{
+	assert(data_ring_size(ring) > 0);
+	return ring->data[ring->head++ & ring->mask];
+}
+
+#if NEED_BATCH
+
+/** Append @a count messages in @a data to the end of the ring. */
 static void
-data_vector_pop_first_many(struct data_vector *vector, unsigned *data, size_t count)
+data_ring_push_many(struct data_ring *ring, const unsigned *data,
+	size_t count)
 {
-	assert(count <= vector->size);
-	memcpy(data, vector->data, sizeof(data[0]) * count);
-	vector->size -= count;
-	if (vector->size > 0) {
-		memmove(vector->data, &vector->data[count], vector->size * sizeof(vector->data[0]));
+	assert(data_ring_size(ring) + count <= ring->mask + 1);
+	size_t pos = ring->tail & ring->mask;
+	size_t first = ring->mask + 1 - pos;
+	if (first > count)
+		first = count;
+	memcpy(&ring->data[pos], data, first * sizeof(data[0]));
+	if (first < count) {
+		memcpy(ring->data, &data[first],
+			(count - first) * sizeof(data[0]));
 	}
+	ring->tail += count;
 }
 
-/** Pop a single message from the head of the vector. */
-static unsigned
-data_vector_pop_first(struct data_vector *vector)
+/** Pop @a count of messages into @a data from the head of the ring. */
+static void
+data_ring_pop_many(struct data_ring *ring, unsigned *data, size_t count)
 {
-	unsigned data = 0;
-	data_vector_pop_first_many(vector, &data, 1);
-	return data;
+	assert(count <= data_ring_size(ring));
+	size_t pos = ring->head & ring->mask;
+	size_t first = ring->mask + 1 - pos;
+	if (first > count)
+		first = count;
+	memcpy(data, &ring->data[pos], first * sizeof(data[0]));
+	if (first < count) {
+		memcpy(&data[first], ring->data,
+			(count - first) * sizeof(data[0]));
+	}
+	ring->head += count;
 }
 
 #endif
 
+/**
+ * Ring buffer of payload messages. Same as data_ring, but keeps
+ * the whole payload descriptors. Allocated only for the channels
+ * which ever carried a payload.
+ */
+struct msg_ring {
+	struct coro_bus_msg *msgs;
+	/** Capacity - 1. */
+	size_t mask;
+	size_t head;
+	size_t tail;
+};
+
+static int
+msg_ring_create(struct msg_ring *ring, size_t capacity)
+{
+	assert((capacity & (capacity - 1)) == 0);
+	ring->msgs = malloc(capacity * sizeof(ring->msgs[0]));
+	if (ring->msgs == NULL)
+		return -1;
+	ring->mask = capacity - 1;
+	ring->head = 0;
+	ring->tail = 0;
+	return 0;
+}
+
+static void
+msg_ring_destroy(struct msg_ring *ring)
+{
+	free(ring->msgs);
+}
+
+static inline size_t
+msg_ring_size(const struct msg_ring *ring)
+{
+	return ring->tail - ring->head;
+}
+
+static inline void
+msg_ring_push(struct msg_ring *ring, const struct coro_bus_msg *msg)
+{
+	assert(msg_ring_size(ring) <= ring->mask);
+	ring->msgs[ring->tail++ & ring->mask] = *msg;
+}
+
+static inline void
+msg_ring_pop(struct msg_ring *ring, struct coro_bus_msg *msg)
+{
+	assert(msg_ring_size(ring) > 0);
+	*msg = ring->msgs[ring->head++ & ring->mask];
+}
+
 /**
  * One coroutine waiting to be woken up in a list of other
  * suspended coros.
@@ -93,6 +193,29 @@ wakeup_queue_suspend_this(struct wakeup_queue *queue)
 	rlist_del_entry(&entry, base);
 }
 
+/**
+ * Same as wakeup_queue_suspend_this(), but gives up at the
+ * @a deadline, in coro_time() seconds. Returns false if the
+ * deadline has passed already and the coroutine wasn't suspended.
+ */
+static bool
+wakeup_queue_suspend_this_until(struct wakeup_queue *queue, double deadline)
+{
+	if (deadline == INFINITY) {
+		wakeup_queue_suspend_this(queue);
+		return true;
+	}
+	double timeout = deadline - coro_time();
+	if (timeout <= 0)
+		return false;
+	struct wakeup_entry entry;
+	entry.coro = coro_this();
+	rlist_add_tail_entry(&queue->coros, &entry, base);
+	coro_suspend_timeout(timeout);
+	rlist_del_entry(&entry, base);
+	return true;
+}
+
 /** Wakeup the first coroutine in the queue. */
 static void
 wakeup_queue_wakeup_first(struct wakeup_queue *queue)
@@ -106,24 +229,672 @@ wakeup_queue_wakeup_first(struct wakeup_queue *queue)
 
 #endif
 
+enum {
+	CACHE_LINE_SIZE = 64,
+};
+
+struct shared_ring_cell {
+	/**
+	 * MPMC mode. Position of the message for which the cell is
+	 * ready: the cell is free for the message at position pos
+	 * when seq == pos, and keeps it when seq == pos + 1.
+	 */
+	size_t seq;
+	unsigned data;
+};
+
+/**
+ * Lock-free ring buffer of messages for channels shared between
+ * threads. In SPSC mode it is the classic single producer single
+ * consumer ring where each side owns its position. In MPMC mode
+ * the sides reserve the positions with CAS and each cell has a
+ * sequence number telling which side owns it. The producer and
+ * the consumer data are on different cache lines.
+ */
+struct shared_ring {
+	struct shared_ring_cell *cells;
+	/** Capacity - 1. */
+	size_t mask;
+	char pad0[CACHE_LINE_SIZE];
+	/** Position of the next message to pop. */
+	size_t head;
+	/** SPSC mode. Consumer's copy of the tail. */
+	size_t tail_cache;
+	char pad1[CACHE_LINE_SIZE];
+	/** Position of the next message to push. */
+	size_t tail;
+	/** SPSC mode. Producer's copy of the head. */
+	size_t head_cache;
+	char pad2[CACHE_LINE_SIZE];
+};
+
+static int
+shared_ring_create(struct shared_ring *ring, size_t count)
+{
+	/*
+	 * A single MPMC cell can't tell a free slot from a taken
+	 * one by its seq: both would be equal to the next position.
+	 */
+	size_t capacity = 2;
+	while (capacity < count)
+		capacity <<= 1;
+	ring->cells = malloc(capacity * sizeof(ring->cells[0]));
+	if (ring->cells == NULL)
+		return -1;
+	for (size_t i = 0; i < capacity; ++i)
+		ring->cells[i].seq = i;
+	ring->mask = capacity - 1;
+	ring->head = 0;
+	ring->tail_cache = 0;
+	ring->tail = 0;
+	ring->head_cache = 0;
+	return 0;
+}
+
+static void
+shared_ring_destroy(struct shared_ring *ring)
+{
+	free(ring->cells);
+}
+
+static bool
+shared_ring_spsc_push(struct shared_ring *ring, unsigned data)
+{
+	size_t tail = ring->tail;
+	if (tail - ring->head_cache > ring->mask) {
+		ring->head_cache = __atomic_load_n(&ring->head,
+			__ATOMIC_ACQUIRE);
+		if (tail - ring->head_cache > ring->mask)
+			return false;
+	}
+	ring->cells[tail & ring->mask].data = data;
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static bool
+shared_ring_spsc_pop(struct shared_ring *ring, unsigned *data)
+{
+	size_t head = ring->head;
+	if (head == ring->tail_cache) {
+		ring->tail_cache = __atomic_load_n(&ring->tail,
+			__ATOMIC_ACQUIRE);
+		if (head == ring->tail_cache)
+			return false;
+	}
+	*data = ring->cells[head & ring->mask].data;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static bool
+shared_ring_mpmc_push(struct shared_ring *ring, unsigned data)
+{
+	size_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	struct shared_ring_cell *cell;
+	while (true) {
+		cell = &ring->cells[pos & ring->mask];
+		size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&ring->tail, &pos,
+					pos + 1, true, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+		}
+	}
+	cell->data = data;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static bool
+shared_ring_mpmc_pop(struct shared_ring *ring, unsigned *data)
+{
+	size_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	struct shared_ring_cell *cell;
+	while (true) {
+		cell = &ring->cells[pos & ring->mask];
+		size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&ring->head, &pos,
+					pos + 1, true, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+		}
+	}
+	*data = cell->data;
+	__atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/**
+ * Check if the ring has space for a message without taking it.
+ * Used by the waiters to recheck the ring after registration.
+ */
+static bool
+shared_ring_can_push(struct shared_ring *ring)
+{
+	size_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) + ring->mask >=
+		pos;
+}
+
+/** Check if the ring has messages without taking them. */
+static bool
+shared_ring_can_pop(struct shared_ring *ring)
+{
+	size_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != pos;
+}
+
+enum shared_wakeup_state {
+	SHARED_WAKEUP_WAITING = 0,
+	/**
+	 * The entry is removed from the queue, but the waker is
+	 * still using the coroutine. The waiter must not suspend
+	 * anymore, but can't leave either.
+	 */
+	SHARED_WAKEUP_WAKING,
+	/**
+	 * Same, and the waiter's thread sleeps on the state futex
+	 * until the waker is done.
+	 */
+	SHARED_WAKEUP_WAKING_PARKED,
+	/** The waker is done, the waiter can leave. */
+	SHARED_WAKEUP_WOKEN,
+};
+
+/**
+ * Coroutine waiting in a queue shared between threads. Lives on
+ * the waiter's stack.
+ */
+struct shared_wakeup_entry {
+	struct rlist base;
+	struct coro *coro;
+	/** enum shared_wakeup_state, an int to be a futex. */
+	int state;
+	/** The channel is closed, can't touch it anymore. */
+	bool is_closed;
+};
+
+/**
+ * A queue of suspended coros which can be woken up from any
+ * thread. The wakers check the waiter count without the lock, so
+ * when nobody waits the send and recv don't touch the mutex.
+ */
+struct shared_wakeup_queue {
+	pthread_mutex_t lock;
+	struct rlist coros;
+	size_t count;
+};
+
+static void
+shared_wakeup_queue_create(struct shared_wakeup_queue *queue)
+{
+	pthread_mutex_init(&queue->lock, NULL);
+	rlist_create(&queue->coros);
+	queue->count = 0;
+}
+
+static void
+shared_futex_wait(int *futex, int value)
+{
+	syscall(SYS_futex, futex, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void
+shared_futex_wake(int *futex)
+{
+	syscall(SYS_futex, futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/**
+ * Wakeup the waiter of a removed entry. The coroutine can be
+ * resumed by its thread before coro_wakeup() returns, so it must
+ * see that it is woken already, and wait until the waker is done.
+ */
+static void
+shared_wakeup_entry_wakeup(struct shared_wakeup_entry *entry)
+{
+	__atomic_store_n(&entry->state, SHARED_WAKEUP_WAKING, __ATOMIC_SEQ_CST);
+	coro_wakeup(entry->coro);
+	/*
+	 * The waiter can leave and free the entry after that. The
+	 * wake doesn't read the entry's memory, only uses its address.
+	 */
+	if (__atomic_exchange_n(&entry->state, SHARED_WAKEUP_WOKEN,
+				__ATOMIC_ACQ_REL) == SHARED_WAKEUP_WAKING_PARKED)
+		shared_futex_wake(&entry->state);
+}
+
+/**
+ * Wait until the waker of the entry is done. It can be still
+ * inside coro_wakeup() on another thread, so sleep on the state
+ * futex instead of spinning.
+ */
+static void
+shared_wakeup_entry_wait_woken(struct shared_wakeup_entry *entry)
+{
+	int state;
+	while ((state = __atomic_load_n(&entry->state, __ATOMIC_ACQUIRE)) !=
+	       SHARED_WAKEUP_WOKEN) {
+		if (state == SHARED_WAKEUP_WAKING) {
+			__atomic_compare_exchange_n(&entry->state, &state,
+				SHARED_WAKEUP_WAKING_PARKED, false,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+		} else {
+			shared_futex_wait(&entry->state,
+				SHARED_WAKEUP_WAKING_PARKED);
+		}
+	}
+}
+
+/** Wakeup the first coroutine in the queue, from any thread. */
+static void
+shared_wakeup_queue_wakeup_first(struct shared_wakeup_queue *queue)
+{
+	/*
+	 * Pairs with the fence in shared_wakeup_queue_add(). Either
+	 * the waker sees the waiter, or the waiter sees the change
+	 * in the ring when rechecks it.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&queue->count, __ATOMIC_RELAXED) == 0)
+		return;
+	pthread_mutex_lock(&queue->lock);
+	if (!rlist_empty(&queue->coros)) {
+		struct shared_wakeup_entry *entry = rlist_shift_entry(
+			&queue->coros, struct shared_wakeup_entry, base);
+		__atomic_sub_fetch(&queue->count, 1, __ATOMIC_RELAXED);
+		shared_wakeup_entry_wakeup(entry);
+	}
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/** Wakeup all the coroutines in the queue of a closed channel. */
+static void
+shared_wakeup_queue_destroy(struct shared_wakeup_queue *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	while (!rlist_empty(&queue->coros)) {
+		struct shared_wakeup_entry *entry = rlist_shift_entry(
+			&queue->coros, struct shared_wakeup_entry, base);
+		entry->is_closed = true;
+		shared_wakeup_entry_wakeup(entry);
+	}
+	queue->count = 0;
+	pthread_mutex_unlock(&queue->lock);
+	pthread_mutex_destroy(&queue->lock);
+}
+
+/**
+ * Register the current coroutine in the queue. After that the
+ * caller must recheck the condition it is going to wait for, and
+ * then call shared_wakeup_queue_wait().
+ */
+static void
+shared_wakeup_queue_add(struct shared_wakeup_queue *queue,
+	struct shared_wakeup_entry *entry)
+{
+	entry->coro = coro_this();
+	entry->state = SHARED_WAKEUP_WAITING;
+	entry->is_closed = false;
+	pthread_mutex_lock(&queue->lock);
+	rlist_add_tail_entry(&queue->coros, entry, base);
+	__atomic_add_fetch(&queue->count, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&queue->lock);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/**
+ * Suspend until the entry is woken up or until the @a deadline,
+ * in coro_time() seconds. If the condition became true already
+ * (@a is_ready), then just leave the queue.
+ */
+static void
+shared_wakeup_queue_wait(struct shared_wakeup_queue *queue,
+	struct shared_wakeup_entry *entry, bool is_ready, double deadline)
+{
+	while (!is_ready) {
+		if (__atomic_load_n(&entry->state, __ATOMIC_ACQUIRE) !=
+		    SHARED_WAKEUP_WAITING) {
+			shared_wakeup_entry_wait_woken(entry);
+			return;
+		}
+		if (deadline == INFINITY) {
+			coro_suspend_remote();
+			continue;
+		}
+		double timeout = deadline - coro_time();
+		if (timeout <= 0)
+			break;
+		coro_suspend_timeout(timeout);
+	}
+	pthread_mutex_lock(&queue->lock);
+	/* Under the lock the waker is done with the entry if any. */
+	bool is_woken = entry->state != SHARED_WAKEUP_WAITING;
+	if (!is_woken) {
+		rlist_del_entry(entry, base);
+		__atomic_sub_fetch(&queue->count, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&queue->lock);
+	/* The wakeup wasn't needed, maybe someone else needs it. */
+	if (is_woken)
+		shared_wakeup_queue_wakeup_first(queue);
+}
+
 struct coro_bus_channel {
 	/** Channel max capacity. */
 	size_t size_limit;
+	enum coro_bus_channel_mode mode;
 	/** Coroutines waiting until the channel is not full. */
 	struct wakeup_queue send_queue;
 	/** Coroutines waiting until the channel is not empty. */
 	struct wakeup_queue recv_queue;
-	/** Message queue. */
-	struct data_vector data;
+	/** Message queue, preallocated to fit size_limit messages. */
+	struct data_ring data;
+	/**
+	 * Payload messages. They share the size limit and the
+	 * senders queue with the plain messages, but have own
+	 * receivers. The ring is NULL until the first payload.
+	 */
+	struct msg_ring msgs;
+	struct wakeup_queue msg_recv_queue;
+	/**
+	 * Shared modes. The ring and the waiters are used instead of
+	 * the ones above.
+	 */
+	struct shared_ring ring;
+	struct shared_wakeup_queue send_waiters;
+	struct shared_wakeup_queue recv_waiters;
+};
+
+enum {
+	/** Size of the smallest payload slab class. */
+	BUS_SLAB_MIN_SIZE = 16,
+	/** Classes are powers of 2 from the min size to 2KB. */
+	BUS_SLAB_CLASS_COUNT = 8,
+	BUS_SLAB_MAX_SIZE = BUS_SLAB_MIN_SIZE << (BUS_SLAB_CLASS_COUNT - 1),
+	/** Memory is taken from malloc by chunks of this size. */
+	BUS_SLAB_CHUNK_SIZE = 64 * 1024,
+};
+
+/** Free block of a slab class, the link is kept in the block itself. */
+struct bus_slab_block {
+	struct bus_slab_block *next;
+};
+
+struct bus_slab_chunk {
+	struct bus_slab_chunk *next;
+	/** Keep the blocks aligned like malloc() does. */
+	max_align_t data[];
+};
+
+/**
+ * Allocator of the small payloads. The blocks are cut from big
+ * chunks and are never returned to malloc until the bus is
+ * deleted. Freed blocks are reused via a free list per class.
+ */
+struct bus_slab {
+	struct bus_slab_block *free[BUS_SLAB_CLASS_COUNT];
+	struct bus_slab_chunk *chunks;
+	/** Not used yet part of the last chunk. */
+	char *pos;
+	char *end;
+};
+
+struct coro_bus_subscriber {
+	/** Sequence number of the next message to receive. */
+	size_t cursor;
+	bool is_active;
+};
+
+/**
+ * Topic keeps each published message once, in a ring shared by all
+ * the subscribers. Each subscriber has its own cursor in it. For
+ * the drop and block policies each message counts the subscribers
+ * which didn't read it yet. The head is the oldest message with
+ * non-zero count. The overwrite policy doesn't need the counts,
+ * the oldest messages are simply forgotten.
+ */
+struct coro_bus_topic {
+	size_t size_limit;
+	enum coro_bus_topic_policy policy;
+	unsigned *data;
+	unsigned *refs;
+	/** Capacity - 1. */
+	size_t mask;
+	/** Sequence number of the oldest kept message. */
+	size_t head;
+	/** Sequence number of the next published message. */
+	size_t tail;
+	struct coro_bus_subscriber *subs;
+	int sub_count;
+	int max_sub_count;
+	/** Publishers waiting for space, block policy only. */
+	struct wakeup_queue publish_queue;
+	/** Subscribers waiting for new messages. */
+	struct wakeup_queue recv_queue;
 };
 
 struct coro_bus {
 	struct coro_bus_channel **channels;
 	int channel_count;
 	int max_channel_count;
+	struct bus_slab slab;
+	struct coro_bus_topic **topics;
+	int max_topic_count;
+	/** Rotates the first checked case of the fair selects. */
+	unsigned select_seq;
 };
 
-static enum coro_bus_error_code global_error = CORO_BUS_ERR_NONE;
+static inline int
+bus_slab_class(size_t size)
+{
+	if (size <= BUS_SLAB_MIN_SIZE)
+		return 0;
+	return (int)(sizeof(long) * 8) - __builtin_clzl(size - 1) -
+		__builtin_ctz(BUS_SLAB_MIN_SIZE);
+}
+
+static void
+bus_slab_create(struct bus_slab *slab)
+{
+	memset(slab, 0, sizeof(*slab));
+}
+
+static void
+bus_slab_destroy(struct bus_slab *slab)
+{
+	while (slab->chunks != NULL) {
+		struct bus_slab_chunk *chunk = slab->chunks;
+		slab->chunks = chunk->next;
+		free(chunk);
+	}
+}
+
+static void *
+bus_slab_alloc(struct bus_slab *slab, size_t size)
+{
+	if (size > BUS_SLAB_MAX_SIZE)
+		return malloc(size);
+	int cls = bus_slab_class(size);
+	struct bus_slab_block *block = slab->free[cls];
+	if (block != NULL) {
+		slab->free[cls] = block->next;
+		return block;
+	}
+	size_t block_size = (size_t)BUS_SLAB_MIN_SIZE << cls;
+	if ((size_t)(slab->end - slab->pos) < block_size) {
+		/* The chunk's tail is lost, it is smaller than a block. */
+		struct bus_slab_chunk *chunk = malloc(BUS_SLAB_CHUNK_SIZE);
+		if (chunk == NULL)
+			return NULL;
+		chunk->next = slab->chunks;
+		slab->chunks = chunk;
+		slab->pos = (char *)chunk->data;
+		slab->end = (char *)chunk + BUS_SLAB_CHUNK_SIZE;
+	}
+	void *res = slab->pos;
+	slab->pos += block_size;
+	return res;
+}
+
+static void
+bus_slab_free(struct bus_slab *slab, void *data, size_t size)
+{
+	if (size > BUS_SLAB_MAX_SIZE) {
+		free(data);
+		return;
+	}
+	int cls = bus_slab_class(size);
+	struct bus_slab_block *block = data;
+	block->next = slab->free[cls];
+	slab->free[cls] = block;
+}
+
+/** Sum of the plain and payload messages in a local channel. */
+static inline size_t
+coro_bus_channel_size(const struct coro_bus_channel *ch)
+{
+	size_t size = data_ring_size(&ch->data);
+	if (ch->msgs.msgs != NULL)
+		size += msg_ring_size(&ch->msgs);
+	return size;
+}
+
+/** Each thread has its own error, like errno. */
+static __thread enum coro_bus_error_code global_error = CORO_BUS_ERR_NONE;
+
+static struct coro_bus_channel *
+coro_bus_channel_get(struct coro_bus *bus, int channel)
+{
+	if (bus == NULL || channel < 0 || channel >= bus->max_channel_count)
+		return NULL;
+	return bus->channels[channel];
+}
+
+/** Free the channel's messages and wakeup all its waiters. */
+static void
+coro_bus_channel_destroy(struct coro_bus *bus, struct coro_bus_channel *ch)
+{
+	if (ch->mode == CORO_BUS_CHANNEL_LOCAL) {
+		data_ring_destroy(&ch->data);
+		if (ch->msgs.msgs != NULL) {
+			while (msg_ring_size(&ch->msgs) > 0) {
+				struct coro_bus_msg msg;
+				msg_ring_pop(&ch->msgs, &msg);
+				if (msg.destroy != NULL)
+					msg.destroy(bus, msg.data, msg.size);
+			}
+			msg_ring_destroy(&ch->msgs);
+		}
+	} else {
+		shared_wakeup_queue_destroy(&ch->send_waiters);
+		shared_wakeup_queue_destroy(&ch->recv_waiters);
+		shared_ring_destroy(&ch->ring);
+	}
+	free(ch);
+}
+
+static inline bool
+coro_bus_channel_push(struct coro_bus_channel *ch, unsigned data)
+{
+	if (ch->mode == CORO_BUS_CHANNEL_SPSC)
+		return shared_ring_spsc_push(&ch->ring, data);
+	return shared_ring_mpmc_push(&ch->ring, data);
+}
+
+static inline bool
+coro_bus_channel_pop(struct coro_bus_channel *ch, unsigned *data)
+{
+	if (ch->mode == CORO_BUS_CHANNEL_SPSC)
+		return shared_ring_spsc_pop(&ch->ring, data);
+	return shared_ring_mpmc_pop(&ch->ring, data);
+}
+
+/** The @a deadline in coro_time() seconds has passed. */
+static inline bool
+coro_bus_is_expired(double deadline)
+{
+	return deadline != INFINITY && coro_time() >= deadline;
+}
+
+static int
+coro_bus_shared_send(struct coro_bus_channel *ch, unsigned data,
+	double deadline)
+{
+	while (!coro_bus_channel_push(ch, data)) {
+		if (coro_bus_is_expired(deadline)) {
+			coro_bus_errno_set(CORO_BUS_ERR_TIMEOUT);
+			return -1;
+		}
+		struct shared_wakeup_entry entry;
+		shared_wakeup_queue_add(&ch->send_waiters, &entry);
+		shared_wakeup_queue_wait(&ch->send_waiters, &entry,
+			shared_ring_can_push(&ch->ring), deadline);
+		if (entry.is_closed) {
+			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+			return -1;
+		}
+	}
+	shared_wakeup_queue_wakeup_first(&ch->recv_waiters);
+	return 0;
+}
+
+static int
+coro_bus_shared_try_send(struct coro_bus_channel *ch, unsigned data)
+{
+	if (!coro_bus_channel_push(ch, data)) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	shared_wakeup_queue_wakeup_first(&ch->recv_waiters);
+	return 0;
+}
+
+static int
+coro_bus_shared_recv(struct coro_bus_channel *ch, unsigned *data,
+	double deadline)
+{
+	while (!coro_bus_channel_pop(ch, data)) {
+		if (coro_bus_is_expired(deadline)) {
+			coro_bus_errno_set(CORO_BUS_ERR_TIMEOUT);
+			return -1;
+		}
+		struct shared_wakeup_entry entry;
+		shared_wakeup_queue_add(&ch->recv_waiters, &entry);
+		shared_wakeup_queue_wait(&ch->recv_waiters, &entry,
+			shared_ring_can_pop(&ch->ring), deadline);
+		if (entry.is_closed) {
+			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+			return -1;
+		}
+	}
+	shared_wakeup_queue_wakeup_first(&ch->send_waiters);
+	return 0;
+}
+
+static int
+coro_bus_shared_try_recv(struct coro_bus_channel *ch, unsigned *data)
+{
+	if (!coro_bus_channel_pop(ch, data)) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	shared_wakeup_queue_wakeup_first(&ch->send_waiters);
+	return 0;
+}
 
 enum coro_bus_error_code
 coro_bus_errno(void)
@@ -149,6 +920,10 @@ coro_bus_new(void)
 	bus->channels = NULL;
 	bus->channel_count = 0;
 		bus->max_channel_count = 0;
+	bus_slab_create(&bus->slab);
+	bus->topics = NULL;
+	bus->max_topic_count = 0;
+	bus->select_seq = 0;
 
     	return bus;
 }
@@ -163,44 +938,73 @@ coro_bus_delete(struct coro_bus *bus)
 		if (!bus->channels[i]) 
 			continue;
 		
-	        free(bus->channels[i]->data.data);
-		free(bus->channels[i]);
+		coro_bus_channel_destroy(bus, bus->channels[i]);
 	};
 	
 	free(bus->channels);
+	for (int i = 0; i < bus->max_topic_count; ++i) {
+		if (bus->topics[i] != NULL)
+			coro_bus_topic_close(bus, i);
+	}
+	free(bus->topics);
+	bus_slab_destroy(&bus->slab);
 	free(bus);
 }
 
-int 
-create_channel(struct coro_bus *bus, size_t index, size_t size_limit) 
-{	
+static int
+create_channel_mode(struct coro_bus *bus, size_t index, size_t size_limit,
+	enum coro_bus_channel_mode mode)
+{
 	struct coro_bus_channel *channel = calloc(1, sizeof(*channel));
 	if (!channel) {
 		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
 		return -1;
 	};
-	
-	channel->data.data = calloc(size_limit, sizeof(unsigned));
-	if (!channel->data.data) {
+
+	int rc;
+	if (mode == CORO_BUS_CHANNEL_LOCAL)
+		rc = data_ring_create(&channel->data, size_limit);
+	else
+		rc = shared_ring_create(&channel->ring, size_limit);
+	if (rc != 0) {
 		free(channel);
 		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
 		return -1;
 	};
-	
+
 	channel->size_limit = size_limit;
-	channel->data.size = 0;
-	channel->data.capacity = size_limit;
-	
+	channel->mode = mode;
+
 	rlist_create(&channel->send_queue.coros);
 	rlist_create(&channel->recv_queue.coros);
-    
+	rlist_create(&channel->msg_recv_queue.coros);
+	if (mode != CORO_BUS_CHANNEL_LOCAL) {
+		shared_wakeup_queue_create(&channel->send_waiters);
+		shared_wakeup_queue_create(&channel->recv_waiters);
+	}
+
 	bus->channels[index] = channel;
 	bus->channel_count++;
 	return index;
 }
 
+int 
+create_channel(struct coro_bus *bus, size_t index, size_t size_limit) 
+{	
+	return create_channel_mode(bus, index, size_limit,
+		CORO_BUS_CHANNEL_LOCAL);
+}
+
 int 
 coro_bus_channel_open(struct coro_bus *bus, size_t size_limit) 
+{
+	return coro_bus_channel_open_mode(bus, size_limit,
+		CORO_BUS_CHANNEL_LOCAL);
+}
+
+int
+coro_bus_channel_open_mode(struct coro_bus *bus, size_t size_limit,
+	enum coro_bus_channel_mode mode)
 {
 	if (!bus || size_limit == 0) {
 		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
@@ -209,7 +1013,7 @@ coro_bus_channel_open(struct coro_bus *bus, size_t size_limit)
     
 	for (int i = 0; i < bus->max_channel_count; ++i) {
 		if (bus->channels[i] == NULL ) {
-			return create_channel(bus, i, size_limit);	
+			return create_channel_mode(bus, i, size_limit, mode);
 		};
 	};
 	
@@ -220,17 +1024,17 @@ coro_bus_channel_open(struct coro_bus *bus, size_t size_limit)
 	};
 
 	bus->channels = new_channels;
-	return create_channel(bus, bus->max_channel_count++, size_limit);
+	return create_channel_mode(bus, bus->max_channel_count++, size_limit,
+		mode);
 }
 
 void
 coro_bus_channel_close(struct coro_bus *bus, int channel) 
 {
-	if (!bus || channel < 0 || !bus->channels) 
+    	struct coro_bus_channel *ch = coro_bus_channel_get(bus, channel);
+	if (ch == NULL)
 		return;
 
-    	struct coro_bus_channel *ch = bus->channels[channel];
-
     	while (!rlist_empty(&ch->send_queue.coros)) {
 		struct wakeup_entry *entry = rlist_first_entry(&ch->send_queue.coros, struct wakeup_entry, base);
 		rlist_del(&entry->base);
@@ -245,8 +1049,14 @@ coro_bus_channel_close(struct coro_bus *bus, int channel)
 		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
     	};
 
-    	free(ch->data.data);
-    	free(ch);
+	while (!rlist_empty(&ch->msg_recv_queue.coros)) {
+		struct wakeup_entry *entry = rlist_first_entry(
+			&ch->msg_recv_queue.coros, struct wakeup_entry, base);
+		rlist_del(&entry->base);
+		coro_wakeup(entry->coro);
+	}
+
+	coro_bus_channel_destroy(bus, ch);
 	bus->channels[channel] = NULL;
 
     	bus->channel_count--;
@@ -259,27 +1069,34 @@ coro_bus_channel_close(struct coro_bus *bus, int channel)
 
 }
 
-int
-coro_bus_send(struct coro_bus *bus, int channel, unsigned data)
-{	
-	if (!bus || channel < 0  || !bus->channels) {
+/** Send with a @a deadline in coro_time() seconds. */
+static int
+coro_bus_send_until(struct coro_bus *bus, int channel, unsigned data,
+	double deadline)
+{
+    	struct coro_bus_channel *ch = coro_bus_channel_get(bus, channel);
+	if (ch == NULL) {
         	coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
         	return -1;
     	};
-
-    	struct coro_bus_channel *ch = bus->channels[channel];
-
-    	while (ch->data.size >= ch->size_limit) {
-        	wakeup_queue_suspend_this(&ch->send_queue);
+	if (ch->mode != CORO_BUS_CHANNEL_LOCAL)
+		return coro_bus_shared_send(ch, data, deadline);
+
+    	while (coro_bus_channel_size(ch) >= ch->size_limit) {
+		if (!wakeup_queue_suspend_this_until(&ch->send_queue,
+						     deadline)) {
+			coro_bus_errno_set(CORO_BUS_ERR_TIMEOUT);
+			return -1;
+		}
 		
-		if (!bus->channels) {
+		if (coro_bus_channel_get(bus, channel) != ch) {
             		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
             		return -1;
         	};
 
 	};
 
-    	ch->data.data[ch->data.size++] = data;
+    	data_ring_push(&ch->data, data);
 
     	if (!rlist_empty(&ch->recv_queue.coros)) 
 		wakeup_queue_wakeup_first(&ch->recv_queue);
@@ -287,22 +1104,36 @@ coro_bus_send(struct coro_bus *bus, int channel, unsigned data)
     	return 0;
 }
 
+int
+coro_bus_send(struct coro_bus *bus, int channel, unsigned data)
+{
+	return coro_bus_send_until(bus, channel, data, INFINITY);
+}
+
+int
+coro_bus_send_timed(struct coro_bus *bus, int channel, unsigned data,
+	double timeout)
+{
+	return coro_bus_send_until(bus, channel, data, coro_time() + timeout);
+}
+
 int
 coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data)
 {
-	if (!bus || channel < 0 || !bus->channels) {
+    	struct coro_bus_channel *ch = coro_bus_channel_get(bus, channel);
+	if (ch == NULL) {
         	coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
         	return -1;
    	};
+	if (ch->mode != CORO_BUS_CHANNEL_LOCAL)
+		return coro_bus_shared_try_send(ch, data);
 
-    	struct coro_bus_channel *ch = bus->channels[channel];
-
-    	if (ch->data.size >= ch->size_limit) {
+    	if (coro_bus_channel_size(ch) >= ch->size_limit) {
         	coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
         	return -1;
     	};
 
-    	ch->data.data[ch->data.size++] = data;
+    	data_ring_push(&ch->data, data);
 
 	if (!rlist_empty(&ch->recv_queue.coros))
     		wakeup_queue_wakeup_first(&ch->recv_queue);
@@ -310,31 +1141,34 @@ coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data)
     	return 0;
 }
 
-int
-coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
-{	
-	
-	if (!bus || channel < 0 || !bus->channels) {
+/** Recv with a @a deadline in coro_time() seconds. */
+static int
+coro_bus_recv_until(struct coro_bus *bus, int channel, unsigned *data,
+	double deadline)
+{
+    	struct coro_bus_channel *ch = coro_bus_channel_get(bus, channel);
+	if (ch == NULL) {
         	coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
         	return -1;
     	};
+	if (ch->mode != CORO_BUS_CHANNEL_LOCAL)
+		return coro_bus_shared_recv(ch, data, deadline);
+
+    	while (data_ring_size(&ch->data) == 0) {
+		if (!wakeup_queue_suspend_this_until(&ch->recv_queue,
+						     deadline)) {
+			coro_bus_errno_set(CORO_BUS_ERR_TIMEOUT);
+			return -1;
+		}
 		
-    	struct coro_bus_channel *ch = bus->channels[channel];
-
-    	while (ch->data.size == 0) {
-       		wakeup_queue_suspend_this(&ch->recv_queue);
-		
-		if (!bus->channels) {
+		if (coro_bus_channel_get(bus, channel) != ch) {
             		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
             		return -1;
         	};
 
     	};
 
-    	*data = ch->data.data[0];
-	if (ch->data.size > 1)
-    		memmove(&ch->data.data[0], &ch->data.data[1], (ch->data.size - 1) * sizeof(unsigned));
-	ch->data.size--;
+	*data = data_ring_pop(&ch->data);
 
     	if (!rlist_empty(&ch->send_queue.coros))
         	wakeup_queue_wakeup_first(&ch->send_queue);
@@ -342,28 +1176,37 @@ coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
     	return 0;
 }
 
+int
+coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
+{
+	return coro_bus_recv_until(bus, channel, data, INFINITY);
+}
+
+int
+coro_bus_recv_timed(struct coro_bus *bus, int channel, unsigned *data,
+	double timeout)
+{
+	return coro_bus_recv_until(bus, channel, data, coro_time() + timeout);
+}
+
 int
 coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data) 
 {
 	
-	if (!bus || channel < 0 || !bus->channels) {
+   	struct coro_bus_channel *ch = coro_bus_channel_get(bus, channel);
+	if (ch == NULL) {
         	coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
         	return -1;
    	};
-	
-
-   	struct coro_bus_channel *ch = bus->channels[channel];
+	if (ch->mode != CORO_BUS_CHANNEL_LOCAL)
+		return coro_bus_shared_try_recv(ch, data);
 
-    	if (ch->data.size == 0) {
+    	if (data_ring_size(&ch->data) == 0) {
         	coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
 	    	return -1;
     	};
 
-	*data = ch->data.data[0];
-	if (ch->data.size > 1) {
-    		memmove(&ch->data.data[0], &ch->data.data[1], (ch->data.size - 1) * sizeof(unsigned));
-	};
-	ch->data.size--;
+	*data = data_ring_pop(&ch->data);
 
 	if (!rlist_empty(&ch->send_queue.coros))
         	wakeup_queue_wakeup_first(&ch->send_queue);
@@ -372,6 +1215,527 @@ coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data)
 }
 
 
+void *
+coro_bus_msg_alloc(struct coro_bus *bus, size_t size)
+{
+	return bus_slab_alloc(&bus->slab, size);
+}
+
+void
+coro_bus_msg_free(struct coro_bus *bus, void *data, size_t size)
+{
+	bus_slab_free(&bus->slab, data, size);
+}
+
+/**
+ * Find a local channel for a payload operation. The payload ring
+ * is created on demand, so the channels never carrying payloads
+ * don't pay for it.
+ */
+static struct coro_bus_channel *
+coro_bus_msg_channel_get(struct coro_bus *bus, int channel)
+{
+	struct coro_bus_channel *ch = coro_bus_channel_get(bus, channel);
+	if (ch == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return NULL;
+	}
+	if (ch->mode != CORO_BUS_CHANNEL_LOCAL) {
+		coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+		return NULL;
+	}
+	if (ch->msgs.msgs == NULL &&
+	    msg_ring_create(&ch->msgs, ch->data.mask + 1) != 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return NULL;
+	}
+	return ch;
+}
+
+int
+coro_bus_send_msg(struct coro_bus *bus, int channel,
+	const struct coro_bus_msg *msg)
+{
+	struct coro_bus_channel *ch = coro_bus_msg_channel_get(bus, channel);
+	if (ch == NULL)
+		return -1;
+	while (coro_bus_channel_size(ch) >= ch->size_limit) {
+		wakeup_queue_suspend_this(&ch->send_queue);
+		if (coro_bus_channel_get(bus, channel) != ch) {
+			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+			return -1;
+		}
+	}
+	msg_ring_push(&ch->msgs, msg);
+	wakeup_queue_wakeup_first(&ch->msg_recv_queue);
+	return 0;
+}
+
+int
+coro_bus_try_send_msg(struct coro_bus *bus, int channel,
+	const struct coro_bus_msg *msg)
+{
+	struct coro_bus_channel *ch = coro_bus_msg_channel_get(bus, channel);
+	if (ch == NULL)
+		return -1;
+	if (coro_bus_channel_size(ch) >= ch->size_limit) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	msg_ring_push(&ch->msgs, msg);
+	wakeup_queue_wakeup_first(&ch->msg_recv_queue);
+	return 0;
+}
+
+int
+coro_bus_recv_msg(struct coro_bus *bus, int channel, struct coro_bus_msg *msg)
+{
+	struct coro_bus_channel *ch = coro_bus_msg_channel_get(bus, channel);
+	if (ch == NULL)
+		return -1;
+	while (msg_ring_size(&ch->msgs) == 0) {
+		wakeup_queue_suspend_this(&ch->msg_recv_queue);
+		if (coro_bus_channel_get(bus, channel) != ch) {
+			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+			return -1;
+		}
+	}
+	msg_ring_pop(&ch->msgs, msg);
+	wakeup_queue_wakeup_first(&ch->send_queue);
+	return 0;
+}
+
+int
+coro_bus_try_recv_msg(struct coro_bus *bus, int channel,
+	struct coro_bus_msg *msg)
+{
+	struct coro_bus_channel *ch = coro_bus_msg_channel_get(bus, channel);
+	if (ch == NULL)
+		return -1;
+	if (msg_ring_size(&ch->msgs) == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	msg_ring_pop(&ch->msgs, msg);
+	wakeup_queue_wakeup_first(&ch->send_queue);
+	return 0;
+}
+
+static struct coro_bus_topic *
+coro_bus_topic_get(struct coro_bus *bus, int topic)
+{
+	if (bus == NULL || topic < 0 || topic >= bus->max_topic_count)
+		return NULL;
+	return bus->topics[topic];
+}
+
+static struct coro_bus_subscriber *
+coro_bus_subscriber_get(struct coro_bus_topic *t, int sub)
+{
+	if (sub < 0 || sub >= t->max_sub_count || !t->subs[sub].is_active)
+		return NULL;
+	return &t->subs[sub];
+}
+
+int
+coro_bus_topic_open(struct coro_bus *bus, size_t size_limit,
+	enum coro_bus_topic_policy policy)
+{
+	if (bus == NULL || size_limit == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	int index = 0;
+	while (index < bus->max_topic_count && bus->topics[index] != NULL)
+		++index;
+	if (index == bus->max_topic_count) {
+		struct coro_bus_topic **topics = realloc(bus->topics,
+			(index + 1) * sizeof(*topics));
+		if (topics == NULL) {
+			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+			return -1;
+		}
+		topics[index] = NULL;
+		bus->topics = topics;
+		++bus->max_topic_count;
+	}
+	struct coro_bus_topic *t = calloc(1, sizeof(*t));
+	size_t capacity = 1;
+	while (capacity < size_limit)
+		capacity <<= 1;
+	if (t != NULL) {
+		t->data = malloc(capacity * sizeof(t->data[0]));
+		t->refs = malloc(capacity * sizeof(t->refs[0]));
+	}
+	if (t == NULL || t->data == NULL || t->refs == NULL) {
+		if (t != NULL) {
+			free(t->data);
+			free(t->refs);
+		}
+		free(t);
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	t->size_limit = size_limit;
+	t->policy = policy;
+	t->mask = capacity - 1;
+	rlist_create(&t->publish_queue.coros);
+	rlist_create(&t->recv_queue.coros);
+	bus->topics[index] = t;
+	return index;
+}
+
+/**
+ * Wakeup all the coroutines in the queue. They are unlinked, so
+ * each one is woken once, and until they wait again the next
+ * wakeups find the queue empty and cost nothing.
+ */
+static void
+wakeup_queue_wakeup_all(struct wakeup_queue *queue)
+{
+	while (!rlist_empty(&queue->coros)) {
+		struct wakeup_entry *entry = rlist_shift_entry(
+			&queue->coros, struct wakeup_entry, base);
+		coro_wakeup(entry->coro);
+	}
+}
+
+void
+coro_bus_topic_close(struct coro_bus *bus, int topic)
+{
+	struct coro_bus_topic *t = coro_bus_topic_get(bus, topic);
+	if (t == NULL)
+		return;
+	/*
+	 * The woken up coros see that the topic is gone. They are
+	 * unlinked, because the queues are freed right now.
+	 */
+	wakeup_queue_wakeup_all(&t->publish_queue);
+	wakeup_queue_wakeup_all(&t->recv_queue);
+	free(t->data);
+	free(t->refs);
+	free(t->subs);
+	free(t);
+	bus->topics[topic] = NULL;
+}
+
+int
+coro_bus_subscribe(struct coro_bus *bus, int topic)
+{
+	struct coro_bus_topic *t = coro_bus_topic_get(bus, topic);
+	if (t == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	int sub = 0;
+	while (sub < t->max_sub_count && t->subs[sub].is_active)
+		++sub;
+	if (sub == t->max_sub_count) {
+		int count = t->max_sub_count == 0 ? 4 : t->max_sub_count * 2;
+		struct coro_bus_subscriber *subs = realloc(t->subs,
+			count * sizeof(*subs));
+		if (subs == NULL) {
+			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+			return -1;
+		}
+		for (int i = t->max_sub_count; i < count; ++i)
+			subs[i].is_active = false;
+		t->subs = subs;
+		t->max_sub_count = count;
+	}
+	/* Only the messages published after the subscription are seen. */
+	t->subs[sub].cursor = t->tail;
+	t->subs[sub].is_active = true;
+	++t->sub_count;
+	return sub;
+}
+
+/**
+ * Forget the messages not needed by anyone. If that freed space,
+ * a blocked publisher can continue.
+ */
+static void
+coro_bus_topic_advance_head(struct coro_bus_topic *t)
+{
+	size_t old_head = t->head;
+	while (t->head < t->tail && t->refs[t->head & t->mask] == 0)
+		++t->head;
+	if (t->head != old_head)
+		wakeup_queue_wakeup_first(&t->publish_queue);
+}
+
+/** Drop the reference of a subscriber to the message @a seq. */
+static inline void
+coro_bus_topic_unref(struct coro_bus_topic *t, size_t seq)
+{
+	if (t->policy == CORO_BUS_TOPIC_OVERWRITE)
+		return;
+	unsigned *refs = &t->refs[seq & t->mask];
+	assert(*refs > 0);
+	if (--*refs == 0 && seq == t->head)
+		coro_bus_topic_advance_head(t);
+}
+
+void
+coro_bus_unsubscribe(struct coro_bus *bus, int topic, int sub)
+{
+	struct coro_bus_topic *t = coro_bus_topic_get(bus, topic);
+	if (t == NULL)
+		return;
+	struct coro_bus_subscriber *s = coro_bus_subscriber_get(t, sub);
+	if (s == NULL)
+		return;
+	if (t->policy != CORO_BUS_TOPIC_OVERWRITE) {
+		for (size_t seq = s->cursor; seq < t->tail; ++seq)
+			coro_bus_topic_unref(t, seq);
+	}
+	s->is_active = false;
+	--t->sub_count;
+}
+
+/** Check if a publish would have to wait or drop the message. */
+static inline bool
+coro_bus_topic_is_full(const struct coro_bus_topic *t)
+{
+	return t->policy != CORO_BUS_TOPIC_OVERWRITE &&
+		t->tail - t->head >= t->size_limit;
+}
+
+static void
+coro_bus_topic_push(struct coro_bus_topic *t, unsigned data)
+{
+	size_t seq = t->tail++;
+	t->data[seq & t->mask] = data;
+	if (t->policy == CORO_BUS_TOPIC_OVERWRITE) {
+		if (t->tail - t->head > t->size_limit)
+			t->head = t->tail - t->size_limit;
+	} else {
+		t->refs[seq & t->mask] = t->sub_count;
+		if (t->sub_count == 0 && seq == t->head)
+			++t->head;
+	}
+	wakeup_queue_wakeup_all(&t->recv_queue);
+}
+
+int
+coro_bus_publish(struct coro_bus *bus, int topic, unsigned data)
+{
+	struct coro_bus_topic *t = coro_bus_topic_get(bus, topic);
+	if (t == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	while (coro_bus_topic_is_full(t)) {
+		if (t->policy == CORO_BUS_TOPIC_DROP) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		wakeup_queue_suspend_this(&t->publish_queue);
+		if (coro_bus_topic_get(bus, topic) != t) {
+			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+			return -1;
+		}
+	}
+	coro_bus_topic_push(t, data);
+	return 0;
+}
+
+int
+coro_bus_try_publish(struct coro_bus *bus, int topic, unsigned data)
+{
+	struct coro_bus_topic *t = coro_bus_topic_get(bus, topic);
+	if (t == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	if (coro_bus_topic_is_full(t)) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	coro_bus_topic_push(t, data);
+	return 0;
+}
+
+/** Take the next message of a subscriber, if there is one. */
+static bool
+coro_bus_topic_pop(struct coro_bus_topic *t, struct coro_bus_subscriber *s,
+	unsigned *data)
+{
+	/* Overwrite policy: a slow subscriber skips the lost messages. */
+	if (s->cursor < t->head)
+		s->cursor = t->head;
+	if (s->cursor == t->tail)
+		return false;
+	size_t seq = s->cursor++;
+	*data = t->data[seq & t->mask];
+	coro_bus_topic_unref(t, seq);
+	return true;
+}
+
+int
+coro_bus_topic_recv(struct coro_bus *bus, int topic, int sub, unsigned *data)
+{
+	struct coro_bus_topic *t = coro_bus_topic_get(bus, topic);
+	struct coro_bus_subscriber *s;
+	while (true) {
+		if (t == NULL || (s = coro_bus_subscriber_get(t, sub)) == NULL) {
+			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+			return -1;
+		}
+		if (coro_bus_topic_pop(t, s, data))
+			return 0;
+		wakeup_queue_suspend_this(&t->recv_queue);
+		if (coro_bus_topic_get(bus, topic) != t)
+			t = NULL;
+	}
+}
+
+int
+coro_bus_topic_try_recv(struct coro_bus *bus, int topic, int sub,
+	unsigned *data)
+{
+	struct coro_bus_topic *t = coro_bus_topic_get(bus, topic);
+	struct coro_bus_subscriber *s;
+	if (t == NULL || (s = coro_bus_subscriber_get(t, sub)) == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	if (!coro_bus_topic_pop(t, s, data)) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	return 0;
+}
+
+/** Find the channels of all the select cases. */
+static int
+coro_bus_select_channels(struct coro_bus *bus,
+	const struct coro_bus_select_case *cases, unsigned count,
+	struct coro_bus_channel **chs)
+{
+	for (unsigned i = 0; i < count; ++i) {
+		chs[i] = coro_bus_channel_get(bus, cases[i].channel);
+		if (chs[i] == NULL) {
+			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+			return -1;
+		}
+		if (chs[i]->mode != CORO_BUS_CHANNEL_LOCAL) {
+			coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static inline bool
+coro_bus_select_is_ready(const struct coro_bus_channel *ch,
+	const struct coro_bus_select_case *c)
+{
+	if (c->op == CORO_BUS_SELECT_RECV)
+		return data_ring_size(&ch->data) > 0;
+	return coro_bus_channel_size(ch) < ch->size_limit;
+}
+
+/** Complete the first ready case starting from @a start. */
+static int
+coro_bus_select_one(struct coro_bus_channel **chs,
+	struct coro_bus_select_case *cases, unsigned count, unsigned start)
+{
+	for (unsigned k = 0; k < count; ++k) {
+		unsigned i = start + k;
+		if (i >= count)
+			i -= count;
+		struct coro_bus_channel *ch = chs[i];
+		if (!coro_bus_select_is_ready(ch, &cases[i]))
+			continue;
+		if (cases[i].op == CORO_BUS_SELECT_RECV) {
+			cases[i].data = data_ring_pop(&ch->data);
+			wakeup_queue_wakeup_first(&ch->send_queue);
+		} else {
+			data_ring_push(&ch->data, cases[i].data);
+			wakeup_queue_wakeup_first(&ch->recv_queue);
+		}
+		return i;
+	}
+	return -1;
+}
+
+static inline struct wakeup_queue *
+coro_bus_select_queue(struct coro_bus_channel *ch,
+	const struct coro_bus_select_case *c)
+{
+	return c->op == CORO_BUS_SELECT_RECV ? &ch->recv_queue :
+		&ch->send_queue;
+}
+
+int
+coro_bus_select(struct coro_bus *bus, struct coro_bus_select_case *cases,
+	unsigned count, bool is_fair)
+{
+	if (bus == NULL || count == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	struct coro_bus_channel *chs[count];
+	if (coro_bus_select_channels(bus, cases, count, chs) != 0)
+		return -1;
+	unsigned start = is_fair ? bus->select_seq++ % count : 0;
+	int res = coro_bus_select_one(chs, cases, count, start);
+	if (res >= 0)
+		return res;
+
+	struct wakeup_entry entries[count];
+	while (true) {
+		for (unsigned i = 0; i < count; ++i) {
+			entries[i].coro = coro_this();
+			rlist_add_tail_entry(
+				&coro_bus_select_queue(chs[i], &cases[i])->coros,
+				&entries[i], base);
+		}
+		coro_suspend();
+		/* A closed channel has unlinked its entry already. */
+		for (unsigned i = 0; i < count; ++i)
+			rlist_del_entry(&entries[i], base);
+		for (unsigned i = 0; i < count; ++i) {
+			if (coro_bus_channel_get(bus, cases[i].channel) != chs[i]) {
+				coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+				return -1;
+			}
+		}
+		res = coro_bus_select_one(chs, cases, count, start);
+		if (res >= 0)
+			break;
+	}
+	/*
+	 * The wakeups for the other ready cases could be meant for
+	 * other waiters, but were taken by this select. Pass them on.
+	 */
+	for (unsigned i = 0; i < count; ++i) {
+		if ((int)i != res && coro_bus_select_is_ready(chs[i], &cases[i]))
+			wakeup_queue_wakeup_first(
+				coro_bus_select_queue(chs[i], &cases[i]));
+	}
+	return res;
+}
+
+int
+coro_bus_try_select(struct coro_bus *bus, struct coro_bus_select_case *cases,
+	unsigned count, bool is_fair)
+{
+	if (bus == NULL || count == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	struct coro_bus_channel *chs[count];
+	if (coro_bus_select_channels(bus, cases, count, chs) != 0)
+		return -1;
+	unsigned start = is_fair ? bus->select_seq++ % count : 0;
+	int res = coro_bus_select_one(chs, cases, count, start);
+	if (res < 0)
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+	return res;
+}
+
 #if NEED_BROADCAST
 
 int
@@ -393,8 +1757,12 @@ coro_bus_broadcast(struct coro_bus *bus, unsigned data)
 				continue;
 			
             		struct coro_bus_channel *ch = bus->channels[i];
+			if (ch->mode != CORO_BUS_CHANNEL_LOCAL) {
+				coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+				return -1;
+			}
 
-            		if (ch->data.size >= ch->size_limit) {
+            		if (coro_bus_channel_size(ch) >= ch->size_limit) {
                 		can_send_all = 0;
                 		wakeup_queue_suspend_this(&ch->send_queue);
 
@@ -418,7 +1786,7 @@ coro_bus_broadcast(struct coro_bus *bus, unsigned data)
 		
         	struct coro_bus_channel *ch = bus->channels[i];
 
-        	ch->data.data[ch->data.size++] = data;
+        	data_ring_push(&ch->data, data);
         	sent++;
 
         	if (!rlist_empty(&ch->recv_queue.coros))
@@ -442,8 +1810,12 @@ coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
         	
 		if (!bus->channels[i]) 
 			continue;
+		if (bus->channels[i]->mode != CORO_BUS_CHANNEL_LOCAL) {
+			coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+			return -1;
+		}
 
-        	if (bus->channels[i]->data.size >= bus->channels[i]->size_limit) {
+        	if (coro_bus_channel_size(bus->channels[i]) >= bus->channels[i]->size_limit) {
             		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
             		return -1;
         	};
@@ -457,7 +1829,7 @@ coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
 		
         	struct coro_bus_channel *ch = bus->channels[i];
 
-        	ch->data.data[ch->data.size++] = data;
+        	data_ring_push(&ch->data, data);
         	sent++;
 
         	if (!rlist_empty(&ch->recv_queue.coros))
@@ -471,52 +1843,228 @@ coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
 
 #if NEED_BATCH
 
+/**
+ * Wakeup up to @a count first coroutines in the queue. They are
+ * unlinked, so each one takes a separate wakeup, and the next
+ * wakeup goes to somebody else even if they haven't run yet.
+ */
+static void
+wakeup_queue_wakeup_many(struct wakeup_queue *queue, unsigned count)
+{
+	while (count-- > 0 && !rlist_empty(&queue->coros)) {
+		struct wakeup_entry *entry = rlist_shift_entry(
+			&queue->coros, struct wakeup_entry, base);
+		coro_wakeup(entry->coro);
+	}
+}
+
+/**
+ * Same as shared_wakeup_queue_wakeup_first(), but for up to
+ * @a count coroutines under one lock.
+ */
+static void
+shared_wakeup_queue_wakeup_many(struct shared_wakeup_queue *queue,
+	unsigned count)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&queue->count, __ATOMIC_RELAXED) == 0)
+		return;
+	pthread_mutex_lock(&queue->lock);
+	while (count-- > 0 && !rlist_empty(&queue->coros)) {
+		struct shared_wakeup_entry *entry = rlist_shift_entry(
+			&queue->coros, struct shared_wakeup_entry, base);
+		__atomic_sub_fetch(&queue->count, 1, __ATOMIC_RELAXED);
+		shared_wakeup_entry_wakeup(entry);
+	}
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Send as many messages as fit into a local channel which is not
+ * full. A batch wakes up a receiver per message, because a plain
+ * recv takes only one and doesn't pass the wakeup on. The next
+ * sender is woken up only if the batch didn't use all the space,
+ * otherwise it would find the channel full anyway.
+ */
+static int
+coro_bus_local_send_v(struct coro_bus_channel *ch, const unsigned *data,
+	unsigned count)
+{
+	size_t space = ch->size_limit - coro_bus_channel_size(ch);
+	assert(space > 0);
+	if (count > space)
+		count = space;
+	data_ring_push_many(&ch->data, data, count);
+	wakeup_queue_wakeup_many(&ch->recv_queue, count);
+	if (count < space)
+		wakeup_queue_wakeup_first(&ch->send_queue);
+	return count;
+}
+
+/**
+ * Receive as many messages as there are in a non-empty channel.
+ * Wakes up a sender per freed slot, same as send-v does for the
+ * receivers.
+ */
+static int
+coro_bus_local_recv_v(struct coro_bus_channel *ch, unsigned *data,
+	unsigned capacity)
+{
+	size_t size = data_ring_size(&ch->data);
+	assert(size > 0);
+	if (capacity > size)
+		capacity = size;
+	data_ring_pop_many(&ch->data, data, capacity);
+	wakeup_queue_wakeup_many(&ch->send_queue, capacity);
+	if (capacity < size)
+		wakeup_queue_wakeup_first(&ch->recv_queue);
+	return capacity;
+}
+
+/**
+ * Batch send into a shared channel. The lock-free rings have no
+ * bulk copy, but the wakeups are done under one lock, the same
+ * way as for the local channels.
+ */
+static int
+coro_bus_shared_send_v(struct coro_bus_channel *ch, const unsigned *data,
+	unsigned count, bool is_blocking)
+{
+	unsigned sent = 0;
+	while (true) {
+		while (sent < count && coro_bus_channel_push(ch, data[sent]))
+			++sent;
+		if (sent > 0 || count == 0)
+			break;
+		if (!is_blocking) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		struct shared_wakeup_entry entry;
+		shared_wakeup_queue_add(&ch->send_waiters, &entry);
+		shared_wakeup_queue_wait(&ch->send_waiters, &entry,
+			shared_ring_can_push(&ch->ring), INFINITY);
+		if (entry.is_closed) {
+			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+			return -1;
+		}
+	}
+	shared_wakeup_queue_wakeup_many(&ch->recv_waiters, sent);
+	if (sent == count && shared_ring_can_push(&ch->ring))
+		shared_wakeup_queue_wakeup_first(&ch->send_waiters);
+	return sent;
+}
+
+static int
+coro_bus_shared_recv_v(struct coro_bus_channel *ch, unsigned *data,
+	unsigned capacity, bool is_blocking)
+{
+	unsigned received = 0;
+	while (true) {
+		while (received < capacity &&
+		       coro_bus_channel_pop(ch, &data[received]))
+			++received;
+		if (received > 0 || capacity == 0)
+			break;
+		if (!is_blocking) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		struct shared_wakeup_entry entry;
+		shared_wakeup_queue_add(&ch->recv_waiters, &entry);
+		shared_wakeup_queue_wait(&ch->recv_waiters, &entry,
+			shared_ring_can_pop(&ch->ring), INFINITY);
+		if (entry.is_closed) {
+			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+			return -1;
+		}
+	}
+	shared_wakeup_queue_wakeup_many(&ch->send_waiters, received);
+	if (received == capacity && shared_ring_can_pop(&ch->ring))
+		shared_wakeup_queue_wakeup_first(&ch->recv_waiters);
+	return received;
+}
+
 int
 coro_bus_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	(void)count;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	struct coro_bus_channel *ch = coro_bus_channel_get(bus, channel);
+	if (ch == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	if (ch->mode != CORO_BUS_CHANNEL_LOCAL)
+		return coro_bus_shared_send_v(ch, data, count, true);
+	if (count == 0)
+		return 0;
+	while (coro_bus_channel_size(ch) >= ch->size_limit) {
+		wakeup_queue_suspend_this(&ch->send_queue);
+		if (coro_bus_channel_get(bus, channel) != ch) {
+			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+			return -1;
+		}
+	}
+	return coro_bus_local_send_v(ch, data, count);
 }
 
 int
 coro_bus_try_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	(void)count;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	struct coro_bus_channel *ch = coro_bus_channel_get(bus, channel);
+	if (ch == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	if (ch->mode != CORO_BUS_CHANNEL_LOCAL)
+		return coro_bus_shared_send_v(ch, data, count, false);
+	if (count == 0)
+		return 0;
+	if (coro_bus_channel_size(ch) >= ch->size_limit) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	return coro_bus_local_send_v(ch, data, count);
 }
 
 int
 coro_bus_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	(void)capacity;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	struct coro_bus_channel *ch = coro_bus_channel_get(bus, channel);
+	if (ch == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	if (ch->mode != CORO_BUS_CHANNEL_LOCAL)
+		return coro_bus_shared_recv_v(ch, data, capacity, true);
+	if (capacity == 0)
+		return 0;
+	while (data_ring_size(&ch->data) == 0) {
+		wakeup_queue_suspend_this(&ch->recv_queue);
+		if (coro_bus_channel_get(bus, channel) != ch) {
+			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+			return -1;
+		}
+	}
+	return coro_bus_local_recv_v(ch, data, capacity);
 }
 
 int
 coro_bus_try_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	(void)capacity;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	struct coro_bus_channel *ch = coro_bus_channel_get(bus, channel);
+	if (ch == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	if (ch->mode != CORO_BUS_CHANNEL_LOCAL)
+		return coro_bus_shared_recv_v(ch, data, capacity, false);
+	if (capacity == 0)
+		return 0;
+	if (data_ring_size(&ch->data) == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	return coro_bus_local_recv_v(ch, data, capacity);
 }
 
 #endif
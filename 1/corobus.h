@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 
 /**
@@ -8,18 +9,34 @@
  * header, because it is used by tests.
  */
 #define NEED_BROADCAST 1
-#define NEED_BATCH 0
+#define NEED_BATCH 1
 
 enum coro_bus_error_code {
 	CORO_BUS_ERR_NONE = 0,
 	CORO_BUS_ERR_NO_CHANNEL,
 	CORO_BUS_ERR_WOULD_BLOCK,
 	CORO_BUS_ERR_NOT_IMPLEMENTED,
+	CORO_BUS_ERR_TIMEOUT,
+};
+
+/**
+ * How a channel can be used. A local channel can be used only by
+ * the coroutines of one thread. The shared channels can be used
+ * by the coroutines of any threads, and by the try-functions from
+ * any thread. Their messages are kept in a lock-free ring, and
+ * their size limit is rounded up to a power of two, at least 2.
+ */
+enum coro_bus_channel_mode {
+	CORO_BUS_CHANNEL_LOCAL = 0,
+	/** Single sender thread and single receiver thread. */
+	CORO_BUS_CHANNEL_SPSC,
+	/** Any number of sender and receiver threads. */
+	CORO_BUS_CHANNEL_MPMC,
 };
 
 struct coro_bus;
 
-/** Get the latest error happened in coro_bus. */
+/** Get the latest error happened in coro_bus in this thread. */
 enum coro_bus_error_code
 coro_bus_errno(void);
 
@@ -63,6 +80,19 @@ create_channel(struct coro_bus *bus, size_t index, size_t size_limit);
 int
 coro_bus_channel_open(struct coro_bus *bus, size_t size_limit);
 
+/**
+ * Same as coro_bus_channel_open(), but the channel can be shared
+ * between threads depending on the @a mode. The coroutines
+ * blocked on a shared channel are woken up by the other threads
+ * via coro_wakeup(), without polling. Opening and closing of the
+ * channels is not thread-safe, and a shared channel can be closed
+ * only when the only other users are the suspended coroutines.
+ * Broadcast doesn't work when the bus has shared channels.
+ */
+int
+coro_bus_channel_open_mode(struct coro_bus *bus, size_t size_limit,
+	enum coro_bus_channel_mode mode);
+
 /**
  * Destroy the channel identified by the given descriptor. The
  * channel must exist. All pending messages of the channel are
@@ -89,6 +119,19 @@ coro_bus_channel_close(struct coro_bus *bus, int channel);
 int
 coro_bus_send(struct coro_bus *bus, int channel, unsigned data);
 
+/**
+ * Same as coro_bus_send(), but waits for free space in the
+ * channel for at most @a timeout seconds.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_TIMEOUT - the channel stayed full.
+ */
+int
+coro_bus_send_timed(struct coro_bus *bus, int channel, unsigned data,
+	double timeout);
+
 /**
  * Same as coro_bus_send(), but if the channel is full, the
  * function immediately returns. It never suspends the current
@@ -121,6 +164,20 @@ coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data);
 int
 coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data);
 
+/**
+ * Same as coro_bus_recv(), but waits for a message for at most
+ * @a timeout seconds.
+ *
+ * @retval 0 Success. Data output is filled with the received
+ *     message.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_TIMEOUT - the channel stayed empty.
+ */
+int
+coro_bus_recv_timed(struct coro_bus *bus, int channel, unsigned *data,
+	double timeout);
+
 /**
  * Same as coro_bus_recv(), but if the channel is empty, the
  * function immediately returns. It never suspends the current
@@ -139,6 +196,254 @@ int
 coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data);
 
 
+/**
+ * Payload message. The buffer isn't copied, its ownership moves
+ * from the sender to the channel and then to the receiver.
+ */
+struct coro_bus_msg {
+	void *data;
+	size_t size;
+	/**
+	 * Frees the buffer if the message is never received, when
+	 * its channel or bus is deleted. Can be NULL. The receiver
+	 * is free to use it too.
+	 */
+	void (*destroy)(struct coro_bus *bus, void *data, size_t size);
+};
+
+/**
+ * Allocate a payload buffer from the bus. Small buffers are taken
+ * from the bus' slab allocator without malloc() calls, once the
+ * slabs are warmed up. The bus must outlive the buffer.
+ * @retval NULL Out of memory.
+ */
+void *
+coro_bus_msg_alloc(struct coro_bus *bus, size_t size);
+
+/**
+ * Free a buffer allocated by coro_bus_msg_alloc(). Can be used as
+ * a payload destructor.
+ */
+void
+coro_bus_msg_free(struct coro_bus *bus, void *data, size_t size);
+
+/**
+ * Same as coro_bus_send(), but sends a payload. The payloads and
+ * the plain messages share the channel's size limit, but are
+ * received separately. Only the local channels support payloads.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to send data to.
+ * @param msg Payload to send. On success the channel owns it.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - the channel is shared.
+ */
+int
+coro_bus_send_msg(struct coro_bus *bus, int channel,
+	const struct coro_bus_msg *msg);
+
+/**
+ * Same as coro_bus_send_msg(), but fails instantly if the
+ * channel is full.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - the channel is shared.
+ */
+int
+coro_bus_try_send_msg(struct coro_bus *bus, int channel,
+	const struct coro_bus_msg *msg);
+
+/**
+ * Same as coro_bus_recv(), but receives a payload.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to recv data from.
+ * @param msg Output parameter to save the payload to. The caller
+ *     owns it then.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - the channel is shared.
+ */
+int
+coro_bus_recv_msg(struct coro_bus *bus, int channel, struct coro_bus_msg *msg);
+
+/**
+ * Same as coro_bus_recv_msg(), but fails instantly if there are
+ * no payloads in the channel.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - no payloads in the channel.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - the channel is shared.
+ */
+int
+coro_bus_try_recv_msg(struct coro_bus *bus, int channel,
+	struct coro_bus_msg *msg);
+
+/**
+ * What happens when a topic is full, because its slowest
+ * subscriber didn't read size_limit messages yet.
+ */
+enum coro_bus_topic_policy {
+	/** Publish fails with CORO_BUS_ERR_WOULD_BLOCK. */
+	CORO_BUS_TOPIC_DROP = 0,
+	/** Publish waits until the slowest subscriber reads. */
+	CORO_BUS_TOPIC_BLOCK,
+	/**
+	 * Publish never waits, the oldest message is overwritten.
+	 * The subscribers which didn't read it skip it.
+	 */
+	CORO_BUS_TOPIC_OVERWRITE,
+};
+
+/**
+ * Open a topic. Unlike the channel broadcast, a message published
+ * into a topic is stored once, and each subscriber reads it via
+ * its own cursor. So publish takes constant time regardless of
+ * the subscriber count. Topics have their own descriptors,
+ * independent of the channels.
+ * @param bus Bus to create the topic in.
+ * @param size_limit How many messages the slowest subscriber can
+ *     lag behind.
+ * @param policy What to do when a subscriber lags too much.
+ *
+ * @retval >=0 Descriptor of the topic.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ */
+int
+coro_bus_topic_open(struct coro_bus *bus, size_t size_limit,
+	enum coro_bus_topic_policy policy);
+
+/**
+ * Destroy the topic. The coroutines suspended on it are woken up
+ * and get the error that the channel is missing.
+ */
+void
+coro_bus_topic_close(struct coro_bus *bus, int topic);
+
+/**
+ * Subscribe to a topic. The subscriber sees the messages published
+ * after this call.
+ * @retval >=0 Descriptor of the subscriber in this topic.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the topic doesn't exist.
+ */
+int
+coro_bus_subscribe(struct coro_bus *bus, int topic);
+
+/**
+ * Unsubscribe from a topic. The messages not read by the
+ * subscriber are released, which can unblock the publishers.
+ */
+void
+coro_bus_unsubscribe(struct coro_bus *bus, int topic, int sub);
+
+/**
+ * Publish a message to all the subscribers of the topic. When the
+ * topic is full, the behaviour depends on its policy.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the topic doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the topic is full, drop policy.
+ */
+int
+coro_bus_publish(struct coro_bus *bus, int topic, unsigned data);
+
+/**
+ * Same as coro_bus_publish(), but never suspends.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the topic doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the topic is full.
+ */
+int
+coro_bus_try_publish(struct coro_bus *bus, int topic, unsigned data);
+
+/**
+ * Receive the next message of a subscriber. If there is none, the
+ * coroutine is suspended until a message is published.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - no such topic or subscriber.
+ */
+int
+coro_bus_topic_recv(struct coro_bus *bus, int topic, int sub, unsigned *data);
+
+/**
+ * Same as coro_bus_topic_recv(), but never suspends.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - no such topic or subscriber.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - no new messages.
+ */
+int
+coro_bus_topic_try_recv(struct coro_bus *bus, int topic, int sub,
+	unsigned *data);
+
+enum coro_bus_select_op {
+	CORO_BUS_SELECT_RECV = 0,
+	CORO_BUS_SELECT_SEND,
+};
+
+/** One of the operations a select waits for. */
+struct coro_bus_select_case {
+	int channel;
+	enum coro_bus_select_op op;
+	/** Message to send, or the received message. */
+	unsigned data;
+};
+
+/**
+ * Wait until any of the send or recv operations can be done, and
+ * do exactly one of them. The coroutine waits in the queues of
+ * all the channels at once. Only the local channels are
+ * supported.
+ * @param bus Bus where the channels are located.
+ * @param cases The operations. The recv ones get their data
+ *     filled in.
+ * @param count Size of @a cases.
+ * @param is_fair If false, the first ready case in the array is
+ *     done. If true, the checks start from a different case on
+ *     each call, so a busy channel can't starve the others.
+ *
+ * @retval >=0 Index of the done case.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - any of the channels doesn't
+ *       exist or is closed during the wait.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - any of the channels is
+ *       shared.
+ */
+int
+coro_bus_select(struct coro_bus *bus, struct coro_bus_select_case *cases,
+	unsigned count, bool is_fair);
+
+/**
+ * Same as coro_bus_select(), but fails instantly if none of the
+ * cases is ready.
+ *
+ * @retval >=0 Index of the done case.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - any of the channels doesn't
+ *       exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - none of the cases is ready.
+ *     - CORO_BUS_ERR_NOT_IMPLEMENTED - any of the channels is
+ *       shared.
+ */
+int
+coro_bus_try_select(struct coro_bus *bus, struct coro_bus_select_case *cases,
+	unsigned count, bool is_fair);
+
 #if NEED_BROADCAST /* Bonus 1 */
 
 /**
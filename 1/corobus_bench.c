@@ -0,0 +1,224 @@
+#include "corobus.h"
+#include "libcoro.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/**
+ * Throughput of the bus channels at different depths. Each round
+ * fills a channel up to its limit and then drains it, so every
+ * message travels through a queue of the given depth. Then the
+ * blocking per-message path is compared with the batch API.
+ */
+
+enum {
+	BENCH_MSG_COUNT = 1 << 24,
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+bench_depth(struct coro_bus *bus, size_t depth)
+{
+	int c = coro_bus_channel_open(bus, depth);
+	size_t rounds = BENCH_MSG_COUNT / depth;
+	if (rounds == 0)
+		rounds = 1;
+	unsigned sum = 0;
+	uint64_t start = bench_now_ns();
+	for (size_t r = 0; r < rounds; ++r) {
+		for (size_t i = 0; i < depth; ++i)
+			coro_bus_try_send(bus, c, i);
+		for (size_t i = 0; i < depth; ++i) {
+			unsigned data;
+			coro_bus_try_recv(bus, c, &data);
+			sum += data;
+		}
+	}
+	uint64_t duration = bench_now_ns() - start;
+	coro_bus_channel_close(bus, c);
+	double count = (double)rounds * depth;
+	printf("depth %8zu: %7.2f M msg/sec (%u)\n", depth,
+		count * 1000 / duration, sum);
+}
+
+struct bench_pipe_ctx {
+	struct coro_bus *bus;
+	int channel;
+	/** Messages per call of the batch API. */
+	unsigned batch;
+};
+
+static void *
+bench_producer_f(void *arg)
+{
+	struct bench_pipe_ctx *ctx = arg;
+	for (unsigned i = 0; i < BENCH_MSG_COUNT; ++i)
+		coro_bus_send(ctx->bus, ctx->channel, i);
+	return NULL;
+}
+
+static void *
+bench_consumer_f(void *arg)
+{
+	struct bench_pipe_ctx *ctx = arg;
+	unsigned data;
+	for (unsigned i = 0; i < BENCH_MSG_COUNT; ++i)
+		coro_bus_recv(ctx->bus, ctx->channel, &data);
+	return NULL;
+}
+
+/** Producer and consumer coroutines blocking on a channel. */
+static void
+bench_pipe(struct coro_bus *bus, size_t depth)
+{
+	struct bench_pipe_ctx ctx;
+	ctx.bus = bus;
+	ctx.channel = coro_bus_channel_open(bus, depth);
+	uint64_t start = bench_now_ns();
+	struct coro *p = coro_new(bench_producer_f, &ctx);
+	struct coro *c = coro_new(bench_consumer_f, &ctx);
+	coro_join(p);
+	coro_join(c);
+	uint64_t duration = bench_now_ns() - start;
+	coro_bus_channel_close(bus, ctx.channel);
+	printf("pipe, depth %8zu: %7.2f M msg/sec\n", depth,
+		(double)BENCH_MSG_COUNT * 1000 / duration);
+}
+
+static void *
+bench_batch_producer_f(void *arg)
+{
+	struct bench_pipe_ctx *ctx = arg;
+	unsigned data[ctx->batch];
+	for (unsigned i = 0; i < ctx->batch; ++i)
+		data[i] = i;
+	for (unsigned sent = 0; sent < BENCH_MSG_COUNT;) {
+		unsigned count = ctx->batch;
+		if (count > BENCH_MSG_COUNT - sent)
+			count = BENCH_MSG_COUNT - sent;
+		sent += coro_bus_send_v(ctx->bus, ctx->channel, data, count);
+	}
+	return NULL;
+}
+
+static void *
+bench_batch_consumer_f(void *arg)
+{
+	struct bench_pipe_ctx *ctx = arg;
+	unsigned data[ctx->batch];
+	for (unsigned received = 0; received < BENCH_MSG_COUNT;) {
+		received += coro_bus_recv_v(ctx->bus, ctx->channel, data,
+			ctx->batch);
+	}
+	return NULL;
+}
+
+/** Same as the pipe, but the messages are sent in batches. */
+static void
+bench_batch(struct coro_bus *bus, size_t depth, unsigned batch)
+{
+	struct bench_pipe_ctx ctx;
+	ctx.bus = bus;
+	ctx.channel = coro_bus_channel_open(bus, depth);
+	ctx.batch = batch;
+	uint64_t start = bench_now_ns();
+	struct coro *p = coro_new(bench_batch_producer_f, &ctx);
+	struct coro *c = coro_new(bench_batch_consumer_f, &ctx);
+	coro_join(p);
+	coro_join(c);
+	uint64_t duration = bench_now_ns() - start;
+	coro_bus_channel_close(bus, ctx.channel);
+	printf("batch pipe, depth %8zu, batch %3u: %7.2f M msg/sec\n", depth,
+		batch, (double)BENCH_MSG_COUNT * 1000 / duration);
+}
+
+/**
+ * Fan-out to many readers: broadcast into a channel per reader
+ * versus publish into a topic with a subscriber per reader.
+ */
+static void
+bench_fanout(struct coro_bus *bus, int reader_count, size_t depth)
+{
+	int channels[reader_count];
+	for (int i = 0; i < reader_count; ++i)
+		channels[i] = coro_bus_channel_open(bus, depth);
+	size_t rounds = BENCH_MSG_COUNT / 16 / depth;
+	unsigned data;
+	uint64_t start = bench_now_ns();
+	for (size_t r = 0; r < rounds; ++r) {
+		for (size_t i = 0; i < depth; ++i)
+			coro_bus_try_broadcast(bus, i);
+		for (int c = 0; c < reader_count; ++c) {
+			for (size_t i = 0; i < depth; ++i)
+				coro_bus_try_recv(bus, channels[c], &data);
+		}
+	}
+	uint64_t broadcast_duration = bench_now_ns() - start;
+	for (int i = 0; i < reader_count; ++i)
+		coro_bus_channel_close(bus, channels[i]);
+
+	int topic = coro_bus_topic_open(bus, depth, CORO_BUS_TOPIC_BLOCK);
+	int subs[reader_count];
+	for (int i = 0; i < reader_count; ++i)
+		subs[i] = coro_bus_subscribe(bus, topic);
+	uint64_t publish_duration = 0;
+	uint64_t total_duration = 0;
+	for (size_t r = 0; r < rounds; ++r) {
+		start = bench_now_ns();
+		for (size_t i = 0; i < depth; ++i)
+			coro_bus_try_publish(bus, topic, i);
+		uint64_t now = bench_now_ns();
+		publish_duration += now - start;
+		for (int s = 0; s < reader_count; ++s) {
+			for (size_t i = 0; i < depth; ++i) {
+				coro_bus_topic_try_recv(bus, topic, subs[s],
+					&data);
+			}
+		}
+		total_duration += bench_now_ns() - start;
+	}
+	coro_bus_topic_close(bus, topic);
+	double count = (double)rounds * depth;
+	printf("fan-out to %3d: broadcast %7.1f ns/msg, topic %7.1f ns/msg "
+		"(publish %5.1f ns)\n", reader_count,
+		broadcast_duration / count, total_duration / count,
+		publish_duration / count);
+}
+
+static void *
+bench_main_f(void *arg)
+{
+	(void)arg;
+	struct coro_bus *bus = coro_bus_new();
+	for (size_t depth = 1; depth <= 1024 * 1024; depth *= 16)
+		bench_depth(bus, depth);
+	bench_pipe(bus, 1);
+	bench_pipe(bus, 1024);
+	bench_batch(bus, 1024, 1);
+	bench_batch(bus, 1024, 16);
+	bench_batch(bus, 1024, 256);
+	bench_fanout(bus, 1, 256);
+	bench_fanout(bus, 16, 256);
+	bench_fanout(bus, 256, 256);
+	coro_bus_delete(bus);
+	return NULL;
+}
+
+int
+main(void)
+{
+	coro_sched_init();
+	struct coro *main_coro = coro_new(bench_main_f, NULL);
+	coro_sched_run();
+	coro_join(main_coro);
+	coro_sched_destroy();
+	return 0;
+}
@@ -1,8 +1,11 @@
+#define _GNU_SOURCE
+
 #include "libcoro.h"
 
 #include "rlist.h"
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -10,40 +13,752 @@
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Context switch backend. The hand-written one saves only the
+ * callee-saved registers and never enters the kernel. The
+ * portable one is built on sigaltstack() + sigsetjmp(). Can be
+ * forced at build time with -DLIBCORO_USE_ASM=0/1.
+ */
+#ifndef LIBCORO_USE_ASM
+#if defined(__x86_64__) || defined(__aarch64__)
+#define LIBCORO_USE_ASM 1
+#else
+#define LIBCORO_USE_ASM 0
+#endif
+#endif
+
+/**
+ * Scheduler statistics: per-coroutine and per-engine counters of
+ * switches and time. Disabled by default, then the counting code
+ * is not compiled at all. Enable with -DLIBCORO_STATS=1.
+ */
+#ifndef LIBCORO_STATS
+#define LIBCORO_STATS 0
+#endif
 
 #define handle_error() do {														\
 	printf("Error %s\n", strerror(errno));										\
 	exit(-1);																	\
 } while(0)
 
+typedef void (*coro_context_f)(void *);
+
+#if LIBCORO_USE_ASM
+
+/**
+ * Machine context of a suspended coroutine. The callee-saved
+ * registers and the floating point control state are pushed onto
+ * the coroutine's own stack by the switch, so only the stack
+ * pointer needs to be remembered.
+ */
+struct coro_context {
+	void *sp;
+};
+
+/**
+ * Save the callee-saved registers on the current stack, store
+ * the stack pointer into @a from_sp, and continue the context
+ * which has @a to_sp as its stack pointer.
+ */
+void
+coro_context_switch(void **from_sp, void *to_sp)
+	__asm__("coro_context_switch");
+
+/**
+ * First function executed by a new context. It takes the entry
+ * function and its argument from the callee-saved registers,
+ * restored by the switch, and jumps into the function.
+ */
+void
+coro_context_trampoline(void)
+	__asm__("coro_context_trampoline");
+
+#if defined(__x86_64__)
+
+/*
+ * MXCSR and the x87 control word are callee-saved too, so a
+ * coroutine changing the rounding mode doesn't leak it into the
+ * others.
+ */
+__asm__(
+	".pushsection .text\n"
+	".p2align 4\n"
+	".type coro_context_switch,@function\n"
+	"coro_context_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size coro_context_switch, .-coro_context_switch\n"
+	".p2align 4\n"
+	".type coro_context_trampoline,@function\n"
+	"coro_context_trampoline:\n"
+	"	movq %r12, %rdi\n"
+	"	jmpq *%r13\n"
+	".size coro_context_trampoline, .-coro_context_trampoline\n"
+	".popsection\n"
+);
+
+static void
+coro_context_create(struct coro_context *ctx, void *stack, size_t stack_size,
+	coro_context_f func, void *arg)
+{
+	void **sp = (void **)(((uintptr_t)stack + stack_size) & ~(uintptr_t)15);
+	/*
+	 * Fake return address of the entry function. Makes the
+	 * stack look like after a normal call: rsp % 16 == 8.
+	 */
+	*--sp = NULL;
+	/* Return address of the switch. */
+	*--sp = (void *)coro_context_trampoline;
+	/* rbp, rbx, r12, r13, r14, r15. */
+	*--sp = NULL;
+	*--sp = NULL;
+	*--sp = arg;
+	*--sp = (void *)func;
+	*--sp = NULL;
+	*--sp = NULL;
+	/* MXCSR and x87 control word, inherited from the creator. */
+	*--sp = NULL;
+	__asm__ volatile("stmxcsr %0" : "=m"(*(uint32_t *)sp));
+	__asm__ volatile("fnstcw %0" : "=m"(*((uint16_t *)sp + 2)));
+	ctx->sp = sp;
+}
+
+#elif defined(__aarch64__)
+
+/*
+ * FPCR (rounding and flush-to-zero modes) is callee-saved too. It
+ * is written back only when it differs, because a write can stall
+ * the pipeline, and almost always it is the same.
+ */
+__asm__(
+	".pushsection .text\n"
+	".p2align 4\n"
+	".type coro_context_switch,%function\n"
+	"coro_context_switch:\n"
+	"	sub sp, sp, #176\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mrs x9, fpcr\n"
+	"	str x9, [sp, #160]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldr x9, [sp, #160]\n"
+	"	mrs x10, fpcr\n"
+	"	cmp x9, x10\n"
+	"	b.eq 1f\n"
+	"	msr fpcr, x9\n"
+	"1:\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #176\n"
+	"	ret\n"
+	".size coro_context_switch, .-coro_context_switch\n"
+	".p2align 4\n"
+	".type coro_context_trampoline,%function\n"
+	"coro_context_trampoline:\n"
+	"	mov x0, x19\n"
+	"	br x20\n"
+	".size coro_context_trampoline, .-coro_context_trampoline\n"
+	".popsection\n"
+);
+
+static void
+coro_context_create(struct coro_context *ctx, void *stack, size_t stack_size,
+	coro_context_f func, void *arg)
+{
+	uintptr_t top = ((uintptr_t)stack + stack_size) & ~(uintptr_t)15;
+	void **sp = (void **)(top - 176);
+	memset(sp, 0, 176);
+	/* x19 and x20 are taken by the trampoline. */
+	sp[0] = arg;
+	sp[1] = (void *)func;
+	/* x30 - return address of the switch. */
+	sp[11] = (void *)coro_context_trampoline;
+	/* FPCR, inherited from the creator. */
+	uint64_t fpcr;
+	__asm__ volatile("mrs %0, fpcr" : "=r"(fpcr));
+	sp[20] = (void *)(uintptr_t)fpcr;
+	ctx->sp = sp;
+}
+
+#else
+#error "LIBCORO_USE_ASM is not supported on this architecture"
+#endif
+
+static inline void
+coro_context_jump(struct coro_context *from, struct coro_context *to)
+{
+	coro_context_switch(&from->sp, to->sp);
+}
+
+/** Nothing below the saved stack pointer is used. */
+enum {
+	CORO_CONTEXT_STACK_MARGIN = 0,
+};
+
+static inline void *
+coro_context_stack_pointer(const struct coro_context *ctx)
+{
+	return ctx->sp;
+}
+
+#else /* !LIBCORO_USE_ASM */
+
+struct coro_context {
+	sigjmp_buf buf;
+	/**
+	 * Approximate stack pointer at the moment of the last
+	 * switch from this context.
+	 */
+	void *sp;
+};
+
+/** Context being created, and where to go back after that. */
+static __thread struct coro_context *new_coro_ctx = NULL;
+static __thread coro_context_f new_coro_func = NULL;
+static __thread void *new_coro_arg = NULL;
+static __thread sigjmp_buf new_coro_start_point;
+
+/**
+ * The core part of the context creation - this signal handler
+ * runs on a separate stack using sigaltstack. At invocation it
+ * remembers its current context and jumps back to the context
+ * constructor. Later the context continues from here.
+ */
+static void
+coro_context_signal_entry(int signum)
+{
+	(void)signum;
+	struct coro_context *ctx = new_coro_ctx;
+	coro_context_f func = new_coro_func;
+	void *arg = new_coro_arg;
+	new_coro_ctx = NULL;
+	/*
+	 * On invocation jump back to the constructor right after
+	 * remembering the context.
+	 */
+	if (sigsetjmp(ctx->buf, 0) == 0)
+		siglongjmp(new_coro_start_point, 1);
+	/*
+	 * If the execution is here, then the context is switched
+	 * to for the first time.
+	 */
+	func(arg);
+	abort();
+}
+
+static void
+coro_context_create(struct coro_context *ctx, void *stack, size_t stack_size,
+	coro_context_f func, void *arg)
+{
+	/*
+	 * SIGUSR2 is used. First of all, block new signals to be
+	 * able to set a new handler.
+	 */
+	sigset_t news, olds, suss;
+	sigemptyset(&news);
+	sigaddset(&news, SIGUSR2);
+	if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
+		handle_error();
+	/*
+	 * New handler should jump onto a new stack and remember
+	 * that position. Afterwards the stack is disabled and
+	 * becomes dedicated to that single context.
+	 */
+	struct sigaction newsa, oldsa;
+	newsa.sa_handler = coro_context_signal_entry;
+	newsa.sa_flags = SA_ONSTACK;
+	sigemptyset(&newsa.sa_mask);
+	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
+		handle_error();
+	/* Create that new stack. */
+	stack_t oldst, newst;
+	newst.ss_sp = stack;
+	newst.ss_size = stack_size;
+	newst.ss_flags = 0;
+	if (sigaltstack(&newst, &oldst) != 0)
+		handle_error();
+
+	/* Jump onto the stack and remember its position. */
+	assert(new_coro_ctx == NULL);
+	new_coro_ctx = ctx;
+	new_coro_func = func;
+	new_coro_arg = arg;
+	sigemptyset(&suss);
+	if (sigsetjmp(new_coro_start_point, 1) == 0) {
+		raise(SIGUSR2);
+		while (new_coro_ctx != NULL)
+			sigsuspend(&suss);
+	}
+	assert(new_coro_ctx == NULL);
+
+	/*
+	 * Return the old stack, unblock SIGUSR2. In other words,
+	 * rollback all global changes. The newly created stack
+	 * now is remembered only by the new context, and can be
+	 * used by it only.
+	 */
+	if (sigaltstack(NULL, &newst) != 0)
+		handle_error();
+	newst.ss_flags = SS_DISABLE;
+	if (sigaltstack(&newst, NULL) != 0)
+		handle_error();
+	if ((oldst.ss_flags & SS_DISABLE) == 0 &&
+	    sigaltstack(&oldst, NULL) != 0)
+		handle_error();
+	if (sigaction(SIGUSR2, &oldsa, NULL) != 0)
+		handle_error();
+	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
+		handle_error();
+}
+
+static inline void
+coro_context_jump(struct coro_context *from, struct coro_context *to)
+{
+	from->sp = __builtin_frame_address(0);
+	if (sigsetjmp(from->buf, 0) == 0)
+		siglongjmp(to->buf, 1);
+}
+
+/**
+ * The exact stack pointer isn't known - sigsetjmp() has its own
+ * frames below the remembered one.
+ */
+enum {
+	CORO_CONTEXT_STACK_MARGIN = 4096,
+};
+
+static inline void *
+coro_context_stack_pointer(const struct coro_context *ctx)
+{
+	return ctx->sp;
+}
+
+#endif /* !LIBCORO_USE_ASM */
+
+enum {
+	/** Stack size used when a coroutine doesn't specify one. */
+	CORO_STACK_SIZE_DEFAULT = 1024 * 1024,
+	/** Default max number of joined coroutines kept for reuse. */
+	CORO_POOL_MAX_DEFAULT = 1024,
+	/**
+	 * How many joined coroutines keep their stacks committed.
+	 * The older ones are given back to the OS.
+	 */
+	CORO_POOL_HOT_MAX = 16,
+};
+
+enum {
+	/** Number of the priority levels. */
+	CORO_PRIO_COUNT = CORO_PRIO_MAX - CORO_PRIO_MIN + 1,
+};
+
 enum coro_state {
 	CORO_STATE_RUNNING,
 	CORO_STATE_SUSPENDED,
 	CORO_STATE_FINISHED,
+	/**
+	 * M:N mode only. The coroutine is going to be suspended,
+	 * but still runs on its stack. A wakeup in this state
+	 * cancels the suspension.
+	 */
+	CORO_STATE_SUSPENDING,
+	/**
+	 * M:N mode only. The coroutine runs and has a pending
+	 * wakeup, which makes its next suspension a nop.
+	 */
+	CORO_STATE_WOKEN,
+};
+
+/**
+ * M:N mode only. What the worker's scheduler should do with a
+ * coroutine which just switched back to it.
+ */
+enum coro_mt_action {
+	CORO_MT_ACTION_YIELD,
+	CORO_MT_ACTION_PARK,
+	CORO_MT_ACTION_FINISH,
 };
 
+struct coro_worker;
+
 /** Main coroutine structure, its context. */
 struct coro {
 	/** Coroutine state. */
 	enum coro_state state;
 	/** A value, returned by func. */
 	void *ret;
-	/** Stack, used by the coroutine. */
+	/**
+	 * Stack, used by the coroutine. Mapped with a guard page
+	 * right below it.
+	 */
 	void *stack;
+	/** Usable size of the stack, a multiple of the page size. */
+	size_t stack_size;
 	/** An argument for the function func. */
 	void *func_arg;
 	/** A function to call as a coroutine. */
 	coro_f func;
+	/** Level of the ready list, priority - CORO_PRIO_MIN. */
+	int prio_level;
+	/** Engine the coroutine belongs to. */
+	struct coro_engine *engine;
 	/** Last remembered coroutine context. */
-	sigjmp_buf ctx;
+	struct coro_context ctx;
 	/**
 	 * Coroutine which is trying to join this one right now.
 	 */
 	struct coro *joiner;
 	/** Links in a coroutine list, used by the scheduler. */
 	struct rlist link;
+	/** M:N mode. Why the coroutine switched to the scheduler. */
+	enum coro_mt_action mt_action;
+	/** M:N mode. Spinlock protecting the joiner and finish. */
+	bool mt_lock;
+	/**
+	 * Link in the engine's list of wakeups requested by other
+	 * threads. Protected by the engine's remote_lock.
+	 */
+	struct rlist remote_link;
+	/** The coroutine is in the remote wakeups list. */
+	bool is_remote_pending;
+	/** When the timer of a timed suspension fires, in ns. */
+	uint64_t timer_deadline;
+	/**
+	 * Position in the timer heap or CORO_TIMER_NONE if the
+	 * coroutine has no active timer.
+	 */
+	size_t timer_index;
+#if LIBCORO_STATS
+	/** How many times the coroutine was switched to. */
+	uint64_t stat_switch_count;
+	/** Total time spent running, in ns. */
+	uint64_t stat_run_time;
+	/** Total time spent suspended, in ns. */
+	uint64_t stat_suspend_time;
+	/** When the coroutine was switched to or from last time. */
+	uint64_t stat_switch_time;
+	/** The last switch from the coroutine was a suspension. */
+	bool stat_is_suspended;
+#endif
+};
+
+enum {
+	CORO_TIMER_NONE = SIZE_MAX,
+};
+
+/**
+ * Binary min-heap of the coroutines suspended with a timeout,
+ * ordered by the deadline. Each coroutine knows its position, so
+ * a timer is removed in O(log n) when the coroutine is woken up
+ * before the deadline.
+ */
+struct coro_timer_heap {
+	struct coro **coros;
+	/** Readable without the owner's lock in M:N mode. */
+	size_t count;
+	size_t capacity;
+};
+
+static inline void
+coro_timer_heap_set(struct coro_timer_heap *heap, size_t i, struct coro *c)
+{
+	heap->coros[i] = c;
+	c->timer_index = i;
+}
+
+static void
+coro_timer_heap_sift_up(struct coro_timer_heap *heap, size_t i)
+{
+	struct coro *c = heap->coros[i];
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		struct coro *p = heap->coros[parent];
+		if (p->timer_deadline <= c->timer_deadline)
+			break;
+		coro_timer_heap_set(heap, i, p);
+		i = parent;
+	}
+	coro_timer_heap_set(heap, i, c);
+}
+
+static void
+coro_timer_heap_sift_down(struct coro_timer_heap *heap, size_t i)
+{
+	struct coro *c = heap->coros[i];
+	size_t count = heap->count;
+	while (true) {
+		size_t child = 2 * i + 1;
+		if (child >= count)
+			break;
+		if (child + 1 < count && heap->coros[child + 1]->timer_deadline <
+		    heap->coros[child]->timer_deadline)
+			++child;
+		if (c->timer_deadline <= heap->coros[child]->timer_deadline)
+			break;
+		coro_timer_heap_set(heap, i, heap->coros[child]);
+		i = child;
+	}
+	coro_timer_heap_set(heap, i, c);
+}
+
+static void
+coro_timer_heap_push(struct coro_timer_heap *heap, struct coro *c)
+{
+	assert(c->timer_index == CORO_TIMER_NONE);
+	if (heap->count == heap->capacity) {
+		size_t capacity = heap->capacity == 0 ? 16 : heap->capacity * 2;
+		struct coro **coros = realloc(heap->coros,
+			capacity * sizeof(*coros));
+		if (coros == NULL)
+			handle_error();
+		heap->coros = coros;
+		heap->capacity = capacity;
+	}
+	heap->coros[heap->count] = c;
+	__atomic_store_n(&heap->count, heap->count + 1, __ATOMIC_RELAXED);
+	coro_timer_heap_sift_up(heap, heap->count - 1);
+}
+
+static void
+coro_timer_heap_remove(struct coro_timer_heap *heap, struct coro *c)
+{
+	size_t i = c->timer_index;
+	assert(i < heap->count && heap->coros[i] == c);
+	c->timer_index = CORO_TIMER_NONE;
+	size_t last = heap->count - 1;
+	__atomic_store_n(&heap->count, last, __ATOMIC_RELAXED);
+	if (i == last)
+		return;
+	struct coro *moved = heap->coros[last];
+	coro_timer_heap_set(heap, i, moved);
+	if (i > 0 && heap->coros[(i - 1) / 2]->timer_deadline >
+	    moved->timer_deadline)
+		coro_timer_heap_sift_up(heap, i);
+	else
+		coro_timer_heap_sift_down(heap, i);
+}
+
+static inline struct coro *
+coro_timer_heap_top(const struct coro_timer_heap *heap)
+{
+	return heap->count > 0 ? heap->coros[0] : NULL;
+}
+
+static void
+coro_timer_heap_destroy(struct coro_timer_heap *heap)
+{
+	assert(heap->count == 0);
+	free(heap->coros);
+}
+
+/** Time of the coroutine timers, in nanoseconds. */
+static uint64_t
+coro_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+coro_clock_timespec(uint64_t ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+}
+
+/**
+ * Milliseconds until the @a deadline in ns for epoll_wait(),
+ * rounded up so the deadline is passed after the wait.
+ */
+static int
+coro_clock_timeout_ms(uint64_t deadline)
+{
+	uint64_t now = coro_clock_ns();
+	if (deadline <= now)
+		return 0;
+	uint64_t ms = (deadline - now + 999999) / 1000000;
+	return ms > INT_MAX ? INT_MAX : (int)ms;
+}
+
+/** Condition variable which can be waited for on the timers' clock. */
+static void
+coro_cond_create(pthread_cond_t *cond)
+{
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+enum coro_fd_wait_state {
+	CORO_FD_WAITING = 0,
+	/**
+	 * The event is delivered, but the poller is still using the
+	 * coroutine. It must not suspend anymore, but can't leave
+	 * either.
+	 */
+	CORO_FD_WAKING,
+	/**
+	 * Same, and the waiter's thread sleeps on the state futex
+	 * until the poller is done.
+	 */
+	CORO_FD_WAKING_PARKED,
+	/** The poller is done, the waiter can leave. */
+	CORO_FD_WOKEN,
+};
+
+/** Coroutine waiting for an fd. Lives on the waiter's stack. */
+struct coro_fd_wait {
+	struct coro *coro;
+	/** Events which happened on the fd. */
+	int revents;
+	/** enum coro_fd_wait_state, an int to be a futex. */
+	int state;
+};
+
+static void
+coro_futex_wait(int *futex, int value)
+{
+	syscall(SYS_futex, futex, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void
+coro_futex_wake(int *futex)
+{
+	syscall(SYS_futex, futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/**
+ * Epoll reactor. Each fd is registered as one-shot with a pointer
+ * to its waiter, so an event is delivered exactly once and then
+ * the fd stays disabled until the next wait re-arms it.
+ */
+struct coro_reactor {
+	/** -1 until the first wait for an fd. */
+	int epoll_fd;
+	/**
+	 * Interrupts a blocked epoll_wait() when a coroutine is
+	 * woken up by somebody else. Registered with NULL data.
+	 */
+	int event_fd;
+	/** Number of coroutines waiting for their fds. */
+	size_t wait_count;
+	/** Somebody is inside epoll_wait() right now. */
+	bool is_polling;
+};
+
+enum {
+	/** Max number of events taken by one epoll_wait(). */
+	CORO_REACTOR_EVENTS_MAX = 256,
 };
 
+static void
+coro_reactor_create(struct coro_reactor *r)
+{
+	r->epoll_fd = -1;
+	r->event_fd = -1;
+	r->wait_count = 0;
+	r->is_polling = false;
+}
+
+static void
+coro_reactor_open(struct coro_reactor *r)
+{
+	assert(r->epoll_fd < 0);
+	r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (r->epoll_fd < 0)
+		handle_error();
+	r->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (r->event_fd < 0)
+		handle_error();
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->event_fd, &ev) != 0)
+		handle_error();
+}
+
+static void
+coro_reactor_destroy(struct coro_reactor *r)
+{
+	assert(r->wait_count == 0);
+	if (r->epoll_fd < 0)
+		return;
+	close(r->event_fd);
+	close(r->epoll_fd);
+	r->epoll_fd = -1;
+	r->event_fd = -1;
+}
+
+struct coro_engine;
+
+static void
+coro_reactor_poll(struct coro_reactor *r, struct coro_engine *engine,
+	int timeout_ms);
+
+/** Make a blocked epoll_wait() return. Can be called from any thread. */
+static void
+coro_reactor_interrupt(struct coro_reactor *r)
+{
+	uint64_t one = 1;
+	ssize_t rc = write(r->event_fd, &one, sizeof(one));
+	/* EAGAIN means the counter is full and is going to fire. */
+	(void)rc;
+}
+
 struct coro_engine {
 	/**
 	 * Scheduler is the main coroutine - it represents the
@@ -54,50 +769,752 @@ struct coro_engine {
 	struct coro *this;
 
 	/**
-	 * Coroutines to run in this iteration of the loop. The
-	 * list gets populated once at the start of the iteration.
+	 * Coroutines to run in this iteration of the loop, one
+	 * list per priority level. The higher levels run first.
+	 * The lists get populated at the start of the iteration,
+	 * and by the wakeups of the coroutines more important than
+	 * the running one.
 	 */
-	struct rlist coros_running_now;
+	struct rlist coros_running_now[CORO_PRIO_COUNT];
 	/**
-	 * Coroutines to run in the next iteration of the loop.
-	 * The list gets populated by wakeups and yields and new
-	 * coros.
+	 * Coroutines to run in the next iteration of the loop, per
+	 * priority level. The lists get populated by wakeups and
+	 * yields and new coros.
+	 */
+	struct rlist coros_running_next[CORO_PRIO_COUNT];
+	/** Level of the coroutine running in this iteration. */
+	int prio_level_now;
+	/**
+	 * Joined coroutines to be reused. The most recently used
+	 * ones are in the head.
 	 */
-	struct rlist coros_running_next;
-	/** Joined coroutines to be reused. */
 	struct rlist coros_pool;
+	/** Size of the hot pool. */
+	size_t coros_pool_size;
+	/**
+	 * Joined coroutines whose stacks were given back to the
+	 * OS. Still reusable, but their stacks will page-fault.
+	 */
+	struct rlist coros_pool_cold;
+	/** Size of the cold pool. */
+	size_t coros_pool_cold_size;
+	/** Max number of coroutines in both pools together. */
+	size_t coros_pool_max;
+	/** System page size. */
+	size_t page_size;
 	/** Total number of coroutines, including the pool. */
 	size_t coro_count;
+	/** Worker owning the engine in M:N mode, NULL otherwise. */
+	struct coro_worker *worker;
+	/**
+	 * Coroutines of this engine woken up by other threads. The
+	 * engine's thread wakes them up for real when it gets to
+	 * the scheduler.
+	 */
+	struct rlist remote_wakeups;
+	/** Size of remote_wakeups, readable without the lock. */
+	size_t remote_wakeup_count;
+	/**
+	 * Number of coroutines waiting for a wakeup from another
+	 * thread. While there are any, the scheduler sleeps when
+	 * nothing is runnable instead of returning.
+	 */
+	size_t remote_wait_count;
+	pthread_mutex_t remote_lock;
+	pthread_cond_t remote_cond;
 	/**
-	 * Buffer, used by the coroutine constructor to escape
-	 * from the signal handler back into the constructor to
-	 * rollback sigaltstack etc.
+	 * Coroutines suspended with a timeout. Not used in M:N
+	 * mode, where the coroutines can migrate, and the timers
+	 * are kept by the group.
 	 */
-	sigjmp_buf start_point;
+	struct coro_timer_heap timers;
+	/** Fd waits. Not used in M:N mode, same as the timers. */
+	struct coro_reactor reactor;
+#if LIBCORO_STATS
+	/** Switches to the coroutines, not counting the scheduler. */
+	uint64_t stat_switch_count;
+	/** Time spent in the coroutines, in ns. */
+	uint64_t stat_run_time;
+	/** Iterations of the scheduler loop. */
+	uint64_t stat_loop_count;
+	/**
+	 * Size of coros_running_next, or of the worker's queue in
+	 * M:N mode.
+	 */
+	size_t stat_ready_count;
+	/** Max of stat_ready_count seen by the scheduler. */
+	size_t stat_ready_max;
+	/** Sum of stat_ready_count over the scheduler iterations. */
+	uint64_t stat_ready_total;
+#endif
 };
 
-static void
-coro_engine_create(struct coro_engine *engine)
+/** Engine of the current thread. */
+static __thread struct coro_engine *cur_engine = NULL;
+
+/**
+ * Get the engine of the current thread. Not inlined and with a
+ * barrier so the compiler can't cache the thread-local address
+ * across a context switch, after which the coroutine might be
+ * running on another thread.
+ */
+static __attribute__((noinline)) struct coro_engine *
+coro_engine_current(void)
+{
+	struct coro_engine *engine = cur_engine;
+	__asm__ volatile("" ::: "memory");
+	return engine;
+}
+
+#if LIBCORO_STATS
+
+static void
+coro_stat_reset(struct coro *c)
+{
+	c->stat_switch_count = 0;
+	c->stat_run_time = 0;
+	c->stat_suspend_time = 0;
+	c->stat_switch_time = 0;
+	c->stat_is_suspended = false;
+}
+
+/** Account the switch from @a from to @a to at once. */
+static void
+coro_stat_switch(struct coro_engine *engine, struct coro *from,
+	struct coro *to)
+{
+	uint64_t now = coro_clock_ns();
+	if (from != &engine->sched) {
+		uint64_t run_time = now - from->stat_switch_time;
+		from->stat_run_time += run_time;
+		engine->stat_run_time += run_time;
+		from->stat_is_suspended =
+			from->state == CORO_STATE_SUSPENDED ||
+			from->state == CORO_STATE_SUSPENDING;
+	}
+	from->stat_switch_time = now;
+	if (to != &engine->sched) {
+		if (to->stat_is_suspended)
+			to->stat_suspend_time += now - to->stat_switch_time;
+		++to->stat_switch_count;
+		++engine->stat_switch_count;
+	}
+	to->stat_switch_time = now;
+}
+
+/** Account an iteration of the scheduler. */
+static void
+coro_stat_loop(struct coro_engine *engine, size_t ready_count)
+{
+	++engine->stat_loop_count;
+	engine->stat_ready_total += ready_count;
+	if (ready_count > engine->stat_ready_max)
+		engine->stat_ready_max = ready_count;
+}
+
+#define coro_stat_ready_inc(engine) (++(engine)->stat_ready_count)
+#define coro_stat_ready_set(engine, count) ((engine)->stat_ready_count = (count))
+
+#else
+
+#define coro_stat_reset(c) ((void)0)
+#define coro_stat_switch(engine, from, to) ((void)0)
+#define coro_stat_loop(engine, ready_count) ((void)0)
+#define coro_stat_ready_inc(engine) ((void)0)
+#define coro_stat_ready_set(engine, count) ((void)0)
+
+#endif
+
+/** Add a coroutine to the list of the next scheduler iteration. */
+static inline void
+coro_engine_push_next(struct coro_engine *engine, struct coro *c)
+{
+	rlist_add_tail_entry(&engine->coros_running_next[c->prio_level], c,
+		link);
+	coro_stat_ready_inc(engine);
+}
+
+/**
+ * Make a woken up or new coroutine runnable. If it is more
+ * important than the running one, it runs in this iteration of
+ * the loop, right after the current coroutine switches out. It
+ * can't starve the scheduler - the level only grows this way.
+ */
+static inline void
+coro_engine_push_ready(struct coro_engine *engine, struct coro *c)
+{
+	if (engine->this != NULL && c->prio_level > engine->prio_level_now) {
+		rlist_add_tail_entry(&engine->coros_running_now[c->prio_level],
+			c, link);
+		return;
+	}
+	coro_engine_push_next(engine, c);
+}
+
+static void
+coro_engine_create(struct coro_engine *engine)
+{
+	memset(engine, 0, sizeof(*engine));
+	rlist_create(&engine->sched.link);
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i) {
+		rlist_create(&engine->coros_running_now[i]);
+		rlist_create(&engine->coros_running_next[i]);
+	}
+	rlist_create(&engine->coros_pool);
+	rlist_create(&engine->coros_pool_cold);
+	engine->coros_pool_max = CORO_POOL_MAX_DEFAULT;
+	engine->page_size = sysconf(_SC_PAGESIZE);
+	rlist_create(&engine->remote_wakeups);
+	pthread_mutex_init(&engine->remote_lock, NULL);
+	coro_cond_create(&engine->remote_cond);
+	coro_reactor_create(&engine->reactor);
+}
+
+/**
+ * Map a new stack of @a size bytes with a PROT_NONE guard page
+ * below it, so an overflow crashes instead of silently corrupting
+ * the neighbour memory. The pages are committed lazily by the OS
+ * on first touch.
+ */
+static void *
+coro_stack_new(struct coro_engine *engine, size_t size)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+	flags |= MAP_NORESERVE;
+#endif
+#ifdef MAP_STACK
+	flags |= MAP_STACK;
+#endif
+	size_t page_size = engine->page_size;
+	char *map = mmap(NULL, size + page_size, PROT_READ | PROT_WRITE,
+		flags, -1, 0);
+	if (map == MAP_FAILED)
+		handle_error();
+	if (mprotect(map, page_size, PROT_NONE) != 0)
+		handle_error();
+	return map + page_size;
+}
+
+static void
+coro_stack_delete(struct coro_engine *engine, void *stack, size_t size)
+{
+	size_t page_size = engine->page_size;
+	if (munmap((char *)stack - page_size, size + page_size) != 0)
+		handle_error();
+}
+
+/**
+ * Give the unused part of a parked coroutine's stack back to the
+ * OS. Everything below the saved context is dead and can be
+ * dropped. The pages are zero-filled again on the next touch.
+ */
+static void
+coro_stack_release(struct coro_engine *engine, struct coro *c)
+{
+	uintptr_t begin = (uintptr_t)c->stack;
+	uintptr_t end = (uintptr_t)coro_context_stack_pointer(&c->ctx);
+	end = (end - CORO_CONTEXT_STACK_MARGIN) & ~(engine->page_size - 1);
+	if (end <= begin)
+		return;
+	if (madvise((void *)begin, end - begin, MADV_DONTNEED) != 0)
+		handle_error();
+}
+
+static void
+coro_delete(struct coro_engine *engine, struct coro *c)
+{
+	coro_stack_delete(engine, c->stack, c->stack_size);
+	free(c);
+	/*
+	 * In M:N mode a coroutine can be created and deleted by
+	 * different engines, only the sum of all counters makes
+	 * sense.
+	 */
+	assert(engine->worker != NULL || engine->coro_count > 0);
+	--engine->coro_count;
+}
+
+/** Drop the oldest pooled coroutines until the pool fits its limit. */
+static void
+coro_engine_pool_trim(struct coro_engine *engine)
+{
+	while (engine->coros_pool_size + engine->coros_pool_cold_size >
+	       engine->coros_pool_max) {
+		struct coro *c;
+		if (engine->coros_pool_cold_size > 0) {
+			c = rlist_shift_tail_entry(&engine->coros_pool_cold,
+				struct coro, link);
+			--engine->coros_pool_cold_size;
+		} else {
+			c = rlist_shift_tail_entry(&engine->coros_pool,
+				struct coro, link);
+			--engine->coros_pool_size;
+		}
+		coro_delete(engine, c);
+	}
+}
+
+/** Park a joined coroutine for future reuse. */
+static void
+coro_engine_pool_put(struct coro_engine *engine, struct coro *c)
+{
+	assert(rlist_empty(&c->link));
+	rlist_add_entry(&engine->coros_pool, c, link);
+	++engine->coros_pool_size;
+	size_t hot_max = CORO_POOL_HOT_MAX;
+	if (hot_max > engine->coros_pool_max)
+		hot_max = engine->coros_pool_max;
+	if (engine->coros_pool_size > hot_max) {
+		c = rlist_shift_tail_entry(&engine->coros_pool, struct coro,
+			link);
+		--engine->coros_pool_size;
+		coro_stack_release(engine, c);
+		rlist_add_entry(&engine->coros_pool_cold, c, link);
+		++engine->coros_pool_cold_size;
+	}
+	coro_engine_pool_trim(engine);
+}
+
+static struct coro *
+coro_pool_find(struct rlist *pool, size_t stack_size)
+{
+	struct coro *c;
+	rlist_foreach_entry(c, pool, link) {
+		if (c->stack_size == stack_size)
+			return c;
+	}
+	return NULL;
+}
+
+/** Take a pooled coroutine with the given stack size, if any. */
+static struct coro *
+coro_engine_pool_take(struct coro_engine *engine, size_t stack_size)
+{
+	struct coro *c = coro_pool_find(&engine->coros_pool, stack_size);
+	if (c != NULL) {
+		--engine->coros_pool_size;
+	} else {
+		c = coro_pool_find(&engine->coros_pool_cold, stack_size);
+		if (c == NULL)
+			return NULL;
+		--engine->coros_pool_cold_size;
+	}
+	rlist_del_entry(c, link);
+	return c;
+}
+
+//////////////////////////////////////////////////////////////////
+
+/*
+ * M:N mode. Each worker thread runs its own engine. Ready
+ * coroutines are kept in per-worker queues, and an idle worker
+ * steals them from the others, so a coroutine can continue on a
+ * different thread after any suspension. Unlike the single
+ * thread engine, a coroutine always switches back to its
+ * worker's scheduler. The scheduler then completes the yield or
+ * suspension on the coroutine's behalf, when its stack is not
+ * used anymore and it is safe to let another thread resume it.
+ */
+
+struct coro_group;
+
+struct coro_worker {
+	/**
+	 * Engine of the worker. Its sched context is the worker
+	 * thread's own stack.
+	 */
+	struct coro_engine engine;
+	/** Group the worker belongs to. */
+	struct coro_group *group;
+	/**
+	 * Coroutines ready to run, per priority level. Protected
+	 * by the lock.
+	 */
+	struct rlist queue[CORO_PRIO_COUNT];
+	/** Sizes of the queue levels. Protected by the lock. */
+	size_t queue_level_size[CORO_PRIO_COUNT];
+	/** Size of the queue. */
+	size_t queue_size;
+	pthread_mutex_t lock;
+	pthread_t thread;
+	/** Index in the group. */
+	int id;
+	/** Scheduled coroutines since the last poll of the reactor. */
+	unsigned poll_tick;
+};
+
+struct coro_group {
+	struct coro_worker *workers;
+	int worker_count;
+	/** Spawned and not finished coroutines. */
+	size_t live_count;
+	/** Number of coroutines in all the worker queues. */
+	size_t queued_count;
+	/** Number of workers sleeping on idle_cond. */
+	int idle_count;
+	/** All coroutines are finished, the workers should exit. */
+	bool is_stopped;
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+	/**
+	 * Coroutines of all the workers suspended with a timeout.
+	 * Any worker fires them, and the idle ones sleep until the
+	 * nearest deadline.
+	 */
+	struct coro_timer_heap timers;
+	pthread_mutex_t timer_lock;
+	/**
+	 * Fd waits of all the workers. Only one worker polls it at a
+	 * time, an idle one blocks in epoll_wait() instead of sleeping
+	 * on idle_cond.
+	 */
+	struct coro_reactor reactor;
+};
+
+enum {
+	/**
+	 * How often a busy worker checks the fd events, in
+	 * scheduled coroutines.
+	 */
+	CORO_WORKER_POLL_INTERVAL = 64,
+};
+
+static void
+coro_mt_lock(struct coro *c)
+{
+	while (__atomic_exchange_n(&c->mt_lock, true, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static void
+coro_mt_unlock(struct coro *c)
+{
+	__atomic_store_n(&c->mt_lock, false, __ATOMIC_RELEASE);
+}
+
+static void
+coro_worker_push(struct coro_worker *worker, struct coro *c)
+{
+	struct coro_group *group = worker->group;
+	pthread_mutex_lock(&worker->lock);
+	assert(rlist_empty(&c->link));
+	/* The priority can be changed by another thread. */
+	int level = __atomic_load_n(&c->prio_level, __ATOMIC_RELAXED);
+	rlist_add_tail_entry(&worker->queue[level], c, link);
+	++worker->queue_level_size[level];
+	__atomic_add_fetch(&worker->queue_size, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&group->queued_count, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&worker->lock);
+	if (__atomic_load_n(&group->idle_count, __ATOMIC_SEQ_CST) == 0)
+		return;
+	if (__atomic_load_n(&group->reactor.is_polling, __ATOMIC_SEQ_CST))
+		coro_reactor_interrupt(&group->reactor);
+	pthread_mutex_lock(&group->idle_lock);
+	pthread_cond_signal(&group->idle_cond);
+	pthread_mutex_unlock(&group->idle_lock);
+}
+
+static struct coro *
+coro_worker_pop(struct coro_worker *worker)
+{
+	if (__atomic_load_n(&worker->queue_size, __ATOMIC_RELAXED) == 0)
+		return NULL;
+	struct coro *c = NULL;
+	pthread_mutex_lock(&worker->lock);
+	for (int i = CORO_PRIO_COUNT - 1; i >= 0; --i) {
+		if (rlist_empty(&worker->queue[i]))
+			continue;
+		c = rlist_shift_entry(&worker->queue[i], struct coro, link);
+		--worker->queue_level_size[i];
+		__atomic_sub_fetch(&worker->queue_size, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&worker->group->queued_count, 1,
+			__ATOMIC_SEQ_CST);
+		break;
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return c;
+}
+
+/**
+ * Take half of the most important non-empty level of another
+ * worker's queue. The first stolen coroutine is returned, the
+ * rest go to the own queue.
+ */
+static struct coro *
+coro_worker_steal(struct coro_worker *worker)
+{
+	struct coro_group *group = worker->group;
+	for (int i = 1; i < group->worker_count; ++i) {
+		struct coro_worker *victim = &group->workers[
+			(worker->id + i) % group->worker_count];
+		if (__atomic_load_n(&victim->queue_size,
+				    __ATOMIC_RELAXED) == 0)
+			continue;
+		RLIST_HEAD(stolen);
+		pthread_mutex_lock(&victim->lock);
+		int level = CORO_PRIO_COUNT - 1;
+		while (level > 0 && victim->queue_level_size[level] == 0)
+			--level;
+		size_t count = (victim->queue_level_size[level] + 1) / 2;
+		for (size_t j = 0; j < count; ++j) {
+			struct coro *c = rlist_shift_tail_entry(
+				&victim->queue[level], struct coro, link);
+			rlist_add_entry(&stolen, c, link);
+		}
+		victim->queue_level_size[level] -= count;
+		__atomic_sub_fetch(&victim->queue_size, count,
+			__ATOMIC_RELAXED);
+		pthread_mutex_unlock(&victim->lock);
+		if (count == 0)
+			continue;
+		struct coro *c = rlist_shift_entry(&stolen, struct coro,
+			link);
+		__atomic_sub_fetch(&group->queued_count, 1, __ATOMIC_SEQ_CST);
+		if (count > 1) {
+			pthread_mutex_lock(&worker->lock);
+			rlist_splice_tail(&worker->queue[level], &stolen);
+			worker->queue_level_size[level] += count - 1;
+			__atomic_add_fetch(&worker->queue_size, count - 1,
+				__ATOMIC_RELAXED);
+			pthread_mutex_unlock(&worker->lock);
+		}
+		return c;
+	}
+	return NULL;
+}
+
+/**
+ * Sleep until there are coroutines to run somewhere in the group,
+ * or until the nearest timer deadline. Returns false if the group
+ * is stopped.
+ */
+static bool
+coro_worker_wait(struct coro_worker *worker)
+{
+	struct coro_group *group = worker->group;
+	/*
+	 * A timer added later belongs to a running coroutine. Its
+	 * worker takes the timer into account when goes idle.
+	 */
+	pthread_mutex_lock(&group->timer_lock);
+	struct coro *first = coro_timer_heap_top(&group->timers);
+	uint64_t deadline = first != NULL ? first->timer_deadline : 0;
+	pthread_mutex_unlock(&group->timer_lock);
+	if (__atomic_load_n(&group->reactor.wait_count, __ATOMIC_SEQ_CST) > 0 &&
+	    !__atomic_exchange_n(&group->reactor.is_polling, true,
+				 __ATOMIC_SEQ_CST)) {
+		/*
+		 * Become the poller. Being counted as idle makes the
+		 * new ready coroutines interrupt the poll.
+		 */
+		__atomic_add_fetch(&group->idle_count, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&group->queued_count,
+				    __ATOMIC_SEQ_CST) == 0 &&
+		    !__atomic_load_n(&group->is_stopped, __ATOMIC_SEQ_CST)) {
+			coro_reactor_poll(&group->reactor, &worker->engine,
+				first != NULL ? coro_clock_timeout_ms(deadline) :
+				-1);
+		}
+		__atomic_sub_fetch(&group->idle_count, 1, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&group->reactor.is_polling, false,
+			__ATOMIC_SEQ_CST);
+		return !__atomic_load_n(&group->is_stopped, __ATOMIC_SEQ_CST);
+	}
+	struct timespec ts;
+	coro_clock_timespec(deadline, &ts);
+
+	pthread_mutex_lock(&group->idle_lock);
+	__atomic_add_fetch(&group->idle_count, 1, __ATOMIC_SEQ_CST);
+	while (!group->is_stopped &&
+	       __atomic_load_n(&group->queued_count, __ATOMIC_SEQ_CST) == 0) {
+		if (first == NULL) {
+			pthread_cond_wait(&group->idle_cond, &group->idle_lock);
+		} else if (pthread_cond_timedwait(&group->idle_cond,
+				&group->idle_lock, &ts) == ETIMEDOUT) {
+			break;
+		}
+	}
+	__atomic_sub_fetch(&group->idle_count, 1, __ATOMIC_SEQ_CST);
+	bool is_stopped = group->is_stopped;
+	pthread_mutex_unlock(&group->idle_lock);
+	return !is_stopped;
+}
+
+/** Can be called from any thread. */
+static void
+coro_worker_wakeup(struct coro *coro)
+{
+	enum coro_state state = __atomic_load_n(&coro->state,
+		__ATOMIC_SEQ_CST);
+	enum coro_state new_state;
+	do {
+		switch (state) {
+		case CORO_STATE_RUNNING:
+			new_state = CORO_STATE_WOKEN;
+			break;
+		case CORO_STATE_SUSPENDING:
+		case CORO_STATE_SUSPENDED:
+			new_state = CORO_STATE_RUNNING;
+			break;
+		default:
+			return;
+		}
+	} while (!__atomic_compare_exchange_n(&coro->state, &state,
+		new_state, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	if (state != CORO_STATE_SUSPENDED)
+		return;
+	/*
+	 * Prefer the current worker, the wakeup source probably
+	 * shares data with the coroutine.
+	 */
+	struct coro_worker *worker = __atomic_load_n(&coro->engine,
+		__ATOMIC_RELAXED)->worker;
+	struct coro_engine *engine = coro_engine_current();
+	if (engine != NULL && engine->worker != NULL &&
+	    engine->worker->group == worker->group)
+		worker = engine->worker;
+	coro_worker_push(worker, coro);
+}
+
+/** Wakeup the coroutines whose timers have expired. */
+static void
+coro_worker_process_timers(struct coro_worker *worker)
+{
+	struct coro_group *group = worker->group;
+	if (__atomic_load_n(&group->timers.count, __ATOMIC_RELAXED) == 0)
+		return;
+	uint64_t now = coro_clock_ns();
+	pthread_mutex_lock(&group->timer_lock);
+	struct coro *c;
+	while ((c = coro_timer_heap_top(&group->timers)) != NULL &&
+	       c->timer_deadline <= now) {
+		coro_timer_heap_remove(&group->timers, c);
+		/*
+		 * Under the lock, so the coroutine can't leave its
+		 * timed suspension and be reused meanwhile.
+		 */
+		coro_worker_wakeup(c);
+	}
+	pthread_mutex_unlock(&group->timer_lock);
+}
+
+static void
+coro_worker_switch_out(struct coro *this, enum coro_mt_action action)
+{
+	this->mt_action = action;
+	coro_context_jump(&this->ctx, &this->engine->sched.ctx);
+}
+
+static void
+coro_worker_suspend(struct coro *this)
+{
+	enum coro_state state = CORO_STATE_RUNNING;
+	if (!__atomic_compare_exchange_n(&this->state, &state,
+			CORO_STATE_SUSPENDING, false, __ATOMIC_SEQ_CST,
+			__ATOMIC_SEQ_CST)) {
+		/* A pending wakeup makes the suspension a nop. */
+		assert(state == CORO_STATE_WOKEN);
+		__atomic_store_n(&this->state, CORO_STATE_RUNNING,
+			__ATOMIC_SEQ_CST);
+		return;
+	}
+	coro_worker_switch_out(this, CORO_MT_ACTION_PARK);
+}
+
+/**
+ * Finish the switch of a coroutine back to the scheduler. It is
+ * not running on its stack anymore.
+ */
+static void
+coro_worker_complete_switch(struct coro_worker *worker, struct coro *c)
+{
+	struct coro_group *group = worker->group;
+	enum coro_state state;
+	struct coro *joiner;
+	switch (c->mt_action) {
+	case CORO_MT_ACTION_YIELD:
+		coro_worker_push(worker, c);
+		return;
+	case CORO_MT_ACTION_PARK:
+		state = CORO_STATE_SUSPENDING;
+		if (__atomic_compare_exchange_n(&c->state, &state,
+				CORO_STATE_SUSPENDED, false, __ATOMIC_SEQ_CST,
+				__ATOMIC_SEQ_CST))
+			return;
+		/* Woken up while was switching out. */
+		assert(state == CORO_STATE_RUNNING);
+		coro_worker_push(worker, c);
+		return;
+	case CORO_MT_ACTION_FINISH:
+		coro_mt_lock(c);
+		__atomic_store_n(&c->state, CORO_STATE_FINISHED,
+			__ATOMIC_SEQ_CST);
+		joiner = c->joiner;
+		if (joiner != NULL)
+			coro_worker_wakeup(joiner);
+		coro_mt_unlock(c);
+		if (__atomic_sub_fetch(&group->live_count, 1,
+				       __ATOMIC_SEQ_CST) > 0)
+			return;
+		pthread_mutex_lock(&group->idle_lock);
+		__atomic_store_n(&group->is_stopped, true, __ATOMIC_SEQ_CST);
+		pthread_cond_broadcast(&group->idle_cond);
+		pthread_mutex_unlock(&group->idle_lock);
+		if (__atomic_load_n(&group->reactor.is_polling,
+				    __ATOMIC_SEQ_CST))
+			coro_reactor_interrupt(&group->reactor);
+		return;
+	}
+	abort();
+}
+
+static void *
+coro_worker_join(struct coro *this, struct coro *coro)
 {
-	memset(engine, 0, sizeof(*engine));
-	rlist_create(&engine->sched.link);
-	rlist_create(&engine->coros_running_now);
-	rlist_create(&engine->coros_running_next);
-	rlist_create(&engine->coros_pool);
+	if (this == NULL) {
+		printf("Error: join from outside of the coroutines in M:N "
+			"mode\n");
+		exit(-1);
+	}
+	while (true) {
+		coro_mt_lock(coro);
+		if (__atomic_load_n(&coro->state, __ATOMIC_SEQ_CST) ==
+		    CORO_STATE_FINISHED)
+			break;
+		coro->joiner = this;
+		coro_mt_unlock(coro);
+		coro_worker_suspend(this);
+	}
+	coro->joiner = NULL;
+	coro_mt_unlock(coro);
+	void *ret = coro->ret;
+	coro->ret = NULL;
+	coro->mt_lock = false;
+	coro_engine_pool_put(this->engine, coro);
+	return ret;
 }
 
+//////////////////////////////////////////////////////////////////
+
 static void
 coro_engine_resume_next(struct coro_engine *engine)
 {
-	assert(!rlist_empty(&engine->coros_running_now));
-	struct coro *to = rlist_shift_entry(&engine->coros_running_now,
+	int level = CORO_PRIO_COUNT - 1;
+	while (rlist_empty(&engine->coros_running_now[level])) {
+		/* The scheduler is always in the end of the lowest one. */
+		assert(level > 0);
+		--level;
+	}
+	engine->prio_level_now = level;
+	struct coro *to = rlist_shift_entry(&engine->coros_running_now[level],
 		struct coro, link);
 	struct coro *from = engine->this;
 	assert(from != NULL);
 
 	engine->this = NULL;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
+	coro_stat_switch(engine, from, to);
+	coro_context_jump(&from->ctx, &to->ctx);
 	assert(rlist_empty(&from->link));
 	assert(engine->this == NULL);
 	engine->this = from;
@@ -107,6 +1524,10 @@ static void
 coro_engine_suspend(struct coro_engine *engine)
 {
 	struct coro *this = engine->this;
+	if (engine->worker != NULL && this != NULL) {
+		coro_worker_suspend(this);
+		return;
+	}
 	if (this == NULL) {
 		printf("Error: deadlock - suspension with no active "
 			"coroutines\n");
@@ -122,15 +1543,32 @@ static void
 coro_engine_yield(struct coro_engine *engine)
 {
 	struct coro *this = engine->this;
+	if (engine->worker != NULL) {
+		coro_worker_switch_out(this, CORO_MT_ACTION_YIELD);
+		return;
+	}
 	assert(rlist_empty(&this->link));
 	assert(this->state == CORO_STATE_RUNNING);
-	rlist_add_tail_entry(&engine->coros_running_next, this, link);
+	coro_engine_push_next(engine, this);
 	coro_engine_resume_next(engine);
 }
 
+static void
+coro_engine_wakeup_remote(struct coro_engine *engine, struct coro *coro);
+
 static void
 coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
 {
+	struct coro_engine *owner = __atomic_load_n(&coro->engine,
+		__ATOMIC_RELAXED);
+	if (owner->worker != NULL) {
+		coro_worker_wakeup(coro);
+		return;
+	}
+	if (owner != engine) {
+		coro_engine_wakeup_remote(owner, coro);
+		return;
+	}
 	if (coro->state == CORO_STATE_RUNNING)
 		return;
 	if (coro->state == CORO_STATE_FINISHED)
@@ -138,31 +1576,200 @@ coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
 	assert(coro->state == CORO_STATE_SUSPENDED);
 	assert(rlist_empty(&coro->link));
 	coro->state = CORO_STATE_RUNNING;
-	rlist_add_tail_entry(&engine->coros_running_next, coro, link);
+	coro_engine_push_ready(engine, coro);
+}
+
+/**
+ * Wakeup a coroutine of a single thread engine from another
+ * thread. The engine's own thread does the actual wakeup later.
+ * Since that happens only between the coroutine runs, the
+ * wakeup can't be lost even if it is requested before the
+ * coroutine is suspended.
+ */
+static void
+coro_engine_wakeup_remote(struct coro_engine *engine, struct coro *coro)
+{
+	pthread_mutex_lock(&engine->remote_lock);
+	if (!coro->is_remote_pending) {
+		coro->is_remote_pending = true;
+		rlist_add_tail(&engine->remote_wakeups, &coro->remote_link);
+		__atomic_add_fetch(&engine->remote_wakeup_count, 1,
+			__ATOMIC_RELEASE);
+		pthread_cond_signal(&engine->remote_cond);
+		if (engine->reactor.is_polling)
+			coro_reactor_interrupt(&engine->reactor);
+	}
+	pthread_mutex_unlock(&engine->remote_lock);
+}
+
+/** Apply the wakeups requested by other threads. */
+static void
+coro_engine_process_remote(struct coro_engine *engine)
+{
+	if (__atomic_load_n(&engine->remote_wakeup_count,
+			    __ATOMIC_ACQUIRE) == 0)
+		return;
+	pthread_mutex_lock(&engine->remote_lock);
+	while (!rlist_empty(&engine->remote_wakeups)) {
+		struct coro *c = rlist_shift_entry(&engine->remote_wakeups,
+			struct coro, remote_link);
+		c->is_remote_pending = false;
+		coro_engine_wakeup(engine, c);
+	}
+	__atomic_store_n(&engine->remote_wakeup_count, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&engine->remote_lock);
+}
+
+/** Wakeup the coroutines whose timers have expired. */
+static void
+coro_engine_process_timers(struct coro_engine *engine)
+{
+	if (engine->timers.count == 0)
+		return;
+	uint64_t now = coro_clock_ns();
+	struct coro *c;
+	while ((c = coro_timer_heap_top(&engine->timers)) != NULL &&
+	       c->timer_deadline <= now) {
+		coro_timer_heap_remove(&engine->timers, c);
+		coro_engine_wakeup(engine, c);
+	}
+}
+
+/**
+ * Wait for the fd events for at most @a timeout_ms and wakeup the
+ * coroutines via @a engine. The wakeups of the engine's own
+ * coroutines are applied right away, the others are delivered to
+ * their engines.
+ */
+static void
+coro_reactor_poll(struct coro_reactor *r, struct coro_engine *engine,
+	int timeout_ms)
+{
+	struct epoll_event events[CORO_REACTOR_EVENTS_MAX];
+	int count = epoll_wait(r->epoll_fd, events, CORO_REACTOR_EVENTS_MAX,
+		timeout_ms);
+	if (count < 0) {
+		if (errno == EINTR)
+			return;
+		handle_error();
+	}
+	for (int i = 0; i < count; ++i) {
+		struct coro_fd_wait *w = events[i].data.ptr;
+		if (w == NULL) {
+			uint64_t value;
+			ssize_t rc = read(r->event_fd, &value, sizeof(value));
+			(void)rc;
+			continue;
+		}
+		w->revents = events[i].events;
+		__atomic_store_n(&w->state, CORO_FD_WAKING, __ATOMIC_SEQ_CST);
+		coro_engine_wakeup(engine, w->coro);
+		/*
+		 * The waiter can leave and free the entry after that.
+		 * The wake doesn't read the entry's memory, only uses
+		 * its address.
+		 */
+		if (__atomic_exchange_n(&w->state, CORO_FD_WOKEN,
+					__ATOMIC_ACQ_REL) == CORO_FD_WAKING_PARKED)
+			coro_futex_wake(&w->state);
+	}
+}
+
+/**
+ * Block in the reactor until an fd event, the nearest timer
+ * deadline, or a wakeup from another thread.
+ */
+static void
+coro_engine_poll(struct coro_engine *engine)
+{
+	struct coro *first = coro_timer_heap_top(&engine->timers);
+	int timeout_ms = first != NULL ?
+		coro_clock_timeout_ms(first->timer_deadline) : -1;
+	pthread_mutex_lock(&engine->remote_lock);
+	if (!rlist_empty(&engine->remote_wakeups)) {
+		pthread_mutex_unlock(&engine->remote_lock);
+		return;
+	}
+	engine->reactor.is_polling = true;
+	pthread_mutex_unlock(&engine->remote_lock);
+	coro_reactor_poll(&engine->reactor, engine, timeout_ms);
+	pthread_mutex_lock(&engine->remote_lock);
+	engine->reactor.is_polling = false;
+	pthread_mutex_unlock(&engine->remote_lock);
+}
+
+/**
+ * Sleep until another thread wakes up any coroutine, or until the
+ * nearest timer deadline, or until an fd event.
+ */
+static void
+coro_engine_wait(struct coro_engine *engine)
+{
+	if (engine->reactor.wait_count > 0) {
+		coro_engine_poll(engine);
+		return;
+	}
+	struct coro *first = coro_timer_heap_top(&engine->timers);
+	struct timespec ts;
+	if (first != NULL)
+		coro_clock_timespec(first->timer_deadline, &ts);
+	pthread_mutex_lock(&engine->remote_lock);
+	while (rlist_empty(&engine->remote_wakeups)) {
+		if (first == NULL) {
+			pthread_cond_wait(&engine->remote_cond,
+				&engine->remote_lock);
+		} else if (pthread_cond_timedwait(&engine->remote_cond,
+				&engine->remote_lock, &ts) == ETIMEDOUT) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&engine->remote_lock);
 }
 
 static void
 coro_engine_run(struct coro_engine *engine)
 {
 	while (true) {
-		assert(rlist_empty(&engine->coros_running_now));
-		rlist_splice_tail(&engine->coros_running_now,
-			&engine->coros_running_next);
-		if (rlist_empty(&engine->coros_running_now))
-			break;
+		coro_engine_process_remote(engine);
+		coro_engine_process_timers(engine);
+		bool is_empty = true;
+		for (int i = 0; i < CORO_PRIO_COUNT && is_empty; ++i)
+			is_empty = rlist_empty(&engine->coros_running_next[i]);
+		/* Don't let the busy coroutines starve the fd waiters. */
+		if (engine->reactor.wait_count > 0 && !is_empty)
+			coro_reactor_poll(&engine->reactor, engine, 0);
+		is_empty = true;
+		for (int i = 0; i < CORO_PRIO_COUNT; ++i) {
+			assert(rlist_empty(&engine->coros_running_now[i]));
+			rlist_splice_tail(&engine->coros_running_now[i],
+				&engine->coros_running_next[i]);
+			if (!rlist_empty(&engine->coros_running_now[i]))
+				is_empty = false;
+		}
+		coro_stat_loop(engine, engine->stat_ready_count);
+		coro_stat_ready_set(engine, 0);
+		if (is_empty) {
+			if (engine->remote_wait_count == 0 &&
+			    engine->timers.count == 0 &&
+			    engine->reactor.wait_count == 0)
+				break;
+			coro_engine_wait(engine);
+			continue;
+		}
 
 		assert(engine->this == NULL);
 		engine->this = &engine->sched;
 		assert(rlist_empty(&engine->sched.link));
 		/*
-		 * Add the scheduler to the tail so the control
-		 * comes back in the end of this iteration of the
-		 * loop.
+		 * Add the scheduler to the tail of the lowest level
+		 * so the control comes back in the end of this
+		 * iteration of the loop.
 		 */
-		rlist_add_tail_entry(&engine->coros_running_now,
+		rlist_add_tail_entry(&engine->coros_running_now[0],
 			&engine->sched, link);
 		coro_engine_resume_next(engine);
-		assert(rlist_empty(&engine->coros_running_now));
+		for (int i = 0; i < CORO_PRIO_COUNT; ++i)
+			assert(rlist_empty(&engine->coros_running_now[i]));
 		assert(engine->this == &engine->sched);
 		engine->this = NULL;
 	}
@@ -172,43 +1779,31 @@ static void
 coro_engine_destroy(struct coro_engine *engine)
 {
 	assert(engine->this == NULL);
-	assert(rlist_empty(&engine->coros_running_now));
-	assert(rlist_empty(&engine->coros_running_next));
-	while (!rlist_empty(&engine->coros_pool)) {
-		struct coro *c = rlist_shift_entry(&engine->coros_pool,
-			struct coro, link);
-		free(c->stack);
-		free(c);
-		assert(engine->coro_count > 0);
-		--engine->coro_count;
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i) {
+		assert(rlist_empty(&engine->coros_running_now[i]));
+		assert(rlist_empty(&engine->coros_running_next[i]));
 	}
+	engine->coros_pool_max = 0;
+	coro_engine_pool_trim(engine);
 	assert(engine->coro_count == 0);
+	assert(rlist_empty(&engine->remote_wakeups));
+	pthread_cond_destroy(&engine->remote_cond);
+	pthread_mutex_destroy(&engine->remote_lock);
+	coro_timer_heap_destroy(&engine->timers);
+	coro_reactor_destroy(&engine->reactor);
 	memset(engine, '#', sizeof(*engine));
 }
 
-static __thread struct coro_engine *new_coro_engine = NULL;
-
 /**
- * The core part of the coroutines creation - this signal handler
- * runs on a separate stack using sigaltstack. At invocation it
- * remembers its current context and jumps back to the coroutine
- * constructor. Later the coroutine continues from here.
+ * Entry point of each coroutine. Runs on the coroutine's own
+ * stack. Later the coroutine is reused from here for the next
+ * functions after being joined.
  */
 static void
-coro_body(int signum)
+coro_body(void *arg)
 {
-	(void)signum;
-	struct coro_engine *my_engine = new_coro_engine;
-	new_coro_engine = NULL;
-
-	struct coro *c = my_engine->this;
-	my_engine->this = NULL;
-	/*
-	 * On invocation jump back to the constructor right after
-	 * remembering the context.
-	 */
-	if (sigsetjmp(c->ctx, 0) == 0)
-		siglongjmp(my_engine->start_point, 1);
+	struct coro *c = arg;
+	struct coro_engine *my_engine = c->engine;
 	/*
 	 * If the execution is here, then the coroutine should
 	 * finally start work.
@@ -217,121 +1812,118 @@ coro_body(int signum)
 	while (true) {
 		c->ret = c->func(c->func_arg);
 		c->func = NULL;
-		assert(c->state == CORO_STATE_RUNNING);
-		c->state = CORO_STATE_FINISHED;
-		if (c->joiner != NULL)
-			coro_engine_wakeup(my_engine, c->joiner);
-		coro_engine_resume_next(my_engine);
+		/* In M:N mode could migrate to another engine. */
+		my_engine = c->engine;
+		if (my_engine->worker != NULL) {
+			coro_worker_switch_out(c, CORO_MT_ACTION_FINISH);
+		} else {
+			assert(c->state == CORO_STATE_RUNNING);
+			c->state = CORO_STATE_FINISHED;
+			if (c->joiner != NULL)
+				coro_engine_wakeup(my_engine, c->joiner);
+			coro_engine_resume_next(my_engine);
+		}
 		/*
 		 * Here it is restarted already, must have its
 		 * state restored.
 		 */
-		assert(c->state == CORO_STATE_RUNNING);
+		assert(c->state == CORO_STATE_RUNNING ||
+		       c->state == CORO_STATE_WOKEN);
 		assert(c->func != NULL);
 	}
 }
 
 static struct coro *
-coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
+coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg,
+	size_t stack_size)
 {
 	struct coro *c = malloc(sizeof(*c));
+	if (c == NULL)
+		handle_error();
 	c->state = CORO_STATE_RUNNING;
 	c->ret = NULL;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
+	c->stack = coro_stack_new(engine, stack_size);
+	c->stack_size = stack_size;
+	c->engine = engine;
 	c->func = func;
 	c->func_arg = func_arg;
 	c->joiner = NULL;
+	c->mt_lock = false;
+	c->is_remote_pending = false;
+	c->timer_index = CORO_TIMER_NONE;
+	coro_stat_reset(c);
 	rlist_create(&c->link);
-	/*
-	 * SIGUSR2 is used. First of all, block new signals to be
-	 * able to set a new handler.
-	 */
-	sigset_t news, olds, suss;
-	sigemptyset(&news);
-	sigaddset(&news, SIGUSR2);
-	if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
-		handle_error();
-	/*
-	 * New handler should jump onto a new stack and remember
-	 * that position. Afterwards the stack is disabled and
-	 * becomes dedicated to that single coroutine.
-	 */
-	struct sigaction newsa, oldsa;
-	newsa.sa_handler = coro_body;
-	newsa.sa_flags = SA_ONSTACK;
-	sigemptyset(&newsa.sa_mask);
-	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
-		handle_error();
-	/* Create that new stack. */
-	stack_t oldst, newst;
-	newst.ss_sp = c->stack;
-	newst.ss_size = stack_size;
-	newst.ss_flags = 0;
-	if (sigaltstack(&newst, &oldst) != 0)
-		handle_error();
+	rlist_create(&c->remote_link);
+	coro_context_create(&c->ctx, c->stack, stack_size, coro_body, c);
+	++engine->coro_count;
+	return c;
+}
 
-	/* Jump onto the stack and remember its position. */
-	assert(new_coro_engine == NULL);
-	new_coro_engine = engine;
-	struct coro *old_this = engine->this;
-	engine->this = c;
-	sigemptyset(&suss);
-	if (sigsetjmp(engine->start_point, 1) == 0) {
-		raise(SIGUSR2);
-		while (engine->this != NULL)
-			sigsuspend(&suss);
+/** Make a new coroutine runnable. */
+static void
+coro_engine_schedule_new(struct coro_engine *engine, struct coro *c)
+{
+	assert(rlist_empty(&c->link));
+	if (engine->worker == NULL) {
+		coro_engine_push_ready(engine, c);
+		return;
 	}
-	assert(new_coro_engine == NULL);
-	engine->this = old_this;
+	c->engine = engine;
+	__atomic_add_fetch(&engine->worker->group->live_count, 1,
+		__ATOMIC_SEQ_CST);
+	coro_worker_push(engine->worker, c);
+}
 
-	/*
-	 * Return the old stack, unblock SIGUSR2. In other words,
-	 * rollback all global changes. The newly created stack
-	 * now is remembered only by the new coroutine, and can be
-	 * used by it only.
-	 */
-	if (sigaltstack(NULL, &newst) != 0)
-		handle_error();
-	newst.ss_flags = SS_DISABLE;
-	if (sigaltstack(&newst, NULL) != 0)
-		handle_error();
-	if ((oldst.ss_flags & SS_DISABLE) == 0 &&
-	    sigaltstack(&oldst, NULL) != 0)
-		handle_error();
-	if (sigaction(SIGUSR2, &oldsa, NULL) != 0)
-		handle_error();
-	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
-		handle_error();
+/** Ready list level of a priority, clamped to the valid range. */
+static inline int
+coro_prio_level(int priority)
+{
+	if (priority < CORO_PRIO_MIN)
+		priority = CORO_PRIO_MIN;
+	else if (priority > CORO_PRIO_MAX)
+		priority = CORO_PRIO_MAX;
+	return priority - CORO_PRIO_MIN;
+}
 
-	/* Now scheduler can work with that coroutine. */
-	++engine->coro_count;
-	assert(rlist_empty(&c->link));
-	rlist_add_tail_entry(&engine->coros_running_next, c, link);
-	return c;
+/** Stack size for the given options, rounded up to a page. */
+static size_t
+coro_engine_stack_size(struct coro_engine *engine,
+	const struct coro_opts *opts)
+{
+	size_t size = CORO_STACK_SIZE_DEFAULT;
+	if (opts != NULL && opts->stack_size != 0)
+		size = opts->stack_size;
+	if (size < (size_t)SIGSTKSZ)
+		size = SIGSTKSZ;
+	size_t page_size = engine->page_size;
+	return (size + page_size - 1) & ~(page_size - 1);
 }
 
 static struct coro *
-coro_engine_spawn(struct coro_engine *engine, coro_f func, void *func_arg)
+coro_engine_spawn(struct coro_engine *engine, coro_f func, void *func_arg,
+	const struct coro_opts *opts)
 {
-	if (rlist_empty(&engine->coros_pool))
-		return coro_engine_spawn_new(engine, func, func_arg);
-
-	struct coro *c = rlist_shift_entry(&engine->coros_pool,
-		struct coro, link);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->state = CORO_STATE_RUNNING;
-	assert(rlist_empty(&c->link));
-	rlist_add_tail_entry(&engine->coros_running_next, c, link);
+	size_t stack_size = coro_engine_stack_size(engine, opts);
+	struct coro *c = coro_engine_pool_take(engine, stack_size);
+	if (c == NULL) {
+		c = coro_engine_spawn_new(engine, func, func_arg, stack_size);
+	} else {
+		c->func = func;
+		c->func_arg = func_arg;
+		c->state = CORO_STATE_RUNNING;
+		coro_stat_reset(c);
+	}
+	c->prio_level = coro_prio_level(opts != NULL ? opts->priority :
+		CORO_PRIO_DEFAULT);
+	coro_engine_schedule_new(engine, c);
 	return c;
 }
 
 static void *
 coro_engine_join(struct coro_engine *engine, struct coro *coro)
 {
+	if (engine->worker != NULL)
+		return coro_worker_join(engine->this, coro);
 	assert(coro->joiner == NULL);
 	coro->joiner = engine->this;
 	while (coro->state == CORO_STATE_RUNNING ||
@@ -342,19 +1934,151 @@ coro_engine_join(struct coro_engine *engine, struct coro *coro)
 	coro->joiner = NULL;
 	void *ret = coro->ret;
 	coro->ret = NULL;
-	assert(rlist_empty(&coro->link));
-	rlist_add_entry(&engine->coros_pool, coro, link);
+	/* A late wakeup from another thread must not see a reused coro. */
+	if (__atomic_load_n(&engine->remote_wakeup_count,
+			    __ATOMIC_ACQUIRE) != 0) {
+		pthread_mutex_lock(&engine->remote_lock);
+		if (coro->is_remote_pending) {
+			coro->is_remote_pending = false;
+			rlist_del(&coro->remote_link);
+			__atomic_sub_fetch(&engine->remote_wakeup_count, 1,
+				__ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&engine->remote_lock);
+	}
+	coro_engine_pool_put(engine, coro);
+	return ret;
+}
+
+//////////////////////////////////////////////////////////////////
+
+/** Scheduler loop of an M:N mode worker. */
+static void
+coro_worker_run(struct coro_worker *worker)
+{
+	struct coro_engine *engine = &worker->engine;
+	cur_engine = engine;
+	struct coro_reactor *reactor = &worker->group->reactor;
+	while (true) {
+		coro_worker_process_timers(worker);
+		if (++worker->poll_tick >= CORO_WORKER_POLL_INTERVAL &&
+		    __atomic_load_n(&reactor->wait_count, __ATOMIC_RELAXED) > 0) {
+			worker->poll_tick = 0;
+			if (!__atomic_exchange_n(&reactor->is_polling, true,
+						 __ATOMIC_SEQ_CST)) {
+				coro_reactor_poll(reactor, engine, 0);
+				__atomic_store_n(&reactor->is_polling, false,
+					__ATOMIC_SEQ_CST);
+			}
+		}
+		struct coro *c = coro_worker_pop(worker);
+		if (c == NULL)
+			c = coro_worker_steal(worker);
+		if (c == NULL) {
+			if (!coro_worker_wait(worker))
+				break;
+			continue;
+		}
+		__atomic_store_n(&c->engine, engine, __ATOMIC_RELAXED);
+		coro_stat_ready_set(engine, __atomic_load_n(&worker->queue_size,
+			__ATOMIC_RELAXED));
+		coro_stat_loop(engine, engine->stat_ready_count);
+		engine->this = c;
+		coro_stat_switch(engine, &engine->sched, c);
+		coro_context_jump(&engine->sched.ctx, &c->ctx);
+		coro_stat_switch(engine, c, &engine->sched);
+		engine->this = NULL;
+		coro_worker_complete_switch(worker, c);
+	}
+	cur_engine = NULL;
+}
+
+static void *
+coro_worker_thread_f(void *arg)
+{
+	coro_worker_run(arg);
+	return NULL;
+}
+
+void *
+coro_sched_run_mt(int thread_count, coro_f func, void *func_arg)
+{
+	if (thread_count < 1)
+		thread_count = 1;
+	struct coro_group group;
+	memset(&group, 0, sizeof(group));
+	group.workers = calloc(thread_count, sizeof(group.workers[0]));
+	if (group.workers == NULL)
+		handle_error();
+	group.worker_count = thread_count;
+	pthread_mutex_init(&group.idle_lock, NULL);
+	coro_cond_create(&group.idle_cond);
+	pthread_mutex_init(&group.timer_lock, NULL);
+	coro_reactor_create(&group.reactor);
+	coro_reactor_open(&group.reactor);
+	for (int i = 0; i < thread_count; ++i) {
+		struct coro_worker *w = &group.workers[i];
+		coro_engine_create(&w->engine);
+		w->engine.worker = w;
+		w->group = &group;
+		w->id = i;
+		for (int j = 0; j < CORO_PRIO_COUNT; ++j)
+			rlist_create(&w->queue[j]);
+		pthread_mutex_init(&w->lock, NULL);
+	}
+	struct coro_worker *main_worker = &group.workers[0];
+	struct coro *main_coro = coro_engine_spawn(&main_worker->engine,
+		func, func_arg, NULL);
+	for (int i = 1; i < thread_count; ++i) {
+		struct coro_worker *w = &group.workers[i];
+		errno = pthread_create(&w->thread, NULL, coro_worker_thread_f,
+			w);
+		if (errno != 0)
+			handle_error();
+	}
+	struct coro_engine *old_engine = cur_engine;
+	coro_worker_run(main_worker);
+	cur_engine = old_engine;
+	for (int i = 1; i < thread_count; ++i)
+		pthread_join(group.workers[i].thread, NULL);
+
+	assert(main_coro->state == CORO_STATE_FINISHED);
+	void *ret = main_coro->ret;
+	main_coro->ret = NULL;
+	coro_engine_pool_put(&main_worker->engine, main_coro);
+	size_t coro_count = 0;
+	for (int i = 0; i < thread_count; ++i) {
+		struct coro_worker *w = &group.workers[i];
+		for (int j = 0; j < CORO_PRIO_COUNT; ++j)
+			assert(rlist_empty(&w->queue[j]));
+		w->engine.coros_pool_max = 0;
+		coro_engine_pool_trim(&w->engine);
+		coro_count += w->engine.coro_count;
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->engine.remote_cond);
+		pthread_mutex_destroy(&w->engine.remote_lock);
+	}
+	assert(coro_count == 0);
+	(void)coro_count;
+	coro_timer_heap_destroy(&group.timers);
+	pthread_mutex_destroy(&group.timer_lock);
+	coro_reactor_destroy(&group.reactor);
+	pthread_cond_destroy(&group.idle_cond);
+	pthread_mutex_destroy(&group.idle_lock);
+	free(group.workers);
 	return ret;
 }
 
 //////////////////////////////////////////////////////////////////
 
-static struct coro_engine glob_engine;
+/** Each thread can run its own single thread engine. */
+static __thread struct coro_engine glob_engine;
 
 void
 coro_sched_init(void)
 {
 	coro_engine_create(&glob_engine);
+	cur_engine = &glob_engine;
 }
 
 void
@@ -367,40 +2091,288 @@ void
 coro_sched_destroy(void)
 {
 	coro_engine_destroy(&glob_engine);
+	if (cur_engine == &glob_engine)
+		cur_engine = NULL;
 }
 
 struct coro *
 coro_this(void)
 {
-	return glob_engine.this;
+	struct coro_engine *engine = coro_engine_current();
+	return engine != NULL ? engine->this : NULL;
+}
+
+void
+coro_sched_set_pool_max(size_t count)
+{
+	struct coro_engine *engine = coro_engine_current();
+	engine->coros_pool_max = count;
+	coro_engine_pool_trim(engine);
 }
 
 struct coro *
 coro_new(coro_f func, void *func_arg)
 {
-	return coro_engine_spawn(&glob_engine, func, func_arg);
+	return coro_engine_spawn(coro_engine_current(), func, func_arg, NULL);
+}
+
+struct coro *
+coro_new_opts(coro_f func, void *func_arg, const struct coro_opts *opts)
+{
+	return coro_engine_spawn(coro_engine_current(), func, func_arg, opts);
 }
 
 void *
 coro_join(struct coro *coro)
 {
-	return coro_engine_join(&glob_engine, coro);
+	return coro_engine_join(coro_engine_current(), coro);
 }
 
 void
 coro_suspend(void)
 {
-	coro_engine_suspend(&glob_engine);
+	coro_engine_suspend(coro_engine_current());
+}
+
+void
+coro_suspend_remote(void)
+{
+	struct coro_engine *engine = coro_engine_current();
+	if (engine->worker != NULL) {
+		coro_engine_suspend(engine);
+		return;
+	}
+	++engine->remote_wait_count;
+	coro_engine_suspend(engine);
+	--engine->remote_wait_count;
+}
+
+/**
+ * Suspend the current coroutine until woken up or until the
+ * absolute @a deadline. Returns true if the deadline is reached.
+ */
+static bool
+coro_engine_suspend_until(struct coro_engine *engine, uint64_t deadline)
+{
+	struct coro *this = engine->this;
+	assert(this != NULL && this != &engine->sched);
+	this->timer_deadline = deadline;
+	if (engine->worker == NULL) {
+		coro_timer_heap_push(&engine->timers, this);
+		coro_engine_suspend(engine);
+		if (this->timer_index == CORO_TIMER_NONE)
+			return true;
+		coro_timer_heap_remove(&engine->timers, this);
+		return false;
+	}
+	struct coro_group *group = engine->worker->group;
+	pthread_mutex_lock(&group->timer_lock);
+	coro_timer_heap_push(&group->timers, this);
+	pthread_mutex_unlock(&group->timer_lock);
+	coro_engine_suspend(engine);
+	/* Could migrate to another worker of the same group. */
+	pthread_mutex_lock(&group->timer_lock);
+	bool is_expired = this->timer_index == CORO_TIMER_NONE;
+	if (!is_expired)
+		coro_timer_heap_remove(&group->timers, this);
+	pthread_mutex_unlock(&group->timer_lock);
+	return is_expired;
+}
+
+/** Convert a relative timeout in seconds to a deadline in ns. */
+static uint64_t
+coro_deadline(double timeout)
+{
+	uint64_t now = coro_clock_ns();
+	if (timeout <= 0)
+		return now;
+	double ns = timeout * 1e9;
+	if (ns >= (double)(UINT64_MAX - now))
+		return UINT64_MAX;
+	return now + (uint64_t)ns;
+}
+
+double
+coro_time(void)
+{
+	return coro_clock_ns() / 1e9;
+}
+
+bool
+coro_suspend_timeout(double timeout)
+{
+	return coro_engine_suspend_until(coro_engine_current(),
+		coro_deadline(timeout));
+}
+
+void
+coro_sleep(double timeout)
+{
+	uint64_t deadline = coro_deadline(timeout);
+	while (!coro_engine_suspend_until(coro_engine_current(), deadline))
+		;
+}
+
+int
+coro_wait_fd(int fd, int events)
+{
+	struct coro_engine *engine = coro_engine_current();
+	struct coro_reactor *r = engine->worker != NULL ?
+		&engine->worker->group->reactor : &engine->reactor;
+	if (r->epoll_fd < 0)
+		coro_reactor_open(r);
+	struct coro_fd_wait w;
+	w.coro = engine->this;
+	w.revents = 0;
+	w.state = CORO_FD_WAITING;
+	assert(w.coro != NULL && w.coro != &engine->sched);
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events | EPOLLONESHOT;
+	ev.data.ptr = &w;
+	/* A one-shot fd stays registered after its event, re-arm it. */
+	if (epoll_ctl(r->epoll_fd, EPOLL_CTL_MOD, fd, &ev) != 0 &&
+	    (errno != ENOENT ||
+	     epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0))
+		return -1;
+	__atomic_add_fetch(&r->wait_count, 1, __ATOMIC_SEQ_CST);
+	int state;
+	while ((state = __atomic_load_n(&w.state, __ATOMIC_ACQUIRE)) !=
+	       CORO_FD_WOKEN) {
+		if (state == CORO_FD_WAITING) {
+			coro_suspend();
+		} else if (state == CORO_FD_WAKING) {
+			/*
+			 * Only in M:N mode the poller can be another
+			 * thread, still inside the wakeup. Sleep until
+			 * it is done instead of spinning.
+			 */
+			__atomic_compare_exchange_n(&w.state, &state,
+				CORO_FD_WAKING_PARKED, false, __ATOMIC_ACQ_REL,
+				__ATOMIC_ACQUIRE);
+		} else {
+			coro_futex_wait(&w.state, CORO_FD_WAKING_PARKED);
+		}
+	}
+	__atomic_sub_fetch(&r->wait_count, 1, __ATOMIC_SEQ_CST);
+	return w.revents;
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t size)
+{
+	while (true) {
+		ssize_t rc = read(fd, buf, size);
+		if (rc >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return rc;
+		if (coro_wait_fd(fd, POLLIN) < 0)
+			return -1;
+	}
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t size)
+{
+	while (true) {
+		ssize_t rc = write(fd, buf, size);
+		if (rc >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return rc;
+		if (coro_wait_fd(fd, POLLOUT) < 0)
+			return -1;
+	}
+}
+
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addr_len)
+{
+	while (true) {
+		int rc = accept4(fd, addr, addr_len,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (rc >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return rc;
+		if (coro_wait_fd(fd, POLLIN) < 0)
+			return -1;
+	}
+}
+
+int
+coro_connect(int fd, const struct sockaddr *addr, socklen_t addr_len)
+{
+	if (connect(fd, addr, addr_len) == 0)
+		return 0;
+	if (errno != EINPROGRESS)
+		return -1;
+	if (coro_wait_fd(fd, POLLOUT) < 0)
+		return -1;
+	int err;
+	socklen_t len = sizeof(err);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+		return -1;
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+void
+coro_set_priority(struct coro *coro, int priority)
+{
+	__atomic_store_n(&coro->prio_level, coro_prio_level(priority),
+		__ATOMIC_RELAXED);
+}
+
+int
+coro_priority(struct coro *coro)
+{
+	return __atomic_load_n(&coro->prio_level, __ATOMIC_RELAXED) +
+		CORO_PRIO_MIN;
+}
+
+int
+coro_stats(struct coro *coro, struct coro_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+#if LIBCORO_STATS
+	stats->switch_count = coro->stat_switch_count;
+	stats->run_time = coro->stat_run_time / 1e9;
+	stats->suspend_time = coro->stat_suspend_time / 1e9;
+	return 0;
+#else
+	(void)coro;
+	return -1;
+#endif
+}
+
+int
+coro_sched_stats(struct coro_sched_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	struct coro_engine *engine = coro_engine_current();
+	stats->coro_count = engine->coro_count;
+#if LIBCORO_STATS
+	stats->switch_count = engine->stat_switch_count;
+	stats->run_time = engine->stat_run_time / 1e9;
+	stats->loop_count = engine->stat_loop_count;
+	stats->ready_count = engine->stat_ready_count;
+	stats->ready_max = engine->stat_ready_max;
+	if (engine->stat_loop_count > 0)
+		stats->ready_avg = (double)engine->stat_ready_total /
+			engine->stat_loop_count;
+	return 0;
+#else
+	return -1;
+#endif
 }
 
 void
 coro_yield(void)
 {
-	coro_engine_yield(&glob_engine);
+	coro_engine_yield(coro_engine_current());
 }
 
 void
 coro_wakeup(struct coro *coro)
 {
-	coro_engine_wakeup(&glob_engine, coro);
+	coro_engine_wakeup(coro_engine_current(), coro);
 }
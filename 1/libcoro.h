@@ -1,11 +1,93 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/types.h>
 
 struct coro;
 typedef void *(*coro_f)(void *);
 
-/** Initialize the coroutines engine. */
+/**
+ * Coroutine priorities. A ready coroutine never waits for the ones
+ * of a lower priority: each iteration of the scheduler runs them
+ * in the order of their priorities, and a coroutine woken up by a
+ * less important one runs right after the waker switches out.
+ * Among the equal ones the order is FIFO.
+ */
+enum {
+	/** Background work, runs when nothing else is ready. */
+	CORO_PRIO_MIN = -1,
+	CORO_PRIO_DEFAULT = 0,
+	/** Latency-critical work. */
+	CORO_PRIO_MAX = 2,
+};
+
+/**
+ * Coroutine creation options. Zero-initialized options mean the
+ * defaults.
+ */
+struct coro_opts {
+	/**
+	 * Stack size in bytes. Rounded up to the page size. 0 means
+	 * the default size, 1MB. The stack is committed lazily, only
+	 * the touched pages consume memory. An overflow hits a guard
+	 * page and crashes the process.
+	 */
+	size_t stack_size;
+	/**
+	 * From CORO_PRIO_MIN to CORO_PRIO_MAX, the others are
+	 * clamped. 0 means CORO_PRIO_DEFAULT.
+	 */
+	int priority;
+};
+
+/**
+ * Counters of a coroutine. Collected only when libcoro is built
+ * with -DLIBCORO_STATS=1. Reset when the coroutine is reused by
+ * coro_new().
+ */
+struct coro_stats {
+	/** How many times the coroutine was switched to. */
+	unsigned long long switch_count;
+	/** Total time the coroutine was running, in seconds. */
+	double run_time;
+	/**
+	 * Total time from the coroutine's suspensions until it
+	 * ran again, in seconds.
+	 */
+	double suspend_time;
+};
+
+/**
+ * Counters of the engine of the current thread. Collected only
+ * when libcoro is built with -DLIBCORO_STATS=1.
+ */
+struct coro_sched_stats {
+	/** Switches to the coroutines, not counting the scheduler. */
+	unsigned long long switch_count;
+	/** Time spent in the coroutines, in seconds. */
+	double run_time;
+	/** Iterations of the scheduler loop. */
+	unsigned long long loop_count;
+	/**
+	 * Coroutines ready to run in the next iteration of the
+	 * scheduler. In M:N mode - in the queue of the worker.
+	 */
+	size_t ready_count;
+	/** Max number of ready coroutines seen by one iteration. */
+	size_t ready_max;
+	/** Average number of ready coroutines per iteration. */
+	double ready_avg;
+	/** Existing coroutines, including the ones cached for reuse. */
+	size_t coro_count;
+};
+
+/**
+ * Initialize the coroutines engine. Each thread can have its own
+ * engine, all the functions below work with the engine of the
+ * current thread.
+ */
 void
 coro_sched_init(void);
 
@@ -23,6 +105,42 @@ coro_sched_run(void);
 void
 coro_sched_destroy(void);
 
+/**
+ * Run the coroutines in M:N mode on @a thread_count threads, the
+ * calling one included. Each thread runs its own engine, and the
+ * coroutines migrate between them - an idle thread steals the
+ * ready coroutines from the others. @a func is started as the
+ * first coroutine. The function returns when all the coroutines
+ * are finished, with the result of @a func.
+ *
+ * Inside the M:N mode all the coroutine functions work the same
+ * way as in the single thread engine, except that coro_wakeup()
+ * can be called from any thread. If it is called for a not yet
+ * suspended coroutine, then its next coro_suspend() returns right
+ * away. The usual wait loops re-checking their condition after
+ * each suspension work correctly then. The engine of
+ * coro_sched_init() isn't used and can't be used from inside.
+ */
+void *
+coro_sched_run_mt(int thread_count, coro_f func, void *func_arg);
+
+/**
+ * Set how many joined coroutines are cached together with their
+ * stacks to be reused by the next coro_new() calls. A few most
+ * recent ones keep their stacks committed, the others give the
+ * stack memory back to the OS until reused. The default is 1024.
+ */
+void
+coro_sched_set_pool_max(size_t count);
+
+/**
+ * Take a snapshot of the counters of the current engine. Returns
+ * -1 if the counters are compiled out. Only coro_count is filled
+ * then.
+ */
+int
+coro_sched_stats(struct coro_sched_stats *stats);
+
 /** Get the currently working coroutine. */
 struct coro *
 coro_this(void);
@@ -38,6 +156,29 @@ coro_this(void);
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/** Same as coro_new(), but with non-default options. */
+struct coro *
+coro_new_opts(coro_f func, void *func_arg, const struct coro_opts *opts);
+
+/**
+ * Change the priority of a coroutine. Can be called from any
+ * thread. Takes effect the next time the coroutine becomes ready
+ * to run.
+ */
+void
+coro_set_priority(struct coro *coro, int priority);
+
+/** Get the priority of a coroutine. */
+int
+coro_priority(struct coro *coro);
+
+/**
+ * Take a snapshot of the counters of a not yet joined coroutine.
+ * Returns -1 if the counters are compiled out.
+ */
+int
+coro_stats(struct coro *coro, struct coro_stats *stats);
+
 /**
  * Join a coroutine. When joined, its resources are freed, and the
  * result of its callback function is returned. Each coroutine
@@ -54,6 +195,82 @@ coro_join(struct coro *coro);
 void
 coro_suspend(void);
 
+/**
+ * Same as coro_suspend(), but the wakeup is expected to come from
+ * another thread. While there are coroutines suspended this way,
+ * coro_sched_run() doesn't return when nothing is runnable.
+ * Instead it sleeps until a wakeup from another thread arrives.
+ */
+void
+coro_suspend_remote(void);
+
+/**
+ * Same as coro_suspend(), but the coroutine is also woken up when
+ * @a timeout seconds pass. While there are coroutines suspended
+ * this way, coro_sched_run() doesn't return when nothing is
+ * runnable. Instead it sleeps until the nearest deadline.
+ *
+ * Returns true if the timeout has expired, false if the coroutine
+ * was woken up before that.
+ */
+bool
+coro_suspend_timeout(double timeout);
+
+/**
+ * Pause the current coroutine for at least @a timeout seconds.
+ * Wakeups don't interrupt the sleep.
+ */
+void
+coro_sleep(double timeout);
+
+/** Monotonic time in seconds, the clock used by the timeouts. */
+double
+coro_time(void);
+
+/**
+ * Suspend the current coroutine until any of the @a events
+ * (POLLIN, POLLOUT from <poll.h>) happens on the fd. Other
+ * coroutines keep running meanwhile. While there are coroutines
+ * waiting for fds, coro_sched_run() doesn't return when nothing
+ * is runnable. Instead it blocks in epoll_wait().
+ *
+ * Only one coroutine can wait for a given fd at a time.
+ *
+ * Returns the events which happened, including POLLERR and
+ * POLLHUP, or -1 with errno set if the fd can't be polled.
+ */
+int
+coro_wait_fd(int fd, int events);
+
+/**
+ * Same as read(2), but if the fd has no data yet, suspends the
+ * current coroutine until it has. The fd must be non-blocking.
+ */
+ssize_t
+coro_read(int fd, void *buf, size_t size);
+
+/**
+ * Same as write(2), but if the fd is full, suspends the current
+ * coroutine until it is writable. The fd must be non-blocking.
+ */
+ssize_t
+coro_write(int fd, const void *buf, size_t size);
+
+/**
+ * Same as accept(2), but suspends the current coroutine until a
+ * connection arrives. The listening socket must be non-blocking.
+ * The accepted socket is non-blocking too.
+ */
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addr_len);
+
+/**
+ * Same as connect(2), but suspends the current coroutine until
+ * the connection is established. The socket must be non-blocking.
+ */
+int
+coro_connect(int fd, const struct sockaddr *addr, socklen_t addr_len);
+
 /**
  * Pause the current coroutine until the next iteration of the
  * scheduler. Can be used to let the other coroutines work for a
@@ -66,6 +283,12 @@ coro_yield(void);
  * Wakeup a coroutine. If it was suspended, then it is going to be
  * continued on the next iteration of the scheduler. Otherwise
  * this function is a nop.
+ *
+ * Can be called from any thread. If the coroutine belongs to the
+ * engine of another thread, then the wakeup is delivered when that
+ * engine gets to its scheduler. So a wakeup requested while the
+ * coroutine is still running, but is about to suspend, isn't
+ * lost.
  */
 void
 coro_wakeup(struct coro *coro);
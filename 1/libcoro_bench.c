@@ -0,0 +1,220 @@
+#include "libcoro.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Microbenchmark of the coroutine switch latency. Build it with
+ * both context switch backends (see `make bench`) to compare
+ * them. Also measures the reactor with many connections served by
+ * one thread, and the wakeup latency of an important coroutine
+ * under a saturating background load.
+ */
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *
+bench_yield_f(void *arg)
+{
+	long count = (long)arg;
+	for (long i = 0; i < count; ++i)
+		coro_yield();
+	return NULL;
+}
+
+static void *
+bench_empty_f(void *arg)
+{
+	return arg;
+}
+
+static void
+bench_yield(int coro_count, long yield_count)
+{
+	struct coro **coros = malloc(sizeof(*coros) * coro_count);
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(bench_yield_f, (void *)yield_count);
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	uint64_t duration = bench_now_ns() - start;
+	free(coros);
+	double switch_count = (double)coro_count * yield_count;
+	printf("yield, %d coros: %.1f ns per switch\n", coro_count,
+		duration / switch_count);
+}
+
+static void
+bench_spawn(long count)
+{
+	uint64_t start = bench_now_ns();
+	for (long i = 0; i < count; ++i)
+		coro_join(coro_new(bench_empty_f, NULL));
+	uint64_t duration = bench_now_ns() - start;
+	printf("spawn + join: %.1f ns per coro\n", (double)duration / count);
+}
+
+static void *
+bench_echo_f(void *arg)
+{
+	int fd = (int)(long)arg;
+	char buf[64];
+	ssize_t size;
+	while ((size = coro_read(fd, buf, sizeof(buf))) > 0)
+		coro_write(fd, buf, size);
+	return NULL;
+}
+
+/**
+ * Each connection is served by its own coroutine, while the main
+ * one sends a message to every connection and then reads all the
+ * echoes back.
+ */
+static void
+bench_echo(int conn_count, int round_count)
+{
+	int (*fds)[2] = malloc(sizeof(*fds) * conn_count);
+	struct coro **coros = malloc(sizeof(*coros) * conn_count);
+	for (int i = 0; i < conn_count; ++i) {
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0,
+			       fds[i]) != 0) {
+			printf("echo: can't create %d connections\n", conn_count);
+			exit(-1);
+		}
+		coros[i] = coro_new(bench_echo_f, (void *)(long)fds[i][1]);
+	}
+	char buf[8] = "ping";
+	uint64_t start = bench_now_ns();
+	for (int j = 0; j < round_count; ++j) {
+		for (int i = 0; i < conn_count; ++i)
+			coro_write(fds[i][0], buf, sizeof(buf));
+		for (int i = 0; i < conn_count; ++i)
+			coro_read(fds[i][0], buf, sizeof(buf));
+	}
+	uint64_t duration = bench_now_ns() - start;
+	for (int i = 0; i < conn_count; ++i) {
+		close(fds[i][0]);
+		coro_join(coros[i]);
+		close(fds[i][1]);
+	}
+	free(coros);
+	free(fds);
+	printf("echo, %d connections: %.1f ns per message\n", conn_count,
+		(double)duration / ((double)conn_count * round_count));
+}
+
+struct bench_prio_ctx {
+	/** The coroutine whose wakeup latency is measured. */
+	struct coro *waiter;
+	bool is_waiting;
+	uint64_t wakeup_time;
+	uint64_t *latencies;
+	int latency_count;
+	int sample_count;
+};
+
+static void *
+bench_prio_waiter_f(void *arg)
+{
+	struct bench_prio_ctx *ctx = arg;
+	while (ctx->latency_count < ctx->sample_count) {
+		ctx->is_waiting = true;
+		while (ctx->is_waiting)
+			coro_suspend();
+		ctx->latencies[ctx->latency_count++] =
+			bench_now_ns() - ctx->wakeup_time;
+	}
+	return NULL;
+}
+
+/** Background work: about 2us of CPU between the yields. */
+static void *
+bench_prio_load_f(void *arg)
+{
+	struct bench_prio_ctx *ctx = arg;
+	volatile uint64_t sink = 0;
+	while (ctx->latency_count < ctx->sample_count) {
+		uint64_t until = bench_now_ns() + 2000;
+		while (bench_now_ns() < until)
+			++sink;
+		if (ctx->is_waiting) {
+			ctx->is_waiting = false;
+			ctx->wakeup_time = bench_now_ns();
+			coro_wakeup(ctx->waiter);
+		}
+		coro_yield();
+	}
+	return NULL;
+}
+
+static int
+bench_cmp_u64(const void *a, const void *b)
+{
+	uint64_t l = *(const uint64_t *)a, r = *(const uint64_t *)b;
+	return l < r ? -1 : l > r;
+}
+
+static void
+bench_priority(int load_count, int waiter_prio, const char *name)
+{
+	struct bench_prio_ctx ctx;
+	ctx.is_waiting = false;
+	ctx.latency_count = 0;
+	ctx.sample_count = 2000;
+	ctx.latencies = malloc(sizeof(ctx.latencies[0]) * ctx.sample_count);
+	struct coro_opts opts = {0};
+	opts.priority = waiter_prio;
+	ctx.waiter = coro_new_opts(bench_prio_waiter_f, &ctx, &opts);
+	opts.priority = CORO_PRIO_MIN;
+	struct coro **coros = malloc(sizeof(*coros) * load_count);
+	for (int i = 0; i < load_count; ++i)
+		coros[i] = coro_new_opts(bench_prio_load_f, &ctx, &opts);
+	coro_join(ctx.waiter);
+	for (int i = 0; i < load_count; ++i)
+		coro_join(coros[i]);
+	free(coros);
+	qsort(ctx.latencies, ctx.sample_count, sizeof(ctx.latencies[0]),
+		bench_cmp_u64);
+	printf("wakeup latency, %d background coros, %s waiter: "
+		"p50 %.1f us, p99 %.1f us, max %.1f us\n", load_count, name,
+		ctx.latencies[ctx.sample_count / 2] / 1000.0,
+		ctx.latencies[ctx.sample_count * 99 / 100] / 1000.0,
+		ctx.latencies[ctx.sample_count - 1] / 1000.0);
+	free(ctx.latencies);
+}
+
+static void *
+bench_main_f(void *arg)
+{
+	(void)arg;
+	bench_yield(2, 2000000);
+	bench_yield(100, 40000);
+	bench_yield(10000, 400);
+	bench_spawn(1000000);
+	bench_echo(10, 20000);
+	bench_echo(1000, 200);
+	bench_priority(100, CORO_PRIO_MIN, "same priority");
+	bench_priority(100, CORO_PRIO_MAX, "high priority");
+	return NULL;
+}
+
+int
+main(void)
+{
+	coro_sched_init();
+	struct coro *main_coro = coro_new(bench_main_f, NULL);
+	coro_sched_run();
+	coro_join(main_coro);
+	coro_sched_destroy();
+	return 0;
+}
@@ -2,6 +2,16 @@
 
 #include "unit.h"
 
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <fenv.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void *
@@ -162,6 +172,379 @@ test_wakeup_of_finished(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void *
+test_stack_use_f(void *arg)
+{
+	size_t size = (size_t)arg;
+	char buf[size];
+	memset(buf, 1, size);
+	coro_yield();
+	size_t sum = 0;
+	for (size_t i = 0; i < size; ++i)
+		sum += buf[i];
+	return (void *)sum;
+}
+
+static void
+test_stack_opts(void)
+{
+	unit_test_start();
+
+	struct coro_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.stack_size = 64 * 1024;
+	size_t use = 32 * 1024;
+	struct coro *c1 = coro_new_opts(test_stack_use_f, (void *)use, &opts);
+	struct coro *c2 = coro_new(test_stack_use_f, (void *)use);
+	unit_check(coro_join(c1) == (void *)use, "small stack");
+	unit_check(coro_join(c2) == (void *)use, "default stack");
+
+	unit_msg("reuse of pooled stacks of different sizes");
+	opts.stack_size = 128 * 1024;
+	struct coro *coros[40];
+	for (int i = 0; i < 40; ++i) {
+		struct coro_opts *o = i % 2 == 0 ? &opts : NULL;
+		coros[i] = coro_new_opts(test_stack_use_f, (void *)use, o);
+	}
+	for (int i = 0; i < 40; ++i)
+		unit_assert(coro_join(coros[i]) == (void *)use);
+	for (int i = 0; i < 40; ++i)
+		coros[i] = coro_new_opts(test_stack_use_f, (void *)use, &opts);
+	for (int i = 0; i < 40; ++i)
+		unit_assert(coro_join(coros[i]) == (void *)use);
+
+	unit_msg("no pool");
+	coro_sched_set_pool_max(0);
+	c1 = coro_new(test_stack_use_f, (void *)use);
+	unit_check(coro_join(c1) == (void *)use, "not pooled coro");
+	coro_sched_set_pool_max(1024);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_sleep_ctx {
+	double timeout;
+	int order;
+	int *next_order;
+};
+
+static void *
+test_sleep_f(void *arg)
+{
+	struct test_sleep_ctx *ctx = arg;
+	coro_sleep(ctx->timeout);
+	ctx->order = (*ctx->next_order)++;
+	return NULL;
+}
+
+static void *
+test_suspend_timeout_f(void *arg)
+{
+	return (void *)(long)coro_suspend_timeout(*(double *)arg);
+}
+
+static void
+test_timers(void)
+{
+	unit_test_start();
+
+	unit_msg("sleeping coros wake up in the order of deadlines");
+	int next_order = 0;
+	struct test_sleep_ctx ctxs[3] = {
+		{0.03, -1, &next_order},
+		{0.01, -1, &next_order},
+		{0.02, -1, &next_order},
+	};
+	struct coro *coros[3];
+	double start = coro_time();
+	for (int i = 0; i < 3; ++i)
+		coros[i] = coro_new(test_sleep_f, &ctxs[i]);
+	for (int i = 0; i < 3; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	unit_check(coro_time() - start >= 0.03, "slept long enough");
+	unit_check(ctxs[0].order == 2 && ctxs[1].order == 0 &&
+		ctxs[2].order == 1, "order of the wakeups");
+
+	unit_msg("timeout expires");
+	double timeout = 0.01;
+	struct coro *c = coro_new(test_suspend_timeout_f, &timeout);
+	unit_check(coro_join(c) == (void *)1, "timed out");
+
+	unit_msg("wakeup before the timeout");
+	timeout = 100;
+	c = coro_new(test_suspend_timeout_f, &timeout);
+	coro_yield();
+	coro_wakeup(c);
+	start = coro_time();
+	unit_check(coro_join(c) == (void *)0, "woken up");
+	unit_check(coro_time() - start < 1, "didn't wait for the timeout");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_set_nonblock(int fd)
+{
+	unit_fail_if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0);
+}
+
+/** Echo the messages back until the peer closes the socket. */
+static void *
+test_echo_f(void *arg)
+{
+	int fd = (int)(long)arg;
+	char buf[64];
+	ssize_t size;
+	long total = 0;
+	while ((size = coro_read(fd, buf, sizeof(buf))) > 0) {
+		unit_assert(coro_write(fd, buf, size) == size);
+		total += size;
+	}
+	unit_assert(size == 0);
+	return (void *)total;
+}
+
+static void *
+test_accept_f(void *arg)
+{
+	int fd = coro_accept((int)(long)arg, NULL, NULL);
+	unit_assert(fd >= 0);
+	void *rc = test_echo_f((void *)(long)fd);
+	close(fd);
+	return rc;
+}
+
+static void *
+test_delayed_write_thread_f(void *arg)
+{
+	usleep(10000);
+	unit_assert(write((int)(long)arg, "x", 1) == 1);
+	return NULL;
+}
+
+static void
+test_io(void)
+{
+	unit_test_start();
+
+	unit_msg("read waits for data");
+	int fds[2];
+	unit_fail_if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0);
+	test_set_nonblock(fds[0]);
+	test_set_nonblock(fds[1]);
+	struct coro *c = coro_new(test_echo_f, (void *)(long)fds[1]);
+	char buf[16];
+	for (int i = 0; i < 10; ++i) {
+		coro_yield();
+		unit_assert(coro_write(fds[0], "hello", 5) == 5);
+		unit_assert(coro_read(fds[0], buf, sizeof(buf)) == 5);
+		unit_assert(memcmp(buf, "hello", 5) == 0);
+	}
+	shutdown(fds[0], SHUT_WR);
+	unit_check(coro_join(c) == (void *)50, "echoed everything");
+	close(fds[0]);
+	close(fds[1]);
+
+	unit_msg("the scheduler blocks in the reactor");
+	int pfds[2];
+	unit_fail_if(pipe(pfds) != 0);
+	test_set_nonblock(pfds[0]);
+	pthread_t thread;
+	unit_fail_if(pthread_create(&thread, NULL,
+		test_delayed_write_thread_f, (void *)(long)pfds[1]) != 0);
+	unit_assert(coro_wait_fd(pfds[0], POLLIN) & POLLIN);
+	unit_assert(coro_read(pfds[0], buf, sizeof(buf)) == 1);
+	pthread_join(thread, NULL);
+	close(pfds[0]);
+	close(pfds[1]);
+
+	unit_msg("accept and connect");
+	int lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	unit_fail_if(lfd < 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	unit_fail_if(bind(lfd, (struct sockaddr *)&addr, len) != 0);
+	unit_fail_if(listen(lfd, 16) != 0);
+	unit_fail_if(getsockname(lfd, (struct sockaddr *)&addr, &len) != 0);
+	c = coro_new(test_accept_f, (void *)(long)lfd);
+	int cfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	unit_fail_if(cfd < 0);
+	unit_assert(coro_connect(cfd, (struct sockaddr *)&addr, len) == 0);
+	unit_assert(coro_write(cfd, "abc", 3) == 3);
+	unit_assert(coro_read(cfd, buf, sizeof(buf)) == 3);
+	close(cfd);
+	unit_check(coro_join(c) == (void *)3, "echo over TCP");
+	close(lfd);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_prio_ctx {
+	int id;
+	/** Coroutine to wakeup before recording itself. */
+	struct coro *to_wakeup;
+	bool is_suspend_first;
+	int *log;
+	int *log_size;
+};
+
+static void *
+test_prio_f(void *arg)
+{
+	struct test_prio_ctx *ctx = arg;
+	if (ctx->is_suspend_first)
+		coro_suspend();
+	if (ctx->to_wakeup != NULL)
+		coro_wakeup(ctx->to_wakeup);
+	ctx->log[(*ctx->log_size)++] = ctx->id;
+	return NULL;
+}
+
+static void
+test_priority(void)
+{
+	unit_test_start();
+
+	unit_msg("the more important coros run first");
+	int log[8];
+	int log_size = 0;
+	struct test_prio_ctx ctxs[4];
+	memset(ctxs, 0, sizeof(ctxs));
+	int prios[3] = {CORO_PRIO_MIN, CORO_PRIO_DEFAULT, CORO_PRIO_MAX};
+	struct coro *coros[4];
+	struct coro_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	for (int i = 0; i < 3; ++i) {
+		ctxs[i].id = i;
+		ctxs[i].log = log;
+		ctxs[i].log_size = &log_size;
+		opts.priority = prios[i];
+		coros[i] = coro_new_opts(test_prio_f, &ctxs[i], &opts);
+		unit_assert(coro_priority(coros[i]) == prios[i]);
+	}
+	for (int i = 0; i < 3; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	unit_check(log_size == 3 && log[0] == 2 && log[1] == 1 && log[2] == 0,
+		"order by priority");
+
+	unit_msg("a woken up important coro preempts the iteration");
+	log_size = 0;
+	opts.priority = CORO_PRIO_MAX;
+	ctxs[3].id = 3;
+	ctxs[3].is_suspend_first = true;
+	ctxs[3].log = log;
+	ctxs[3].log_size = &log_size;
+	coros[3] = coro_new_opts(test_prio_f, &ctxs[3], &opts);
+	coro_yield();
+	unit_assert(log_size == 0);
+	opts.priority = CORO_PRIO_MIN;
+	for (int i = 0; i < 3; ++i) {
+		ctxs[i].to_wakeup = i == 0 ? coros[3] : NULL;
+		coros[i] = coro_new_opts(test_prio_f, &ctxs[i], &opts);
+	}
+	for (int i = 0; i < 4; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	unit_check(log_size == 4 && log[0] == 0 && log[1] == 3 &&
+		log[2] == 1 && log[3] == 2, "woken coro runs after the waker");
+
+	unit_msg("change of the priority");
+	log_size = 0;
+	for (int i = 0; i < 3; ++i) {
+		ctxs[i].to_wakeup = NULL;
+		coros[i] = coro_new_opts(test_prio_f, &ctxs[i], &opts);
+	}
+	coro_set_priority(coros[2], CORO_PRIO_MAX + 10);
+	unit_assert(coro_priority(coros[2]) == CORO_PRIO_MAX);
+	unit_assert(coro_priority(coros[0]) == CORO_PRIO_MIN);
+	for (int i = 0; i < 3; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	unit_check(log_size == 3 && log[0] == 0 && log[1] == 1 && log[2] == 2,
+		"applied when becomes ready next time");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_stats_f(void *arg)
+{
+	for (int i = 0; i < 10; ++i)
+		coro_yield();
+	coro_sleep(0.01);
+	return arg;
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct coro_sched_stats before, after;
+	if (coro_sched_stats(&before) != 0) {
+		unit_msg("the stats are compiled out");
+		unit_test_finish();
+		return;
+	}
+	enum { coro_count = 5 };
+	struct coro *coros[coro_count];
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_stats_f, NULL);
+	for (int i = 0; i < coro_count - 1; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	struct coro_stats stats;
+	unit_assert(coro_stats(coros[coro_count - 1], &stats) == 0);
+	unit_check(stats.switch_count == 12, "switches: start, yields, sleep");
+	unit_check(stats.suspend_time >= 0.01, "suspended while slept");
+	unit_check(stats.run_time < stats.suspend_time, "mostly slept");
+	unit_assert(coro_join(coros[coro_count - 1]) == NULL);
+
+	unit_assert(coro_sched_stats(&after) == 0);
+	unit_check(after.switch_count - before.switch_count >=
+		coro_count * 12, "engine switches");
+	unit_check(after.loop_count > before.loop_count, "engine iterations");
+	unit_check(after.ready_max >= coro_count, "max ready queue");
+	unit_check(after.coro_count >= coro_count, "coro count");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_rounding_f(void *arg)
+{
+	fesetround(*(int *)arg);
+	coro_yield();
+	return (void *)(intptr_t)(fegetround() == *(int *)arg);
+}
+
+static void
+test_rounding(void)
+{
+	unit_test_start();
+
+	int up = FE_UPWARD, down = FE_DOWNWARD;
+	struct coro *c1 = coro_new(test_rounding_f, &up);
+	struct coro *c2 = coro_new(test_rounding_f, &down);
+	bool ok1 = coro_join(c1) != NULL;
+	bool ok2 = coro_join(c2) != NULL;
+	unit_check(ok1 && ok2, "each coro keeps its rounding mode");
+	unit_check(fegetround() == FE_TONEAREST,
+		   "and it doesn't leak into the caller");
+
+	unit_test_finish();
+}
+
 static void *
 coro_main_f(void *arg)
 {
@@ -171,9 +554,157 @@ coro_main_f(void *arg)
 	test_wakup_self();
 	test_join_of_join();
 	test_wakeup_of_finished();
+	test_stack_opts();
+	test_timers();
+	test_io();
+	test_priority();
+	test_stats();
+	test_rounding();
 	return NULL;
 }
 
+struct test_mt_ctx {
+	int iter_count;
+	int *counter;
+	/** Ping-pong partner and the flag to wait on. */
+	struct coro *partner;
+	bool *my_turn;
+	bool *partner_turn;
+};
+
+static void *
+test_mt_yield_f(void *arg)
+{
+	struct test_mt_ctx *ctx = arg;
+	for (int i = 0; i < ctx->iter_count; ++i) {
+		__atomic_add_fetch(ctx->counter, 1, __ATOMIC_RELAXED);
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void *
+test_mt_ping_pong_f(void *arg)
+{
+	struct test_mt_ctx *ctx = arg;
+	for (int i = 0; i < ctx->iter_count; ++i) {
+		while (!__atomic_load_n(ctx->my_turn, __ATOMIC_ACQUIRE))
+			coro_suspend();
+		__atomic_store_n(ctx->my_turn, false, __ATOMIC_RELAXED);
+		++*ctx->counter;
+		__atomic_store_n(ctx->partner_turn, true, __ATOMIC_RELEASE);
+		coro_wakeup(ctx->partner);
+	}
+	return NULL;
+}
+
+static void *
+test_mt_sleep_f(void *arg)
+{
+	coro_sleep(0.01);
+	return arg;
+}
+
+static void *
+test_mt_external_wakeup_thread_f(void *arg)
+{
+	struct test_mt_ctx *ctx = arg;
+	__atomic_store_n(ctx->my_turn, true, __ATOMIC_RELEASE);
+	coro_wakeup(ctx->partner);
+	return NULL;
+}
+
+static void *
+test_mt_main_f(void *arg)
+{
+	unit_msg("many yielding coros");
+	enum { coro_count = 100, iter_count = 1000 };
+	int counter = 0;
+	struct test_mt_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.iter_count = iter_count;
+	ctx.counter = &counter;
+	struct coro *coros[coro_count];
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_mt_yield_f, &ctx);
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	unit_check(counter == coro_count * iter_count, "all yields are done");
+
+	unit_msg("ping-pong with suspend and wakeup");
+	counter = 0;
+	bool turn1 = false, turn2 = false;
+	struct test_mt_ctx ctx1 = ctx, ctx2 = ctx;
+	ctx1.my_turn = &turn1;
+	ctx1.partner_turn = &turn2;
+	ctx2.my_turn = &turn2;
+	ctx2.partner_turn = &turn1;
+	struct coro *c1 = coro_new(test_mt_ping_pong_f, &ctx1);
+	struct coro *c2 = coro_new(test_mt_ping_pong_f, &ctx2);
+	ctx1.partner = c2;
+	ctx2.partner = c1;
+	/* The coros can already run on other threads, start after setup. */
+	__atomic_store_n(&turn1, true, __ATOMIC_RELEASE);
+	coro_wakeup(c1);
+	unit_assert(coro_join(c1) == NULL);
+	unit_assert(coro_join(c2) == NULL);
+	unit_check(counter == 2 * iter_count, "all the turns are done");
+
+	unit_msg("sleep in M:N mode");
+	double start = coro_time();
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_mt_sleep_f, NULL);
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	unit_check(coro_time() - start >= 0.01, "all slept");
+
+	unit_msg("echo over sockets in M:N mode");
+	enum { pair_count = 8 };
+	int fds[pair_count][2];
+	char buf[16];
+	for (int i = 0; i < pair_count; ++i) {
+		unit_fail_if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0,
+			fds[i]) != 0);
+		coros[i] = coro_new(test_echo_f, (void *)(long)fds[i][1]);
+	}
+	for (int j = 0; j < 100; ++j) {
+		for (int i = 0; i < pair_count; ++i)
+			unit_assert(coro_write(fds[i][0], "ping", 4) == 4);
+		for (int i = 0; i < pair_count; ++i)
+			unit_assert(coro_read(fds[i][0], buf, 4) == 4);
+	}
+	for (int i = 0; i < pair_count; ++i) {
+		shutdown(fds[i][0], SHUT_WR);
+		unit_assert(coro_join(coros[i]) == (void *)400);
+		close(fds[i][0]);
+		close(fds[i][1]);
+	}
+
+	unit_msg("wakeup from a non-coro thread");
+	bool is_ready = false;
+	ctx.my_turn = &is_ready;
+	ctx.partner = coro_this();
+	pthread_t thread;
+	unit_fail_if(pthread_create(&thread, NULL,
+		test_mt_external_wakeup_thread_f, &ctx) != 0);
+	while (!__atomic_load_n(&is_ready, __ATOMIC_ACQUIRE))
+		coro_suspend();
+	pthread_join(thread, NULL);
+	return arg;
+}
+
+static void
+test_mt(void)
+{
+	unit_test_start();
+
+	int data;
+	void *rc = coro_sched_run_mt(4, test_mt_main_f, &data);
+	unit_check(rc == &data, "M:N mode main coro result");
+
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -183,5 +714,7 @@ main(void)
 	void *rc = coro_join(main_coro);
 	unit_check(rc == NULL, "main coro rc");
 	coro_sched_destroy();
+
+	test_mt();
 	return 0;
 }
@@ -3,6 +3,7 @@
 #include "unit.h"
 #include "corobus.h"
 
+#include <pthread.h>
 #include <string.h>
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -763,6 +764,520 @@ test_close_non_empty_bus(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static int msg_destroy_count = 0;
+
+static void
+test_msg_destroy(struct coro_bus *bus, void *data, size_t size)
+{
+	++msg_destroy_count;
+	coro_bus_msg_free(bus, data, size);
+}
+
+static void *
+send_msg_f(void *arg)
+{
+	struct ctx_send *ctx = arg;
+	struct coro_bus_msg msg;
+	msg.size = 100;
+	msg.data = coro_bus_msg_alloc(ctx->bus, msg.size);
+	memset(msg.data, (int)ctx->data, msg.size);
+	msg.destroy = coro_bus_msg_free;
+	ctx->is_started = true;
+	ctx->rc = coro_bus_send_msg(ctx->bus, ctx->channel, &msg);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+test_send_msg(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 2);
+	unit_assert(c1 >= 0);
+
+	unit_msg("payloads are not copied");
+	struct coro_bus_msg msg;
+	msg.size = 10;
+	msg.data = coro_bus_msg_alloc(bus, msg.size);
+	memcpy(msg.data, "123456789", msg.size);
+	msg.destroy = coro_bus_msg_free;
+	unit_assert(coro_bus_send_msg(bus, c1, &msg) == 0);
+	struct coro_bus_msg res;
+	unit_assert(coro_bus_try_recv_msg(bus, c1, &res) == 0);
+	unit_check(res.data == msg.data && res.size == msg.size, "same buffer");
+	unit_check(strcmp(res.data, "123456789") == 0, "same data");
+	coro_bus_msg_free(bus, res.data, res.size);
+	unit_assert(coro_bus_try_recv_msg(bus, c1, &res) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("freed small buffers are reused");
+	void *p1 = coro_bus_msg_alloc(bus, 20);
+	coro_bus_msg_free(bus, p1, 20);
+	void *p2 = coro_bus_msg_alloc(bus, 30);
+	unit_check(p1 == p2, "same slab block");
+	coro_bus_msg_free(bus, p2, 30);
+	p1 = coro_bus_msg_alloc(bus, 100000);
+	unit_check(p1 != NULL, "big buffer");
+	coro_bus_msg_free(bus, p1, 100000);
+
+	unit_msg("payloads and plain messages share the limit");
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send_msg(bus, c1, &msg) == 0);
+	unit_assert(coro_bus_try_send_msg(bus, c1, &msg) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_try_send(bus, c1, 2) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_recv_msg(bus, c1, &res) == 0);
+	unit_assert(res.data == msg.data);
+	unsigned data = 0;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(data == 1);
+
+	unit_msg("blocking send is woken up by a recv");
+	unit_assert(coro_bus_send_msg(bus, c1, &msg) == 0);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	struct ctx_send ctx;
+	ctx.bus = bus;
+	ctx.channel = c1;
+	ctx.data = 7;
+	ctx.is_started = false;
+	ctx.is_done = false;
+	ctx.worker = coro_new(send_msg_f, &ctx);
+	coro_yield();
+	unit_assert(ctx.is_started && !ctx.is_done);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(send_join(&ctx) == 0);
+	unit_assert(coro_bus_recv_msg(bus, c1, &res) == 0);
+	unit_assert(res.data == msg.data);
+	unit_assert(coro_bus_recv_msg(bus, c1, &res) == 0);
+	unit_check(res.size == 100 && ((char *)res.data)[99] == 7, "payload");
+	res.destroy(bus, res.data, res.size);
+
+	unit_msg("pending payloads are destroyed on close");
+	msg.destroy = test_msg_destroy;
+	unit_assert(coro_bus_send_msg(bus, c1, &msg) == 0);
+	coro_bus_channel_close(bus, c1);
+	unit_check(msg_destroy_count == 1, "destroyed on close");
+	c1 = coro_bus_channel_open(bus, 2);
+	msg.data = coro_bus_msg_alloc(bus, msg.size);
+	unit_assert(coro_bus_send_msg(bus, c1, &msg) == 0);
+	coro_bus_delete(bus);
+	unit_check(msg_destroy_count == 2, "destroyed on bus delete");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct ctx_topic {
+	struct coro_bus *bus;
+	int topic;
+	int sub;
+	unsigned data;
+	int rc;
+	enum coro_bus_error_code err;
+	bool is_done;
+};
+
+static void *
+topic_recv_f(void *arg)
+{
+	struct ctx_topic *ctx = arg;
+	ctx->rc = coro_bus_topic_recv(ctx->bus, ctx->topic, ctx->sub,
+		&ctx->data);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void *
+topic_publish_f(void *arg)
+{
+	struct ctx_topic *ctx = arg;
+	ctx->rc = coro_bus_publish(ctx->bus, ctx->topic, ctx->data);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+test_topic(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	unsigned data = 0;
+
+	unit_msg("each subscriber gets each message");
+	int t = coro_bus_topic_open(bus, 2, CORO_BUS_TOPIC_DROP);
+	unit_assert(t >= 0);
+	unit_assert(coro_bus_publish(bus, t, 1) == 0);
+	int s1 = coro_bus_subscribe(bus, t);
+	int s2 = coro_bus_subscribe(bus, t);
+	unit_assert(s1 >= 0 && s2 >= 0 && s1 != s2);
+	unit_assert(coro_bus_topic_try_recv(bus, t, s1, &data) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_publish(bus, t, 2) == 0);
+	unit_assert(coro_bus_publish(bus, t, 3) == 0);
+	unit_assert(coro_bus_topic_recv(bus, t, s1, &data) == 0 && data == 2);
+	unit_assert(coro_bus_topic_recv(bus, t, s1, &data) == 0 && data == 3);
+
+	unit_msg("drop policy");
+	unit_assert(coro_bus_publish(bus, t, 4) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_topic_recv(bus, t, s2, &data) == 0 && data == 2);
+	unit_assert(coro_bus_publish(bus, t, 4) == 0);
+	unit_assert(coro_bus_try_publish(bus, t, 5) == -1);
+	unit_msg("unsubscribe releases the messages");
+	coro_bus_unsubscribe(bus, t, s2);
+	unit_assert(coro_bus_topic_try_recv(bus, t, s2, &data) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_try_publish(bus, t, 5) == 0);
+	unit_assert(coro_bus_topic_recv(bus, t, s1, &data) == 0 && data == 4);
+	unit_assert(coro_bus_topic_recv(bus, t, s1, &data) == 0 && data == 5);
+	coro_bus_topic_close(bus, t);
+
+	unit_msg("block policy");
+	t = coro_bus_topic_open(bus, 1, CORO_BUS_TOPIC_BLOCK);
+	s1 = coro_bus_subscribe(bus, t);
+	unit_assert(coro_bus_publish(bus, t, 1) == 0);
+	struct ctx_topic ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.bus = bus;
+	ctx.topic = t;
+	ctx.data = 2;
+	struct coro *c = coro_new(topic_publish_f, &ctx);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_topic_recv(bus, t, s1, &data) == 0 && data == 1);
+	unit_assert(coro_join(c) == NULL && ctx.rc == 0);
+	unit_assert(coro_bus_topic_recv(bus, t, s1, &data) == 0 && data == 2);
+
+	unit_msg("blocked subscribers are woken up by a publish");
+	struct ctx_topic ctx2;
+	ctx.sub = s1;
+	ctx.is_done = false;
+	ctx2 = ctx;
+	ctx2.sub = coro_bus_subscribe(bus, t);
+	c = coro_new(topic_recv_f, &ctx);
+	struct coro *c2 = coro_new(topic_recv_f, &ctx2);
+	coro_yield();
+	unit_assert(!ctx.is_done && !ctx2.is_done);
+	unit_assert(coro_bus_publish(bus, t, 3) == 0);
+	unit_assert(coro_join(c) == NULL && ctx.rc == 0 && ctx.data == 3);
+	unit_assert(coro_join(c2) == NULL && ctx2.rc == 0 && ctx2.data == 3);
+
+	unit_msg("close wakes up the subscribers");
+	ctx.is_done = false;
+	c = coro_new(topic_recv_f, &ctx);
+	coro_yield();
+	coro_bus_topic_close(bus, t);
+	unit_assert(coro_join(c) == NULL && ctx.rc == -1);
+	unit_assert(ctx.err == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("overwrite policy");
+	t = coro_bus_topic_open(bus, 3, CORO_BUS_TOPIC_OVERWRITE);
+	s1 = coro_bus_subscribe(bus, t);
+	for (unsigned i = 1; i <= 5; ++i)
+		unit_assert(coro_bus_try_publish(bus, t, i) == 0);
+	for (unsigned i = 3; i <= 5; ++i) {
+		unit_assert(coro_bus_topic_recv(bus, t, s1, &data) == 0);
+		unit_assert(data == i);
+	}
+	unit_assert(coro_bus_topic_try_recv(bus, t, s1, &data) == -1);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct ctx_select {
+	struct coro_bus *bus;
+	struct coro_bus_select_case *cases;
+	unsigned count;
+	int rc;
+	enum coro_bus_error_code err;
+	bool is_done;
+};
+
+static void *
+select_f(void *arg)
+{
+	struct ctx_select *ctx = arg;
+	ctx->rc = coro_bus_select(ctx->bus, ctx->cases, ctx->count, false);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+test_select(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 1);
+	int c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0 && c2 >= 0);
+	struct coro_bus_select_case cases[3];
+	cases[0].channel = c1;
+	cases[0].op = CORO_BUS_SELECT_RECV;
+	cases[1].channel = c2;
+	cases[1].op = CORO_BUS_SELECT_RECV;
+
+	unit_msg("nothing is ready");
+	unit_assert(coro_bus_try_select(bus, cases, 2, false) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("the first ready case is done");
+	unit_assert(coro_bus_send(bus, c2, 5) == 0);
+	unit_assert(coro_bus_select(bus, cases, 2, false) == 1);
+	unit_assert(cases[1].data == 5);
+	unit_assert(coro_bus_send(bus, c1, 6) == 0);
+	unit_assert(coro_bus_send(bus, c2, 7) == 0);
+	unit_assert(coro_bus_select(bus, cases, 2, false) == 0);
+	unit_assert(cases[0].data == 6);
+	unit_assert(coro_bus_select(bus, cases, 2, false) == 1);
+	unit_assert(cases[1].data == 7);
+
+	unit_msg("send case");
+	cases[2].channel = c1;
+	cases[2].op = CORO_BUS_SELECT_SEND;
+	cases[2].data = 8;
+	unit_assert(coro_bus_select(bus, cases, 3, false) == 2);
+	unit_assert(coro_bus_select(bus, cases, 3, false) == 0);
+	unit_assert(cases[0].data == 8);
+
+	unit_msg("fair select alternates between busy channels");
+	int counts[2] = {0, 0};
+	for (int i = 0; i < 10; ++i) {
+		unit_assert(coro_bus_send(bus, c1, 1) == 0);
+		unit_assert(coro_bus_send(bus, c2, 2) == 0);
+		int rc = coro_bus_select(bus, cases, 2, true);
+		unit_assert(rc == 0 || rc == 1);
+		++counts[rc];
+		unsigned data;
+		unit_assert(coro_bus_recv(bus, rc == 0 ? c2 : c1, &data) == 0);
+	}
+	unit_check(counts[0] == 5 && counts[1] == 5, "both are served");
+
+	unit_msg("waits on all the channels");
+	struct ctx_select ctx;
+	ctx.bus = bus;
+	ctx.cases = cases;
+	ctx.count = 2;
+	ctx.is_done = false;
+	struct coro *c = coro_new(select_f, &ctx);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_send(bus, c2, 9) == 0);
+	unit_assert(coro_join(c) == NULL);
+	unit_assert(ctx.rc == 1 && cases[1].data == 9);
+
+	unit_msg("close wakes up the select");
+	ctx.is_done = false;
+	c = coro_new(select_f, &ctx);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	coro_bus_channel_close(bus, c1);
+	unit_assert(coro_join(c) == NULL);
+	unit_assert(ctx.rc == -1 && ctx.err == CORO_BUS_ERR_NO_CHANNEL);
+	unsigned data;
+	unit_assert(coro_bus_try_recv(bus, c2, &data) == -1);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+timed_send_f(void *arg)
+{
+	struct ctx_send *ctx = arg;
+	coro_sleep(0.01);
+	unit_assert(coro_bus_send(ctx->bus, ctx->channel, ctx->data) == 0);
+	return NULL;
+}
+
+static void
+test_timed(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 1);
+	int c2 = coro_bus_channel_open_mode(bus, 2, CORO_BUS_CHANNEL_MPMC);
+	unit_assert(c1 >= 0 && c2 >= 0);
+	unsigned data;
+
+	unit_msg("recv from an empty channel times out");
+	double start = coro_time();
+	unit_assert(coro_bus_recv_timed(bus, c1, &data, 0.01) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_TIMEOUT);
+	unit_assert(coro_bus_recv_timed(bus, c2, &data, 0.01) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_TIMEOUT);
+	unit_check(coro_time() - start >= 0.02, "waited for the timeouts");
+
+	unit_msg("send to a full channel times out");
+	unit_assert(coro_bus_send_timed(bus, c1, 1, 0.01) == 0);
+	unit_assert(coro_bus_send_timed(bus, c1, 2, 0.01) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_TIMEOUT);
+	unit_assert(coro_bus_try_send(bus, c2, 1) == 0);
+	unit_assert(coro_bus_try_send(bus, c2, 2) == 0);
+	unit_assert(coro_bus_send_timed(bus, c2, 3, 0.01) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_TIMEOUT);
+	unit_assert(coro_bus_recv_timed(bus, c1, &data, 0) == 0 && data == 1);
+	unit_assert(coro_bus_recv_timed(bus, c2, &data, 0) == 0 && data == 1);
+	unit_assert(coro_bus_recv_timed(bus, c2, &data, 0) == 0 && data == 2);
+
+	unit_msg("a message arrives before the timeout");
+	int channels[2] = {c1, c2};
+	for (int i = 0; i < 2; ++i) {
+		struct ctx_send ctx;
+		ctx.bus = bus;
+		ctx.channel = channels[i];
+		ctx.data = 3;
+		struct coro *c = coro_new(timed_send_f, &ctx);
+		unit_assert(coro_bus_recv_timed(bus, channels[i], &data,
+			100) == 0);
+		unit_assert(data == 3);
+		unit_assert(coro_join(c) == NULL);
+	}
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct ctx_cross_thread {
+	struct coro_bus *bus;
+	int channel;
+	unsigned data_count;
+	unsigned long long sum;
+};
+
+static void *
+cross_thread_recv_f(void *arg)
+{
+	struct ctx_cross_thread *ctx = arg;
+	for (unsigned i = 0; i < ctx->data_count; ++i) {
+		unsigned data = 0;
+		unit_assert(coro_bus_recv(ctx->bus, ctx->channel, &data) == 0);
+		unit_assert(data == i);
+	}
+	return NULL;
+}
+
+static void *
+cross_thread_engine_f(void *arg)
+{
+	coro_sched_init();
+	struct coro *c = coro_new(cross_thread_recv_f, arg);
+	coro_sched_run();
+	unit_assert(coro_join(c) == NULL);
+	coro_sched_destroy();
+	return NULL;
+}
+
+static void
+test_cross_thread_spsc(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open_mode(bus, 4, CORO_BUS_CHANNEL_SPSC);
+	unit_assert(c1 >= 0);
+
+	unit_msg("receiver in the engine of another thread");
+	struct ctx_cross_thread ctx;
+	ctx.bus = bus;
+	ctx.channel = c1;
+	ctx.data_count = 100000;
+	pthread_t thread;
+	unit_fail_if(pthread_create(&thread, NULL, cross_thread_engine_f,
+		&ctx) != 0);
+	for (unsigned i = 0; i < ctx.data_count; ++i)
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+	pthread_join(thread, NULL);
+
+	unit_msg("the size limit is rounded up to a power of 2");
+	for (unsigned i = 0; i < 4; ++i)
+		unit_assert(coro_bus_try_send(bus, c1, i) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 4) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	coro_bus_channel_close(bus, c1);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void *
+cross_thread_send_f(void *arg)
+{
+	struct ctx_cross_thread *ctx = arg;
+	for (unsigned i = 1; i <= ctx->data_count; ++i)
+		unit_assert(coro_bus_send(ctx->bus, ctx->channel, i) == 0);
+	return NULL;
+}
+
+static void *
+cross_thread_sum_f(void *arg)
+{
+	struct ctx_cross_thread *ctx = arg;
+	for (unsigned i = 0; i < ctx->data_count; ++i) {
+		unsigned data = 0;
+		unit_assert(coro_bus_recv(ctx->bus, ctx->channel, &data) == 0);
+		ctx->sum += data;
+	}
+	return NULL;
+}
+
+static void *
+cross_thread_mpmc_f(void *arg)
+{
+	struct coro_bus *bus = arg;
+	enum { worker_count = 4 };
+	int c1 = coro_bus_channel_open_mode(bus, 8, CORO_BUS_CHANNEL_MPMC);
+	unit_assert(c1 >= 0);
+	struct ctx_cross_thread contexts[worker_count];
+	struct coro *senders[worker_count];
+	struct coro *receivers[worker_count];
+	for (int i = 0; i < worker_count; ++i) {
+		struct ctx_cross_thread *ctx = &contexts[i];
+		ctx->bus = bus;
+		ctx->channel = c1;
+		ctx->data_count = 10000;
+		ctx->sum = 0;
+		senders[i] = coro_new(cross_thread_send_f, ctx);
+		receivers[i] = coro_new(cross_thread_sum_f, ctx);
+	}
+	unsigned long long sum = 0;
+	for (int i = 0; i < worker_count; ++i) {
+		unit_assert(coro_join(senders[i]) == NULL);
+		unit_assert(coro_join(receivers[i]) == NULL);
+		sum += contexts[i].sum;
+	}
+	unsigned long long n = contexts[0].data_count;
+	unit_assert(sum == worker_count * n * (n + 1) / 2);
+	coro_bus_channel_close(bus, c1);
+	return NULL;
+}
+
+static void
+test_cross_thread_mpmc(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	unit_msg("senders and receivers on the M:N scheduler");
+	unit_check(coro_sched_run_mt(4, cross_thread_mpmc_f, bus) == NULL,
+		"all messages are delivered");
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 #if NEED_BROADCAST
 struct ctx_broadcast {
 	struct coro_bus *bus;
@@ -1151,6 +1666,23 @@ test_send_vector_blocking(void)
 	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 4);
 	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 5);
 
+	unit_msg("send-v wakes up a plain recv per message");
+	const unsigned coro_count = 3;
+	unsigned datas[coro_count];
+	struct ctx_recv recv_ctx[coro_count];
+	for (unsigned i = 0; i < coro_count; ++i)
+		recv_start(&recv_ctx[i], bus, c1, &datas[i]);
+	coro_yield();
+	for (unsigned i = 0; i < coro_count; ++i)
+		unit_assert(recv_ctx[i].is_started && !recv_ctx[i].is_done);
+	unit_assert(coro_bus_send_v(bus, c1, data3, 3) == 3);
+	unsigned sum = 0;
+	for (unsigned i = 0; i < coro_count; ++i) {
+		unit_assert(recv_join(&recv_ctx[i]) == 0);
+		sum += datas[i];
+	}
+	unit_assert(sum == 1 + 2 + 3);
+
 	coro_bus_channel_close(bus, c1);
 	coro_bus_delete(bus);
 	unit_test_finish();
@@ -1443,6 +1975,22 @@ test_recv_vector_blocking(void)
 	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
 	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
 
+	unit_msg("recv-v wakes up a plain send per freed slot");
+	for (unsigned i = 1; i <= 10; ++i)
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+	const unsigned coro_count = 3;
+	struct ctx_send send_ctx[coro_count];
+	for (unsigned i = 0; i < coro_count; ++i)
+		send_start(&send_ctx[i], bus, c1, 11 + i);
+	coro_yield();
+	for (unsigned i = 0; i < coro_count; ++i)
+		unit_assert(send_ctx[i].is_started && !send_ctx[i].is_done);
+	unit_assert(coro_bus_recv_v(bus, c1, data4, 3) == 3);
+	for (unsigned i = 0; i < coro_count; ++i)
+		unit_assert(send_join(&send_ctx[i]) == 0);
+	for (unsigned i = 4; i <= 13; ++i)
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == i);
+
 	coro_bus_channel_close(bus, c1);
 	coro_bus_delete(bus);
 	unit_test_finish();
@@ -1566,6 +2114,11 @@ coro_main_f(void *arg)
 	test_send_recv_very_many();
 	test_wakeup_on_close();
 	test_close_non_empty_bus();
+	test_send_msg();
+	test_topic();
+	test_select();
+	test_timed();
+	test_cross_thread_spsc();
 
 	test_broadcast_basic();
 	test_broadcast_blocking();
@@ -1600,5 +2153,7 @@ main(int argc, char **argv)
 	void *rc = coro_join(main_coro);
 	unit_check(rc == NULL, "main coro rc");
 	coro_sched_destroy();
+
+	test_cross_thread_mpmc();
 	return 0;
 }
@@ -2,6 +2,9 @@
 #include "unit.h"
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
 static void
@@ -469,6 +472,301 @@ test_resize(void)
 #endif
 }
 
+static void
+test_seek(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char buf[3000];
+	for (int i = 0; i < (int)sizeof(buf); ++i)
+		buf[i] = 'a' + i % 26;
+	unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+
+	char buf2[100];
+	unit_check(ufs_seek(fd, 1000) == 1000, "seek inside the file");
+	unit_check(ufs_read(fd, buf2, 100) == 100, "read after seek");
+	unit_check(memcmp(buf2, buf + 1000, 100) == 0, "data is correct");
+	unit_check(ufs_seek(fd, 0) == 0, "seek to the start");
+	unit_check(ufs_write(fd, "123", 3) == 3, "overwrite");
+	unit_fail_if(ufs_seek(fd, 0) != 0);
+	unit_check(ufs_read(fd, buf2, 5) == 5 &&
+		   memcmp(buf2, "123de", 5) == 0, "overwritten data");
+	unit_check(ufs_seek(fd, 100000) == sizeof(buf),
+		   "seek beyond the end stops at the end");
+	unit_check(ufs_read(fd, buf2, 1) == 0, "EOF");
+	unit_check(ufs_seek(fd + 1, 0) == -1, "bad descriptor");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_big_writes(void)
+{
+	unit_test_start();
+
+	/*
+	 * Odd sized writes and reads cross the boundaries of the growing
+	 * pieces of file memory. Files deleted in between give their
+	 * memory to the next ones.
+	 */
+	int size = 3 * 1024 * 1024 + 123;
+	char *buf = (char *) malloc(size);
+	char *buf2 = (char *) malloc(size);
+	for (int i = 0; i < size; ++i)
+		buf[i] = i % 251;
+	for (int round = 0; round < 3; ++round) {
+		int fd = ufs_open("big", UFS_CREATE);
+		unit_fail_if(fd == -1);
+		int small = ufs_open("small", UFS_CREATE);
+		unit_fail_if(small == -1);
+		int step = 777 + round * 50000;
+		for (int pos = 0; pos < size; pos += step) {
+			int len = size - pos < step ? size - pos : step;
+			unit_fail_if(ufs_write(fd, buf + pos, len) != len);
+			unit_fail_if(ufs_write(small, buf, 100) != 100);
+		}
+		unit_fail_if(ufs_seek(fd, 0) != 0);
+		unit_fail_if(ufs_read(fd, buf2, size) != size);
+		unit_fail_if(memcmp(buf, buf2, size) != 0);
+		for (int pos = 1; pos < size; pos = pos * 3 + 1) {
+			unit_fail_if(ufs_seek(fd, pos - 1) != pos - 1);
+			unit_fail_if(ufs_read(fd, buf2, 3) !=
+				     (size - pos + 1 < 3 ? size - pos + 1 : 3));
+			unit_fail_if(memcmp(buf + pos - 1, buf2, 2) != 0);
+		}
+		unit_fail_if(ufs_close(small) != 0);
+		unit_fail_if(ufs_delete("small") != 0);
+		unit_fail_if(ufs_close(fd) != 0);
+		unit_fail_if(ufs_delete("big") != 0);
+	}
+	unit_check(true, "big writes and reads");
+	free(buf2);
+	free(buf);
+
+	unit_test_finish();
+}
+
+static void
+test_many_files(void)
+{
+	unit_test_start();
+
+	/*
+	 * Files are deleted while the name index grows, and descriptor
+	 * numbers are reused.
+	 */
+	const int count = 2000;
+	bool *is_deleted = (bool *) calloc(count, sizeof(bool));
+	char name[32], buf[32];
+	for (int i = 0; i < count; ++i) {
+		int name_len = sprintf(name, "many%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_write(fd, name, name_len) != name_len);
+		unit_fail_if(ufs_close(fd) != 0);
+		if (i % 3 == 0) {
+			sprintf(name, "many%d", i / 2);
+			unit_fail_if(ufs_delete(name) != 0);
+			is_deleted[i / 2] = true;
+		}
+	}
+	int first_fd = -1;
+	bool is_reused = true;
+	bool is_ok = true;
+	for (int i = 0; i < count; ++i) {
+		int name_len = sprintf(name, "many%d", i);
+		int fd = ufs_open(name, 0);
+		if (first_fd == -1)
+			first_fd = fd;
+		is_reused = is_reused && (fd == -1 || fd == first_fd);
+		if (is_deleted[i]) {
+			is_ok = is_ok && fd == -1;
+			continue;
+		}
+		is_ok = is_ok && fd != -1 &&
+			ufs_read(fd, buf, sizeof(buf)) == name_len &&
+			memcmp(buf, name, name_len) == 0;
+		unit_fail_if(ufs_close(fd) != 0);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	unit_check(is_ok, "exactly the deleted files are not found");
+	unit_check(is_reused, "a closed descriptor is reused");
+	unit_check(ufs_open("many1", 0) == -1, "all the files are deleted");
+	free(is_deleted);
+
+	unit_test_finish();
+}
+
+static void
+test_vectors(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+
+	char head[] = "head", body[3000], tail[] = "tail";
+	for (int i = 0; i < (int)sizeof(body); ++i)
+		body[i] = 'a' + i % 26;
+	struct iovec in[] = {
+		{head, 4}, {NULL, 0}, {body, sizeof(body)}, {tail, 4},
+	};
+	ssize_t size = 8 + sizeof(body);
+	unit_check(ufs_writev(fd, in, 4) == size, "writev");
+
+	char buf[2][sizeof(body) + 8];
+	ufs_seek(fd, 0);
+	struct iovec out[] = {{buf[0], 100}, {buf[1], sizeof(buf[1])}};
+	unit_check(ufs_readv(fd, out, 2) == size, "readv to the end");
+	unit_check(memcmp(buf[0], "head", 4) == 0 &&
+		   memcmp(buf[0] + 4, body, 96) == 0 &&
+		   memcmp(buf[1], body + 96, sizeof(body) - 96) == 0 &&
+		   memcmp(buf[1] + sizeof(body) - 96, "tail", 4) == 0,
+		   "the data is split between the buffers");
+	unit_check(ufs_readv(fd, out, 2) == 0, "EOF");
+
+	/* The view is cut by the extents, but is the same data. */
+	ufs_seek(fd, 2);
+	struct iovec view_iov[8];
+	struct ufs_view *view;
+	int count = ufs_view(fd, size, view_iov, 8, &view);
+	unit_check(count > 1, "view spans several pieces");
+	char *pos = buf[0];
+	for (int i = 0; i < count; ++i) {
+		memcpy(pos, view_iov[i].iov_base, view_iov[i].iov_len);
+		pos += view_iov[i].iov_len;
+	}
+	unit_check(pos - buf[0] == size - 2, "view to the end");
+	unit_check(memcmp(buf[0], "ad", 2) == 0 &&
+		   memcmp(buf[0] + 2, body, sizeof(body)) == 0,
+		   "view gives the file data");
+	unit_check(ufs_read(fd, buf[0], 1) == 0, "view moves the position");
+
+	struct ufs_view *view2;
+	ufs_seek(fd, 0);
+	unit_check(ufs_view(fd, size, view_iov, 1, &view2) == 1 &&
+		   view_iov[0].iov_len < (size_t)size,
+		   "view is short when iov is small");
+
+	ufs_seek(fd, 0);
+	char *first = view_iov[0].iov_base;
+	unit_check(ufs_write(fd, "H", 1) == 1 && first[0] == 'H',
+		   "writes are visible through the view");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_check(first[1] == 'e' && memcmp(view_iov[0].iov_base, "He", 2) == 0,
+		   "the view outlives the descriptor and the file");
+	ufs_view_release(view2);
+	unit_check(ufs_open("file", 0) == -1, "the file stays deleted");
+	ufs_view_release(view);
+
+	unit_check(ufs_view(-1, 1, view_iov, 1, &view) == -1,
+		   "view of a bad descriptor");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+
+	unit_test_finish();
+}
+
+enum {
+	THREAD_COUNT = 8,
+	THREAD_ITERATIONS = 200,
+	THREAD_FILE_SIZE = 10000,
+};
+
+static char thread_data[THREAD_FILE_SIZE];
+
+static void *
+test_threads_f(void *arg)
+{
+	int id = *(int *)arg;
+	char name[32];
+	sprintf(name, "thread%d", id);
+	char *buf = malloc(THREAD_FILE_SIZE);
+	bool ok = true;
+
+	for (int i = 0; i < THREAD_ITERATIONS && ok; ++i) {
+		/* Own file: create, fill, read back, delete. */
+		int fd = ufs_open(name, UFS_CREATE);
+		ok = ok && fd != -1;
+		ok = ok && ufs_write(fd, thread_data, THREAD_FILE_SIZE) ==
+			THREAD_FILE_SIZE;
+		ok = ok && ufs_seek(fd, 0) == 0;
+		ok = ok && ufs_read(fd, buf, THREAD_FILE_SIZE) ==
+			THREAD_FILE_SIZE;
+		ok = ok && memcmp(buf, thread_data, THREAD_FILE_SIZE) == 0;
+		ok = ok && ufs_close(fd) == 0;
+		ok = ok && ufs_delete(name) == 0;
+
+		/*
+		 * Shared file: the writer rewrites it with the same data,
+		 * so the readers always see it whole.
+		 */
+		fd = ufs_open("shared", 0);
+		ok = ok && fd != -1;
+		if (id == 0) {
+			ok = ok && ufs_write(fd, thread_data, THREAD_FILE_SIZE) ==
+				THREAD_FILE_SIZE;
+		} else {
+			ok = ok && ufs_read(fd, buf, THREAD_FILE_SIZE) ==
+				THREAD_FILE_SIZE;
+			ok = ok && memcmp(buf, thread_data, THREAD_FILE_SIZE) == 0;
+		}
+		ok = ok && ufs_close(fd) == 0;
+
+		ok = ok && ufs_open("no_such_file", 0) == -1;
+		ok = ok && ufs_errno() == UFS_ERR_NO_FILE;
+	}
+	free(buf);
+	return (void *)ok;
+}
+
+static void
+test_threads(void)
+{
+	unit_test_start();
+
+	for (int i = 0; i < THREAD_FILE_SIZE; ++i)
+		thread_data[i] = 'a' + i % 26;
+	int fd = ufs_open("shared", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, thread_data, THREAD_FILE_SIZE) !=
+		     THREAD_FILE_SIZE);
+	unit_fail_if(ufs_seek(fd, 0) != 0);
+	char c;
+	unit_fail_if(ufs_read(fd, &c, 1) != 1);
+
+	pthread_t threads[THREAD_COUNT];
+	int ids[THREAD_COUNT];
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		ids[i] = i;
+		unit_fail_if(pthread_create(&threads[i], NULL, test_threads_f,
+					    &ids[i]) != 0);
+	}
+	bool ok = true;
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		void *result;
+		pthread_join(threads[i], &result);
+		ok = ok && result;
+	}
+	unit_check(ok, "threads use own and shared files in parallel");
+	unit_check(ufs_errno() == UFS_ERR_NO_ERR,
+		   "errors of the threads don't affect this one");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_delete("shared") == 0, "delete the shared file");
+	unit_check(ufs_open("thread0", 0) == -1,
+		   "the thread files are deleted");
+
+	unit_test_finish();
+}
+
 int
 main(int argc, char **argv)
 {
@@ -493,6 +791,11 @@ main(int argc, char **argv)
 	test_max_file_size();
 	test_rights();
 	test_resize();
+	test_seek();
+	test_big_writes();
+	test_many_files();
+	test_vectors();
+	test_threads();
 
 	/* Free the memory to make the memory leak detector happy. */
 	ufs_destroy();
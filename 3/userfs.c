@@ -1,91 +1,430 @@
 #include "userfs.h"
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 enum 
 {
+	/** Size of the first and the smallest extent of a file. */
 	BLOCK_SIZE = 512,
 	MAX_FILE_SIZE = 1024 * 1024 * 100,
+	/**
+	 * Extent number k of a file is BLOCK_SIZE << k bytes, but not
+	 * bigger than EXTENT_MAX_SIZE. So small files stay small, and
+	 * big ones take few big pieces of memory.
+	 */
+	EXTENT_MAX_CLASS = 11,
+	EXTENT_MAX_SIZE = BLOCK_SIZE << EXTENT_MAX_CLASS,
+	/** File bytes covered by the extents smaller than the max one. */
+	EXTENT_GROWTH_END = BLOCK_SIZE * ((1 << EXTENT_MAX_CLASS) - 1),
+	/** Memory the arena takes from malloc at once. */
+	ARENA_CHUNK_SIZE = EXTENT_MAX_SIZE,
+	/** Descriptors in a chunk of the descriptor table. */
+	FILE_DESC_CHUNK_SIZE = 1024,
+	FILE_DESC_CHUNK_COUNT = 4096,
 };
 
-/** Global error code. Set from any function on any error. */
-static enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+/**
+ * Error code of the calling thread. Set from any function on any
+ * error.
+ */
+static __thread enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
 
-struct block 
+/** Free extent in an arena free list. */
+struct arena_free
 {
-    /** Block memory. */
-    char *memory;
-    /** How many bytes are occupied. */
-    int occupied;
-    /** Next block in the file. */
-    struct block *next;
-    /** Previous block in the file. */
-    struct block *prev;
-
-    /* PUT HERE OTHER MEMBERS */
+    struct arena_free *next;
 };
 
+/**
+ * Memory of all the files. Extents smaller than the max one are cut
+ * from big chunks, each at an offset aligned by its size, and freed
+ * extents are reused by the next files. The chunks are returned to
+ * the system only by ufs_destroy(). The max extents are as big as a
+ * chunk and are taken from malloc directly.
+ */
+static struct {
+    /** Free extents of each class except the max one. */
+    struct arena_free *free_lists[EXTENT_MAX_CLASS];
+    /** Chunk the new extents are cut from. */
+    char *chunk;
+    /** Used bytes of the chunk. */
+    size_t chunk_used;
+    /** All the chunks, to free them on destroy. */
+    char **chunks;
+    int chunk_count;
+    int chunk_capacity;
+    /** Files of all the threads allocate here. */
+    pthread_mutex_t lock;
+} arena = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void
+arena_push(char *memory, int extent_class)
+{
+    struct arena_free *item = (struct arena_free *)memory;
+    item->next = arena.free_lists[extent_class];
+    arena.free_lists[extent_class] = item;
+}
+
+/**
+ * Put a part of the current chunk into the free lists as extents
+ * aligned by their size.
+ */
+static void
+arena_release_range(size_t from, size_t to)
+{
+    while (from < to) {
+        size_t piece = from & -from;
+        arena_push(arena.chunk + from, __builtin_ctzl(piece / BLOCK_SIZE));
+        from += piece;
+    }
+}
+
+static char *
+arena_alloc_locked(int extent_class)
+{
+    struct arena_free *item = arena.free_lists[extent_class];
+    if (item) {
+        arena.free_lists[extent_class] = item->next;
+        return (char *)item;
+    }
+
+    size_t size = (size_t)BLOCK_SIZE << extent_class;
+    size_t offset = (arena.chunk_used + size - 1) & ~(size - 1);
+    if (!arena.chunk || offset + size > ARENA_CHUNK_SIZE) {
+        if (arena.chunk_count == arena.chunk_capacity) {
+            int new_capacity = arena.chunk_capacity ? arena.chunk_capacity * 2 : 8;
+            char **new_chunks = realloc(arena.chunks, new_capacity * sizeof(char *));
+            if (!new_chunks)
+                return NULL;
+
+            arena.chunks = new_chunks;
+            arena.chunk_capacity = new_capacity;
+        }
+
+        char *chunk = malloc(ARENA_CHUNK_SIZE);
+        if (!chunk)
+            return NULL;
+
+        if (arena.chunk)
+            arena_release_range(arena.chunk_used, ARENA_CHUNK_SIZE);
+        arena.chunks[arena.chunk_count++] = chunk;
+        arena.chunk = chunk;
+        arena.chunk_used = 0;
+        offset = 0;
+    }
+
+    arena_release_range(arena.chunk_used, offset);
+    arena.chunk_used = offset + size;
+    return arena.chunk + offset;
+}
+
+static char *
+arena_alloc(int extent_class)
+{
+    if (extent_class == EXTENT_MAX_CLASS)
+        return malloc(EXTENT_MAX_SIZE);
+
+    pthread_mutex_lock(&arena.lock);
+    char *memory = arena_alloc_locked(extent_class);
+    pthread_mutex_unlock(&arena.lock);
+    return memory;
+}
+
+static void
+arena_free(char *memory, int extent_class)
+{
+    if (extent_class == EXTENT_MAX_CLASS) {
+        free(memory);
+        return;
+    }
+
+    pthread_mutex_lock(&arena.lock);
+    arena_push(memory, extent_class);
+    pthread_mutex_unlock(&arena.lock);
+}
+
+static void
+arena_destroy(void)
+{
+    for (int i = 0; i < arena.chunk_count; i++)
+        free(arena.chunks[i]);
+    free(arena.chunks);
+
+    arena.chunks = NULL;
+    arena.chunk_count = 0;
+    arena.chunk_capacity = 0;
+    arena.chunk = NULL;
+    arena.chunk_used = 0;
+    memset(arena.free_lists, 0, sizeof(arena.free_lists));
+}
+
+static int
+extent_class(int index)
+{
+    return index < EXTENT_MAX_CLASS ? index : EXTENT_MAX_CLASS;
+}
+
+/**
+ * Find the extent holding byte @a pos of a file, and the offset in
+ * it. The extent sizes are known in advance, so it is O(1).
+ */
+static int
+extent_locate(size_t pos, size_t *offset)
+{
+    if (pos < EXTENT_GROWTH_END) {
+        int index = 63 - __builtin_clzll(pos / BLOCK_SIZE + 1);
+        *offset = pos - (size_t)BLOCK_SIZE * ((1ull << index) - 1);
+        return index;
+    }
+
+    pos -= EXTENT_GROWTH_END;
+    *offset = pos % EXTENT_MAX_SIZE;
+    return EXTENT_MAX_CLASS + pos / EXTENT_MAX_SIZE;
+}
+
 struct file 
 {
-    /** Double-linked list of file blocks. */
-    struct block *block_list;
     /**
-     * Last block in the list above for fast access to the end
-     * of file.
+     * Extent table: memory of the i-th extent of the file. The
+     * extent of any position is found in O(1), see
+     * extent_locate().
+     */
+    char **extents;
+    /** How many extents are allocated. */
+    int extent_count;
+    /** Size of the extent table. */
+    int extent_capacity;
+    /** File size in bytes. All extents but the last one are full. */
+    size_t size;
+    /**
+     * Protects the extents and the size. Reads of the file run in
+     * parallel, writes are exclusive.
+     */
+    pthread_rwlock_t lock;
+    /**
+     * References to the file: one from the name until the file is
+     * deleted, one from each opened descriptor and one from each
+     * view borrowing the file memory. The last one frees the file.
      */
-    struct block *last_block;
-    /** How many file descriptors are opened on the file. */
     int refs;
     /** File name. */
     char *name;
+    /** Hash of the name, to skip most of the compares. */
+    uint64_t hash;
     /** Files are stored in a double-linked list. */
     struct file *next;
     struct file *prev;
 
     /* PUT HERE OTHER MEMBERS */
-
-    /** Flag to show if the file is deleted. */
-    int deleted;
 };
 
 /** List of all files. */
 static struct file *file_list = NULL;
 
+/**
+ * Protects the file list and the name index below. Opens of the
+ * existing files run in parallel, creation and deletion are
+ * exclusive.
+ */
+static pthread_rwlock_t file_list_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/** Slot of a removed file. Lookups go past it, inserts reuse it. */
+#define FILE_INDEX_TOMBSTONE ((struct file *)1)
+
+/**
+ * Open addressing hash table of the files which are not deleted,
+ * with linear probing.
+ */
+struct file_table
+{
+    struct file **slots;
+    /** Slot count, a power of 2. */
+    size_t capacity;
+    /** Files and tombstones. */
+    size_t used;
+};
+
+/**
+ * File name index. When the table gets full, a new one is created
+ * and the files are moved to it a few at a time by the next inserts
+ * and removals, so no single ufs_open() pays for rehashing all the
+ * files. Until then lookups check both tables.
+ */
+static struct {
+    struct file_table table;
+    /** The previous table being drained, or empty. */
+    struct file_table old;
+    /** Slots of the old table already moved. */
+    size_t moved;
+    /** Files in both tables. */
+    size_t count;
+} file_index;
+
+enum {
+    FILE_INDEX_MIN_CAPACITY = 16,
+    /** Old table slots moved per insert or removal. */
+    FILE_INDEX_MOVE_STEP = 16,
+};
+
+static uint64_t
+file_name_hash(const char *name)
+{
+    /* FNV-1a. */
+    uint64_t hash = 14695981039346656037ull;
+    for (const unsigned char *c = (const unsigned char *)name; *c; c++) {
+        hash ^= *c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static struct file **
+file_table_find(const struct file_table *table, const char *name, uint64_t hash)
+{
+    if (!table->slots)
+        return NULL;
+
+    size_t mask = table->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct file *f = table->slots[i];
+        if (!f)
+            return NULL;
+        if (f != FILE_INDEX_TOMBSTONE && f->hash == hash &&
+            strcmp(f->name, name) == 0)
+            return &table->slots[i];
+    }
+}
+
+static void
+file_table_insert(struct file_table *table, struct file *file)
+{
+    size_t mask = table->capacity - 1;
+    size_t i = file->hash & mask;
+    while (table->slots[i] && table->slots[i] != FILE_INDEX_TOMBSTONE)
+        i = (i + 1) & mask;
+    if (!table->slots[i])
+        table->used++;
+    table->slots[i] = file;
+}
+
+/** Move up to @a count slots of the old table to the new one. */
+static void
+file_index_move(size_t count)
+{
+    struct file_table *old = &file_index.old;
+    if (!old->slots)
+        return;
+
+    for (; count > 0 && file_index.moved < old->capacity; count--) {
+        struct file **slot = &old->slots[file_index.moved++];
+        if (*slot && *slot != FILE_INDEX_TOMBSTONE) {
+            file_table_insert(&file_index.table, *slot);
+            /* Lookups in the old table must not find it anymore. */
+            *slot = FILE_INDEX_TOMBSTONE;
+        }
+    }
+
+    if (file_index.moved == old->capacity) {
+        free(old->slots);
+        memset(old, 0, sizeof(*old));
+        file_index.moved = 0;
+    }
+}
+
+static struct file*
+find_file(const char *name) 
+{
+    uint64_t hash = file_name_hash(name);
+    struct file **slot = file_table_find(&file_index.table, name, hash);
+    if (!slot)
+        slot = file_table_find(&file_index.old, name, hash);
+
+    return slot ? *slot : NULL;
+}
+
+static enum ufs_error_code
+file_index_insert(struct file *file)
+{
+    struct file_table *table = &file_index.table;
+    if ((table->used + 1) * 2 > table->capacity) {
+        /* Can't start a new rehash before the last one is done. */
+        file_index_move(SIZE_MAX);
+
+        size_t capacity = FILE_INDEX_MIN_CAPACITY;
+        while (capacity < (file_index.count + 1) * 4)
+            capacity *= 2;
+        struct file **slots = calloc(capacity, sizeof(struct file *));
+        if (!slots)
+            return UFS_ERR_NO_MEM;
+
+        file_index.old = *table;
+        file_index.moved = 0;
+        table->slots = slots;
+        table->capacity = capacity;
+        table->used = 0;
+    }
+
+    file_table_insert(table, file);
+    file_index.count++;
+    file_index_move(FILE_INDEX_MOVE_STEP);
+
+    return UFS_ERR_NO_ERR;
+}
+
+static void
+file_index_remove(struct file *file)
+{
+    struct file **slot = file_table_find(&file_index.table, file->name, file->hash);
+    if (!slot)
+        slot = file_table_find(&file_index.old, file->name, file->hash);
+
+    *slot = FILE_INDEX_TOMBSTONE;
+    file_index.count--;
+    file_index_move(FILE_INDEX_MOVE_STEP);
+}
+
+static void
+file_index_destroy(void)
+{
+    free(file_index.table.slots);
+    free(file_index.old.slots);
+    memset(&file_index, 0, sizeof(file_index));
+}
+
 struct filedesc 
 {
     struct file *file;
 
     /* PUT HERE OTHER MEMBERS */
 
-    /** Current block number. */
-    int block_number;
-    /** Current offset in the block. */
-    int block_offset;
+    /** Current position in the file. */
+    size_t pos;
     /** Mode in which the file was opened. */
     enum open_flags flags;
 };
 
 /**
- * An array of file descriptors. When a file descriptor is
+ * A table of file descriptors. When a file descriptor is
  * created, its pointer drops here. When a file descriptor is
- * closed, its place in this array is set to NULL and can be
- * taken by next ufs_open() call.
+ * closed, its place in this table is set to NULL and can be
+ * taken by next ufs_open() call. The table is allocated by
+ * chunks which never move, so the descriptors are found without
+ * locks. Only ufs_open() and ufs_close() take the lock.
  */
-static struct filedesc **file_descriptors = NULL;
+static struct filedesc **file_descriptors[FILE_DESC_CHUNK_COUNT];
+/** Descriptor numbers ever given out. */
 static int file_descriptor_count = 0;
-static int file_descriptor_capacity = 0;
-
-static struct file*
-find_file(const char *name) 
-{
-    for (struct file *f = file_list; f; f = f->next) {
-        if (strcmp(f->name, name) == 0 && !f->deleted)
-            return f;
-    }
-
-    return NULL;
-}
+/**
+ * Stack of the closed descriptor numbers below
+ * file_descriptor_count, so ufs_open() doesn't search for a free
+ * one. Has room for all the allocated chunks.
+ */
+static int *free_descriptors = NULL;
+static int free_descriptor_count = 0;
+static pthread_mutex_t file_descriptor_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static int 
 is_writable(const struct filedesc *desc) 
@@ -115,63 +454,108 @@ validate_desc(const struct filedesc *desc, int (*prog) (const struct filedesc*))
     return 0;
 }
 
-static int 
-validate_empty_file(const struct block* block)
+static struct filedesc* 
+ufs_find_filedesc(const int file_desc) 
 {
-    if (!block) {
-        ufs_error_code = UFS_ERR_NO_ERR;
-        return 0;
+    if (file_desc < 0 || file_desc >= FILE_DESC_CHUNK_SIZE * FILE_DESC_CHUNK_COUNT)
+        return NULL;
+
+    struct filedesc **chunk = __atomic_load_n(
+        &file_descriptors[file_desc / FILE_DESC_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+    if (!chunk)
+        return NULL;
+
+    return __atomic_load_n(&chunk[file_desc % FILE_DESC_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+}
+
+/** Give a number to @a desc and publish it. */
+static int
+file_desc_insert(struct filedesc *desc)
+{
+    pthread_mutex_lock(&file_descriptor_lock);
+
+    int fd;
+    if (free_descriptor_count) {
+        fd = free_descriptors[--free_descriptor_count];
+    } else {
+        fd = file_descriptor_count;
+        int chunk_index = fd / FILE_DESC_CHUNK_SIZE;
+        if (fd % FILE_DESC_CHUNK_SIZE == 0) {
+            /* Closes must not fail, so the stack grows beforehand. */
+            int *new_free = chunk_index == FILE_DESC_CHUNK_COUNT ? NULL :
+                realloc(free_descriptors, (fd + FILE_DESC_CHUNK_SIZE) * sizeof(int));
+            if (!new_free) {
+                pthread_mutex_unlock(&file_descriptor_lock);
+                return -1;
+            }
+            free_descriptors = new_free;
+
+            struct filedesc **chunk = calloc(FILE_DESC_CHUNK_SIZE, sizeof(*chunk));
+            if (!chunk) {
+                pthread_mutex_unlock(&file_descriptor_lock);
+                return -1;
+            }
+            __atomic_store_n(&file_descriptors[chunk_index], chunk, __ATOMIC_RELEASE);
+        }
+        file_descriptor_count++;
     }
 
-    return -2;
+    __atomic_store_n(&file_descriptors[fd / FILE_DESC_CHUNK_SIZE][fd % FILE_DESC_CHUNK_SIZE],
+                     desc, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&file_descriptor_lock);
+    return fd;
 }
 
-static struct filedesc* 
-ufs_find_filedesc(const int file_desc) 
+static void
+file_desc_remove(int fd)
 {
-    if (file_desc < 0 || file_desc >= file_descriptor_count || !file_descriptors[file_desc])
-        return NULL;
-    
-    return file_descriptors[file_desc];
+    pthread_mutex_lock(&file_descriptor_lock);
+    __atomic_store_n(&file_descriptors[fd / FILE_DESC_CHUNK_SIZE][fd % FILE_DESC_CHUNK_SIZE],
+                     NULL, __ATOMIC_RELAXED);
+    free_descriptors[free_descriptor_count++] = fd;
+    pthread_mutex_unlock(&file_descriptor_lock);
 }
 
 static enum ufs_error_code 
-ufs_add_block(struct file *file) 
+ufs_add_extent(struct file *file) 
 {
-    struct block *new_block = malloc(sizeof(struct block));
-    if (!new_block)
-        return UFS_ERR_NO_MEM;
+    if (file->extent_count == file->extent_capacity) {
+        int new_capacity = file->extent_capacity ? file->extent_capacity * 2 : 4;
+        char **new_extents = realloc(file->extents, new_capacity * sizeof(char *));
+        if (!new_extents)
+            return UFS_ERR_NO_MEM;
+
+        file->extents = new_extents;
+        file->extent_capacity = new_capacity;
+    }
 
-    new_block->memory = malloc(BLOCK_SIZE);
-    if (!new_block->memory) {
-        free(new_block);
+    char *memory = arena_alloc(extent_class(file->extent_count));
+    if (!memory)
         return UFS_ERR_NO_MEM;
-    }
 
-    new_block->occupied = 0;
-    new_block->next = NULL;
-    new_block->prev = file->last_block;
-    
-    if (file->last_block)
-        file->last_block->next = new_block;
-    else
-        file->block_list = new_block;
-    file->last_block = new_block;
+    file->extents[file->extent_count++] = memory;
 
     return UFS_ERR_NO_ERR;
 }
 
 static void 
-free_file(struct file *file) 
+free_extents(struct file *file) 
 {
-    struct block *blk = file->block_list;
+    for (int i = 0; i < file->extent_count; i++)
+        arena_free(file->extents[i], extent_class(i));
+    free(file->extents);
+
+    file->extents = NULL;
+    file->extent_count = 0;
+    file->extent_capacity = 0;
+    file->size = 0;
+}
 
-    while (blk) {
-        struct block *next_blk = blk->next;
-        free(blk->memory);
-        free(blk);
-        blk = next_blk;
-    }
+static void 
+free_file(struct file *file) 
+{
+    free_extents(file);
 
     if (file->prev)
         file->prev->next = file->next;
@@ -180,10 +564,69 @@ free_file(struct file *file)
     if (file->next)
         file->next->prev = file->prev;
 
+    pthread_rwlock_destroy(&file->lock);
     free(file->name);
     free(file);
 }
 
+static void
+file_ref(struct file *file)
+{
+    __atomic_add_fetch(&file->refs, 1, __ATOMIC_RELAXED);
+}
+
+/** Drop a reference, and free the file if it was the last one. */
+static void
+file_unref(struct file *file)
+{
+    if (__atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    pthread_rwlock_wrlock(&file_list_lock);
+    free_file(file);
+    pthread_rwlock_unlock(&file_list_lock);
+}
+
+/**
+ * Create a file with the name @a filename and put it into the
+ * index. The caller holds the file list lock for writing.
+ */
+static struct file *
+file_create(const char *filename)
+{
+    struct file *f = malloc(sizeof(struct file));
+    if (!f)
+        return NULL;
+
+    f->name = strdup(filename);
+    if (!f->name) {
+        free(f);
+        return NULL;
+    }
+
+    f->hash = file_name_hash(filename);
+    if (file_index_insert(f) != UFS_ERR_NO_ERR) {
+        free(f->name);
+        free(f);
+        return NULL;
+    }
+
+    f->extents = NULL;
+    f->extent_count = 0;
+    f->extent_capacity = 0;
+    f->size = 0;
+    pthread_rwlock_init(&f->lock, NULL);
+    /* The name holds the file until it is deleted. */
+    f->refs = 1;
+    f->next = file_list;
+    f->prev = NULL;
+    if (file_list)
+        file_list->prev = f;
+
+    file_list = f;
+    return f;
+}
+
 enum ufs_error_code
 ufs_errno() 
 {
@@ -198,31 +641,25 @@ ufs_open(const char *filename, int flags)
         return -1;
     }
 
+    pthread_rwlock_rdlock(&file_list_lock);
     struct file *f = find_file(filename);
+    if (f)
+        file_ref(f);
+    pthread_rwlock_unlock(&file_list_lock);
 
     if (!f && (flags & UFS_CREATE)) {
-        f = malloc(sizeof(struct file));
+        pthread_rwlock_wrlock(&file_list_lock);
+        /* Another thread could create it meanwhile. */
+        f = find_file(filename);
+        if (!f)
+            f = file_create(filename);
         if (!f) {
+            pthread_rwlock_unlock(&file_list_lock);
             ufs_error_code = UFS_ERR_NO_MEM;
             return -1;
         }
-
-        f->name = strdup(filename);
-        if (!f->name) {
-            free(f);
-            ufs_error_code = UFS_ERR_NO_MEM;
-            return -1;
-        }
-
-        f->block_list = f->last_block = NULL;
-        f->refs = 0;
-        f->deleted = 0;
-        f->next = file_list;
-        f->prev = NULL;
-        if (file_list)
-            file_list->prev = f;
-	    
-        file_list = f;
+        file_ref(f);
+        pthread_rwlock_unlock(&file_list_lock);
     }
     
     if (!f) {
@@ -230,39 +667,103 @@ ufs_open(const char *filename, int flags)
         return -1;
     }
 
-    if (f->deleted && (flags & UFS_CREATE)) {
-        f->deleted = 0;
-        f->block_list = f->last_block = NULL;
-        f->refs = 0;
-    }
-
-    if (file_descriptor_count == file_descriptor_capacity) {
-        int new_capacity = file_descriptor_capacity ? file_descriptor_capacity * 2 : 10;
-        struct filedesc **new_descriptors = realloc(file_descriptors, new_capacity * sizeof(struct filedesc *));
-        if (!new_descriptors) {
-            ufs_error_code = UFS_ERR_NO_MEM;
-            return -1;
-        }
-        
-        file_descriptors = new_descriptors;
-        file_descriptor_capacity = new_capacity;
-    }
-
     struct filedesc *file_desc = malloc(sizeof(struct filedesc));
     if (!file_desc) {
+        file_unref(f);
         ufs_error_code = UFS_ERR_NO_MEM;
         return -1;
     }
 
     file_desc->file = f;
-    file_desc->block_number = 0;
-    file_desc->block_offset = 0;
+    file_desc->pos = 0;
     file_desc->flags = flags & (UFS_READ_ONLY | UFS_WRITE_ONLY | UFS_READ_WRITE);
 
-    file_descriptors[file_descriptor_count] = file_desc;
-    f->refs++;
+    int fd = file_desc_insert(file_desc);
+    if (fd < 0) {
+        free(file_desc);
+        file_unref(f);
+        ufs_error_code = UFS_ERR_NO_MEM;
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Write at the position of @a desc, and move it. The size is
+ * checked by the caller. Stops early only if out of memory.
+ * @retval -1 Out of memory before anything is written.
+ */
+static ssize_t
+desc_write(struct filedesc *desc, const char *buf, size_t size)
+{
+    struct file *f = desc->file;
+    ssize_t total_written = 0;
+    const char *src = buf;
+
+    while (size) {
+        size_t extent_offset;
+        int extent = extent_locate(desc->pos, &extent_offset);
+        if (extent == f->extent_count) {
+            if (ufs_add_extent(f) != UFS_ERR_NO_ERR) {
+                if (total_written == 0)
+                    return -1;
+                break;
+            }
+        }
+
+        size_t extent_size = (size_t)BLOCK_SIZE << extent_class(extent);
+        size_t space_left = extent_size - extent_offset;
+        size_t write_data_size = size < space_left ? size : space_left;
+
+        memcpy(f->extents[extent] + extent_offset, src, write_data_size);
+
+        desc->pos += write_data_size;
+        total_written += write_data_size;
+        src += write_data_size;
+        size -= write_data_size;
+    }
+
+    if (desc->pos > f->size)
+        f->size = desc->pos;
 
-    return file_descriptor_count++;
+    return total_written;
+}
+
+/**
+ * Read from the position of @a desc, and move it. Stops at the end
+ * of the file.
+ */
+static ssize_t
+desc_read(struct filedesc *desc, char *buf, size_t size)
+{
+    struct file *f = desc->file;
+    if (desc->pos >= f->size)
+        return 0;
+
+    if (size > f->size - desc->pos)
+        size = f->size - desc->pos;
+
+    ssize_t total_read = 0;
+    char *dest = buf;
+
+    while (size) {
+        size_t extent_offset;
+        int extent = extent_locate(desc->pos, &extent_offset);
+
+        size_t extent_size = (size_t)BLOCK_SIZE << extent_class(extent);
+        size_t available_space = extent_size - extent_offset;
+        size_t read_data_size = size < available_space ? size : available_space;
+
+        memcpy(dest, f->extents[extent] + extent_offset, read_data_size);
+
+        desc->pos += read_data_size;
+        total_read += read_data_size;
+        dest += read_data_size;
+        size -= read_data_size;
+    }
+
+    return total_read;
 }
 
 ssize_t 
@@ -272,56 +773,58 @@ ufs_write(int file_desc, const char *buf, size_t size)
     
     if (validate_desc(desc, is_writable) != 0)
         return -1;
-		
-    struct file *f = desc->file;
-    struct block *file_block = f->block_list;
 
-    if (!file_block) {
-        ufs_error_code = ufs_add_block(f);
-        if (ufs_error_code != UFS_ERR_NO_ERR)
-            return -1;
-        
-        file_block = f->block_list;
-        desc->block_number = 0;
-        desc->block_offset = 0;
+    if (desc->pos + size > MAX_FILE_SIZE) {
+        ufs_error_code = UFS_ERR_NO_MEM;
+        return -1;
     }
 
-    for (int i = 0; i < desc->block_number; ++i)
-        file_block = file_block->next;
+    pthread_rwlock_wrlock(&desc->file->lock);
+    ssize_t total_written = desc_write(desc, buf, size);
+    pthread_rwlock_unlock(&desc->file->lock);
 
-    size_t byte_size = file_block->occupied + desc->block_number * BLOCK_SIZE;
-    if (byte_size + size > MAX_FILE_SIZE) {
+    if (total_written < 0) {
         ufs_error_code = UFS_ERR_NO_MEM;
         return -1;
     }
+    ufs_error_code = UFS_ERR_NO_ERR;
+    return total_written;
+}
 
-    ssize_t total_written = 0;
-    const char *src = buf;
-
-    while (size) {
-        if (desc->block_offset >= BLOCK_SIZE) {
-            if (!file_block->next) {
-                if (ufs_add_block(f) != UFS_ERR_NO_ERR) 
-                    break;
-            }
-            file_block = file_block->next;
-            desc->block_number++;
-            desc->block_offset = 0;
-        }
-
-        size_t space_left = BLOCK_SIZE - desc->block_offset;
-        size_t write_data_size = size < space_left ? size : space_left;
+ssize_t
+ufs_writev(int file_desc, const struct iovec *iov, int iovcnt)
+{
+    struct filedesc *desc = ufs_find_filedesc(file_desc);
 
-        memcpy(file_block->memory + desc->block_offset, src, write_data_size);
+    if (validate_desc(desc, is_writable) != 0)
+        return -1;
 
-        desc->block_offset += write_data_size;
-        total_written += write_data_size;
-        src += write_data_size;
-        size -= write_data_size;
+    size_t size = 0;
+    for (int i = 0; i < iovcnt; i++)
+        size += iov[i].iov_len;
+    if (desc->pos + size > MAX_FILE_SIZE) {
+        ufs_error_code = UFS_ERR_NO_MEM;
+        return -1;
+    }
 
-        file_block->occupied = (desc->block_offset > file_block->occupied) ? desc->block_offset : file_block->occupied;
+    ssize_t total_written = 0;
+    ssize_t written = 0;
+    pthread_rwlock_wrlock(&desc->file->lock);
+    for (int i = 0; i < iovcnt; i++) {
+        written = desc_write(desc, iov[i].iov_base, iov[i].iov_len);
+        if (written < 0)
+            break;
+        total_written += written;
+        if ((size_t)written < iov[i].iov_len)
+            break;
     }
+    pthread_rwlock_unlock(&desc->file->lock);
 
+    /* A partial write is a success, like in writev(). */
+    if (written < 0 && total_written == 0) {
+        ufs_error_code = UFS_ERR_NO_MEM;
+        return -1;
+    }
     ufs_error_code = UFS_ERR_NO_ERR;
     return total_written;
 }
@@ -334,43 +837,107 @@ ufs_read(int file_desc, char *buf, size_t size)
     if (validate_desc(desc, is_readable) != 0)
         return -1;
 
-    struct block *file_block = desc->file->block_list;
-    if (validate_empty_file(file_block) == 0) 
-        return 0;
+    pthread_rwlock_rdlock(&desc->file->lock);
+    ssize_t total_read = desc_read(desc, buf, size);
+    pthread_rwlock_unlock(&desc->file->lock);
 
-    for (int i = 0; i < desc->block_number; ++i) {
-        file_block = file_block->next;
-        if (validate_empty_file(file_block) == 0) 
-            return 0;
-    }
+    ufs_error_code = UFS_ERR_NO_ERR;
+    return total_read;
+}
+
+ssize_t
+ufs_readv(int file_desc, const struct iovec *iov, int iovcnt)
+{
+    struct filedesc *desc = ufs_find_filedesc(file_desc);
+
+    if (validate_desc(desc, is_readable) != 0)
+        return -1;
 
     ssize_t total_read = 0;
-    char *dest = buf;
+    pthread_rwlock_rdlock(&desc->file->lock);
+    for (int i = 0; i < iovcnt; i++) {
+        ssize_t read_size = desc_read(desc, iov[i].iov_base, iov[i].iov_len);
+        total_read += read_size;
+        if ((size_t)read_size < iov[i].iov_len)
+            break;
+    }
+    pthread_rwlock_unlock(&desc->file->lock);
 
-    while (size) {
-        if (desc->block_offset >= file_block->occupied) {
-            file_block = file_block->next;
-            
-            if (!file_block) 
-                break;
-            
-            desc->block_number++;
-            desc->block_offset = 0;
-        }
+    ufs_error_code = UFS_ERR_NO_ERR;
+    return total_read;
+}
 
-        size_t available_space = file_block->occupied - desc->block_offset;
-        size_t read_data_size = size < available_space ? size : available_space;
+/*
+ * A view is a reference to the file it pins. The extents never move
+ * while the file lives, so the reference is enough to keep the
+ * returned memory valid.
+ */
 
-        memcpy(dest, file_block->memory + desc->block_offset, read_data_size);
+int
+ufs_view(int file_desc, size_t size, struct iovec *iov, int iovcnt,
+         struct ufs_view **view)
+{
+    struct filedesc *desc = ufs_find_filedesc(file_desc);
 
-        desc->block_offset += read_data_size;
-        total_read += read_data_size;
-        dest += read_data_size;
-        size -= read_data_size;
+    if (validate_desc(desc, is_readable) != 0)
+        return -1;
+
+    struct file *f = desc->file;
+    pthread_rwlock_rdlock(&f->lock);
+    if (desc->pos >= f->size)
+        size = 0;
+    else if (size > f->size - desc->pos)
+        size = f->size - desc->pos;
+
+    int count = 0;
+    while (size && count < iovcnt) {
+        size_t extent_offset;
+        int extent = extent_locate(desc->pos, &extent_offset);
+
+        size_t extent_size = (size_t)BLOCK_SIZE << extent_class(extent);
+        size_t available_space = extent_size - extent_offset;
+        size_t view_size = size < available_space ? size : available_space;
+
+        iov[count].iov_base = f->extents[extent] + extent_offset;
+        iov[count].iov_len = view_size;
+        count++;
+
+        desc->pos += view_size;
+        size -= view_size;
     }
 
+    pthread_rwlock_unlock(&f->lock);
+
+    file_ref(f);
+    *view = (struct ufs_view *)f;
+
     ufs_error_code = UFS_ERR_NO_ERR;
-    return total_read;
+    return count;
+}
+
+void
+ufs_view_release(struct ufs_view *view)
+{
+    file_unref((struct file *)view);
+}
+
+ssize_t 
+ufs_seek(int file_desc, size_t offset) 
+{
+    struct filedesc *desc = ufs_find_filedesc(file_desc);
+    if (!desc) {
+        ufs_error_code = UFS_ERR_NO_FILE;
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&desc->file->lock);
+    if (offset > desc->file->size)
+        offset = desc->file->size;
+    pthread_rwlock_unlock(&desc->file->lock);
+    desc->pos = offset;
+
+    ufs_error_code = UFS_ERR_NO_ERR;
+    return offset;
 }
 
 int 
@@ -382,14 +949,9 @@ ufs_close(int file_desc)
         return -1;
     }
 
-    struct file *f = desc->file;
-    f->refs--;
-
+    file_desc_remove(file_desc);
+    file_unref(desc->file);
     free(desc);
-    file_descriptors[file_desc] = NULL;
-
-    if (f->refs == 0 && f->deleted)
-        free_file(f);
 
     return 0;
 }
@@ -402,15 +964,19 @@ ufs_delete(const char *filename)
         return -1;
     }
 
+    pthread_rwlock_wrlock(&file_list_lock);
     struct file *f = find_file(filename);
     if (!f) {
+        pthread_rwlock_unlock(&file_list_lock);
         ufs_error_code = UFS_ERR_NO_FILE;
         return -1;
     }
 
-    f->deleted = 1;
-    if (f->refs == 0)
-        free_file(f);
+    file_index_remove(f);
+    pthread_rwlock_unlock(&file_list_lock);
+
+    /* Drop the reference of the name. */
+    file_unref(f);
     
     return 0;
 }
@@ -419,22 +985,22 @@ void
 ufs_destroy(void) 
 {
     while (file_list) {
-        struct file *next_file = file_list->next;
-        free_file(next_file);
+        free_file(file_list);
     }
+    file_index_destroy();
+    arena_destroy();
 
-    if (file_descriptors) {
-        for (int i = 0; i < file_descriptor_count; i++) {
-            if (file_descriptors[i]) {
-                free(file_descriptors[i]);
-                file_descriptors[i] = NULL;
-            }
-        }
+    for (int i = 0; i < FILE_DESC_CHUNK_COUNT && file_descriptors[i]; i++) {
+        for (int j = 0; j < FILE_DESC_CHUNK_SIZE; j++)
+            free(file_descriptors[i][j]);
 
-        free(file_descriptors);
-        file_descriptors = NULL;
+        free(file_descriptors[i]);
+        file_descriptors[i] = NULL;
     }
 
-    file_descriptor_capacity = 0;
+    free(free_descriptors);
+    free_descriptors = NULL;
+    free_descriptor_count = 0;
+
     file_descriptor_count = 0;
 }
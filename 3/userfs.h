@@ -1,12 +1,20 @@
 #pragma once
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /**
  * User-defined in-memory filesystem. It is as simple as possible.
  * Each file lies in the memory as an array of blocks. A file
  * has an unique file name, and there are no directories, so the
  * FS is a monolithic flat contiguous folder.
+ *
+ * The functions can be called from many threads at once, except
+ * for ufs_destroy(). Reads of a file run in parallel, writes to it
+ * are serialized, and different files don't block each other. A
+ * descriptor has its own position, so it should be used by one
+ * thread at a time, while other threads open their own descriptors
+ * of the same file.
  */
 
 /**
@@ -69,7 +77,7 @@ enum ufs_error_code {
 #endif
 };
 
-/** Get code of the last error. */
+/** Get code of the last error in the calling thread. */
 enum ufs_error_code
 ufs_errno();
 
@@ -114,6 +122,83 @@ ufs_write(int fd, const char *buf, size_t size);
 ssize_t
 ufs_read(int fd, char *buf, size_t size);
 
+/**
+ * Write data from several buffers, in order, as one ufs_write().
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to write.
+ * @param iovcnt Count of @a iov.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Read data into several buffers, filling them in order.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to read into.
+ * @param iovcnt Count of @a iov.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/** File memory borrowed by ufs_view(). */
+struct ufs_view;
+
+/**
+ * Read without copying: fill @a iov with pointers to the file memory
+ * holding the next @a size bytes, and move the position past them.
+ * The file is split into pieces in memory, so each buffer covers one
+ * piece, and less than @a size bytes are returned if @a iovcnt is
+ * too small. The memory is pinned until ufs_view_release(), even if
+ * the descriptor is closed and the file is deleted. Writes into the
+ * file are visible through the view.
+ * @param fd File descriptor from ufs_open().
+ * @param size Maximum bytes to read.
+ * @param[out] iov Buffers pointing into the file.
+ * @param iovcnt Capacity of @a iov.
+ * @param[out] view Handle to release the view with. Set on success,
+ *   including EOF.
+ *
+ * @retval > 0 How many buffers were filled.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+int
+ufs_view(int fd, size_t size, struct iovec *iov, int iovcnt,
+	 struct ufs_view **view);
+
+/**
+ * Release a view from ufs_view(). Its buffers must not be used
+ * anymore.
+ * @param view View to release.
+ */
+void
+ufs_view_release(struct ufs_view *view);
+
+/**
+ * Move the position of the descriptor. The next read or write starts
+ * from @a offset. A position beyond the end of the file is set to
+ * the end.
+ * @param fd File descriptor from ufs_open().
+ * @param offset New position from the beginning of the file.
+ *
+ * @retval >= 0 The new position.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_seek(int fd, size_t offset);
+
 /**
  * Close a file.
  * @param fd File descriptor from ufs_open().
@@ -166,8 +251,9 @@ ufs_resize(int fd, size_t new_size);
 
 /**
  * Destroy all the global variables, free all the memory, close and delete all
- * the files. After the destruction neither of the ufs functions are supposed to
- * be used. Purpose of the destruction is to reclaim all the dynamic memory.
+ * the files, release all the views. After the destruction neither of the ufs
+ * functions are supposed to be used. Purpose of the destruction is to reclaim
+ * all the dynamic memory.
  */
 void
 ufs_destroy(void);
@@ -0,0 +1,211 @@
+#include "userfs.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Sequential and random reads of 4KB from a file of the maximal
+ * size show how fast a descriptor finds its position in a big file.
+ * Sending the file to /dev/null by 1MB compares copying reads with
+ * views of the file memory.
+ * Creation, opening and deletion of a million files show how the FS
+ * scales with the file count. Threads reading a shared file and
+ * writing their own ones show how it scales with the cores.
+ */
+
+enum {
+	BENCH_FILE_SIZE = 1024 * 1024 * 100,
+	BENCH_WRITE_SIZE = 1024 * 1024,
+	BENCH_READ_SIZE = 4096,
+	BENCH_RANDOM_READS = 25600,
+	BENCH_FILE_COUNT = 1000000,
+	BENCH_VIEW_IOV = 64,
+	BENCH_SHARED_FILE_SIZE = 1024 * 1024 * 16,
+	BENCH_OWN_FILE_SIZE = 1024 * 1024,
+	/** Operations per thread, 3 reads to 1 write. */
+	BENCH_THREAD_OPS = 400000,
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+bench_report(const char *name, uint64_t duration, int count)
+{
+	printf("%s: %.2f ms, %.1f us per read, %.0f MB/s\n", name,
+	       duration / 1e6, duration / 1e3 / count,
+	       (double)count * BENCH_READ_SIZE / (1 << 20) / (duration / 1e9));
+}
+
+static void
+bench_reads(void)
+{
+	char *buf = malloc(BENCH_WRITE_SIZE);
+	for (int i = 0; i < BENCH_WRITE_SIZE; ++i)
+		buf[i] = 'a' + i % 26;
+
+	int fd = ufs_open("bench", UFS_CREATE);
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < BENCH_FILE_SIZE / BENCH_WRITE_SIZE; ++i) {
+		if (ufs_write(fd, buf, BENCH_WRITE_SIZE) != BENCH_WRITE_SIZE) {
+			printf("write failed\n");
+			exit(1);
+		}
+	}
+	printf("write 1MB chunks: %.2f ms\n", (bench_now_ns() - start) / 1e6);
+
+	int count = 0;
+	ufs_seek(fd, 0);
+	start = bench_now_ns();
+	while (ufs_read(fd, buf, BENCH_READ_SIZE) > 0)
+		++count;
+	bench_report("sequential 4KB reads", bench_now_ns() - start, count);
+
+	srand(1);
+	start = bench_now_ns();
+	for (int i = 0; i < BENCH_RANDOM_READS; ++i) {
+		size_t block = rand() % (BENCH_FILE_SIZE / BENCH_READ_SIZE);
+		ufs_seek(fd, block * BENCH_READ_SIZE);
+		ufs_read(fd, buf, BENCH_READ_SIZE);
+	}
+	bench_report("random 4KB reads", bench_now_ns() - start,
+		     BENCH_RANDOM_READS);
+
+	int out = open("/dev/null", O_WRONLY);
+	ufs_seek(fd, 0);
+	start = bench_now_ns();
+	ssize_t rc;
+	while ((rc = ufs_read(fd, buf, BENCH_WRITE_SIZE)) > 0)
+		write(out, buf, rc);
+	printf("send by 1MB reads: %.2f ms\n", (bench_now_ns() - start) / 1e6);
+
+	struct iovec iov[BENCH_VIEW_IOV];
+	struct ufs_view *view;
+	ufs_seek(fd, 0);
+	start = bench_now_ns();
+	while ((rc = ufs_view(fd, BENCH_WRITE_SIZE, iov, BENCH_VIEW_IOV,
+			      &view)) > 0) {
+		writev(out, iov, rc);
+		ufs_view_release(view);
+	}
+	ufs_view_release(view);
+	printf("send by 1MB views: %.2f ms\n", (bench_now_ns() - start) / 1e6);
+	close(out);
+
+	ufs_close(fd);
+	ufs_delete("bench");
+	free(buf);
+}
+
+static void
+bench_files(void)
+{
+	char name[32];
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < BENCH_FILE_COUNT; ++i) {
+		sprintf(name, "file%d", i);
+		ufs_close(ufs_open(name, UFS_CREATE));
+	}
+	uint64_t duration = bench_now_ns() - start;
+	printf("create %d files: %.2f ms, %.2f us per file\n", BENCH_FILE_COUNT,
+	       duration / 1e6, duration / 1e3 / BENCH_FILE_COUNT);
+
+	start = bench_now_ns();
+	for (int i = 0; i < BENCH_FILE_COUNT; ++i) {
+		sprintf(name, "file%d", rand() % BENCH_FILE_COUNT);
+		ufs_close(ufs_open(name, 0));
+	}
+	duration = bench_now_ns() - start;
+	printf("open and close random files: %.2f ms, %.2f us per file\n",
+	       duration / 1e6, duration / 1e3 / BENCH_FILE_COUNT);
+
+	start = bench_now_ns();
+	for (int i = 0; i < BENCH_FILE_COUNT; ++i) {
+		sprintf(name, "file%d", i);
+		ufs_delete(name);
+	}
+	duration = bench_now_ns() - start;
+	printf("delete the files: %.2f ms, %.2f us per file\n",
+	       duration / 1e6, duration / 1e3 / BENCH_FILE_COUNT);
+}
+
+static void *
+bench_thread_f(void *arg)
+{
+	char name[32];
+	sprintf(name, "own%ld", (long)arg);
+	char buf[BENCH_READ_SIZE] = {0};
+	int own = ufs_open(name, UFS_CREATE);
+	int shared = ufs_open("shared", 0);
+	unsigned seed = (unsigned)(long)arg;
+	int writes = 0;
+
+	for (int i = 0; i < BENCH_THREAD_OPS; ++i) {
+		if (i % 4 == 3) {
+			if (ufs_write(own, buf, BENCH_READ_SIZE) < 0)
+				exit(1);
+			if (++writes % (BENCH_OWN_FILE_SIZE / BENCH_READ_SIZE) == 0)
+				ufs_seek(own, 0);
+			continue;
+		}
+		size_t block = rand_r(&seed) %
+			(BENCH_SHARED_FILE_SIZE / BENCH_READ_SIZE);
+		ufs_seek(shared, block * BENCH_READ_SIZE);
+		if (ufs_read(shared, buf, BENCH_READ_SIZE) != BENCH_READ_SIZE)
+			exit(1);
+	}
+
+	ufs_close(shared);
+	ufs_close(own);
+	ufs_delete(name);
+	return NULL;
+}
+
+static void
+bench_threads(void)
+{
+	char *buf = calloc(1, BENCH_SHARED_FILE_SIZE);
+	int fd = ufs_open("shared", UFS_CREATE);
+	ufs_write(fd, buf, BENCH_SHARED_FILE_SIZE);
+	ufs_close(fd);
+	free(buf);
+
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	for (long count = 1;; count = count * 2 < cpu_count ?
+	     count * 2 : cpu_count) {
+		pthread_t *threads = malloc(count * sizeof(*threads));
+		uint64_t start = bench_now_ns();
+		for (long i = 0; i < count; ++i)
+			pthread_create(&threads[i], NULL, bench_thread_f, (void *)i);
+		for (long i = 0; i < count; ++i)
+			pthread_join(threads[i], NULL);
+		uint64_t duration = bench_now_ns() - start;
+		free(threads);
+
+		printf("%ld threads, 4KB reads and writes: %.2f Mops/s\n", count,
+		       count * BENCH_THREAD_OPS / (duration / 1e3));
+		if (count == cpu_count)
+			break;
+	}
+	ufs_delete("shared");
+}
+
+int
+main(void)
+{
+	bench_reads();
+	bench_files();
+	bench_threads();
+	ufs_destroy();
+	return 0;
+}
@@ -1,8 +1,12 @@
+#define _GNU_SOURCE
 #include "thread_pool.h"
 #include "unit.h"
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 static void
 test_new(void)
@@ -299,6 +303,56 @@ test_timed_join(void)
 #endif
 }
 
+static void *
+task_nap_f(void *arg)
+{
+	usleep(50);
+	return task_incr_f(arg);
+}
+
+static void
+test_timed_join_churn(void)
+{
+#if NEED_TIMED_JOIN && NEED_DETACH
+	unit_test_start();
+
+	/*
+	 * Timed out joins leave the task waited for, while detached tasks
+	 * are freed and reused next to it. Tiny timeouts must neither hang
+	 * nor lose a wakeup.
+	 */
+	struct thread_pool *p;
+	struct thread_task *task, *detached;
+	int arg = 0;
+	int timeouts = 0;
+	void *result;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	for (int i = 0; i < 1000; ++i) {
+		unit_fail_if(thread_task_new(&task, task_nap_f, &arg) != 0);
+		unit_fail_if(thread_pool_push_task(p, task) != 0);
+		unit_fail_if(thread_task_new(&detached, task_incr_f, &arg) != 0);
+		unit_fail_if(thread_pool_push_task(p, detached) != 0);
+		unit_fail_if(thread_task_detach(detached) != 0);
+		int rc;
+		while ((rc = thread_task_timed_join(task, 0.000001,
+						    &result)) == TPOOL_ERR_TIMEOUT)
+			++timeouts;
+		unit_fail_if(rc != 0);
+		unit_fail_if(result != &arg);
+		unit_fail_if(thread_task_timed_join(task, 0, &result) !=
+			     TPOOL_ERR_TASK_NOT_PUSHED);
+		unit_fail_if(thread_task_delete(task) != 0);
+	}
+	while (__atomic_load_n(&arg, __ATOMIC_RELAXED) != 2000)
+		usleep(1000);
+	unit_check(timeouts > 0, "timed joins under detach churn");
+	while (thread_pool_delete(p) != 0)
+		usleep(100);
+
+	unit_test_finish();
+#endif
+}
+
 static void
 test_detach_stress(void)
 {
@@ -363,6 +417,440 @@ test_detach_long(void)
 #endif
 }
 
+static void
+test_then(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *t1, *t2, *t3;
+	int arg = 0;
+	void *result;
+	unit_fail_if(thread_pool_new(3, &p) != 0);
+	/*
+	 * A chain where only the head is pushed.
+	 */
+	unit_fail_if(thread_task_new(&t1, task_wait_for_f, &arg) != 0);
+	unit_fail_if(thread_task_new(&t2, task_incr_f, &arg) != 0);
+	unit_fail_if(thread_task_new(&t3, task_incr_f, &arg) != 0);
+	unit_check(thread_task_then(t1, t1) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "can't depend on itself");
+	unit_check(thread_task_then(t1, t2) == 0, "t1 -> t2");
+	unit_check(thread_task_then(t2, t3) == 0, "t2 -> t3");
+	unit_check(thread_pool_push_task(p, t2) == TPOOL_ERR_TASK_IN_POOL,
+		   "a continuation can't be pushed");
+	unit_check(thread_task_delete(t1) == TPOOL_ERR_TASK_IN_POOL,
+		   "a task with continuations can't be deleted before push");
+	unit_fail_if(thread_pool_push_task(p, t1) != 0);
+	usleep(1000);
+	unit_check(!thread_task_is_finished(t2) && !thread_task_is_running(t2),
+		   "the continuation waits");
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	unit_check(thread_task_join(t3, &result) == 0, "joined the tail");
+	unit_check(arg == 3, "the whole chain is done");
+	unit_check(thread_task_is_finished(t1) && thread_task_is_finished(t2),
+		   "the head is finished");
+	unit_fail_if(thread_task_join(t2, &result) != 0);
+	/*
+	 * A continuation of a finished task is pushed right away.
+	 */
+	unit_check(thread_task_then(t1, t2) == 0, "then on a finished task");
+	unit_check(thread_pool_push_task(p, t2) == TPOOL_ERR_TASK_IN_POOL,
+		   "already pushed");
+	unit_check(thread_task_join(t2, &result) == 0, "joined");
+	unit_check(arg == 4, "it was run");
+	/*
+	 * A joined one is not in a pool anymore.
+	 */
+	unit_fail_if(thread_task_join(t1, &result) != 0);
+	unit_check(thread_task_then(t1, t2) == TPOOL_ERR_TASK_NOT_PUSHED,
+		   "then on a joined task");
+	unit_check(thread_task_delete(t2) == 0, "the continuation is intact");
+	unit_fail_if(thread_task_new(&t2, task_incr_f, &arg) != 0);
+
+	unit_fail_if(thread_task_delete(t1) != 0);
+	unit_fail_if(thread_task_delete(t2) != 0);
+	unit_fail_if(thread_task_delete(t3) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_then_many(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *blocker, *head;
+	const int count = 3000;
+	struct thread_task **tasks = calloc(count, sizeof(*tasks));
+	int arg = 0, wait_arg = 0;
+	void *result;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	unit_fail_if(thread_task_new(&head, task_incr_f, &arg) != 0);
+	unit_fail_if(thread_pool_push_task(p, head) != 0);
+	while (!thread_task_is_finished(head))
+		usleep(100);
+	/*
+	 * The only worker is busy, so the continuations of the finished
+	 * head pile up in the pool's queue.
+	 */
+	unit_fail_if(thread_task_new(&blocker, task_wait_for_f, &wait_arg) != 0);
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	bool ok = true;
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f, &arg) != 0);
+		ok = ok && thread_task_then(head, tasks[i]) == 0;
+	}
+	unit_check(ok, "many continuations of a finished task");
+	__atomic_store_n(&wait_arg, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_check(arg == count + 1, "all of them are run");
+
+	unit_fail_if(thread_task_join(head, &result) != 0);
+	unit_fail_if(thread_task_join(blocker, &result) != 0);
+	unit_fail_if(thread_task_delete(head) != 0);
+	unit_fail_if(thread_task_delete(blocker) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+	free(tasks);
+
+	unit_test_finish();
+}
+
+static void
+test_when(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *tasks[10], *next;
+	int arg = 0;
+	int wait_arg = 0;
+	void *result;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	/*
+	 * when_all() fires after the last one.
+	 */
+	for (int i = 0; i < 10; ++i)
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f, &arg) != 0);
+	unit_fail_if(thread_task_new(&next, task_wait_for_f, &arg) != 0);
+	unit_check(thread_task_when_all(next, tasks, 0) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "no tasks to wait for");
+	unit_check(thread_task_when_all(next, tasks, 10) == 0, "when all");
+	for (int i = 0; i < 10; ++i)
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	unit_check(thread_task_join(next, &result) == 0, "joined");
+	unit_check(arg == 10, "all the tasks are done before");
+	for (int i = 0; i < 10; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	/*
+	 * when_any() fires after the first one, the others still wait.
+	 */
+	arg = 0;
+	unit_fail_if(thread_task_new(&tasks[0], task_wait_for_f, &wait_arg) != 0);
+	unit_fail_if(thread_task_new(&tasks[1], task_incr_f, &arg) != 0);
+	unit_fail_if(thread_task_new(&tasks[2], task_wait_for_f, &wait_arg) != 0);
+	unit_check(thread_task_when_any(next, tasks, 3) == 0, "when any");
+	unit_fail_if(thread_pool_push_task(p, tasks[0]) != 0);
+	unit_fail_if(thread_pool_push_task(p, tasks[1]) != 0);
+	unit_check(thread_task_join(next, &result) == 0, "joined");
+	unit_check(!thread_task_is_finished(tasks[0]), "the slow one still runs");
+	unit_fail_if(thread_task_delete(next) != 0);
+	__atomic_store_n(&wait_arg, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_pool_push_task(p, tasks[2]) != 0);
+	for (int i = 0; i < 3; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_push_tasks(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *tasks[100];
+	int arg = 0;
+	void *result;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	for (int i = 0; i < 100; ++i)
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f, &arg) != 0);
+	unit_check(thread_pool_push_tasks(p, tasks, 0) == 0, "empty batch");
+	unit_check(thread_pool_push_tasks(p, tasks, 100) == 0, "batch push");
+	unit_check(thread_pool_push_tasks(p, tasks, 100) ==
+		   TPOOL_ERR_TASK_IN_POOL, "can't push the same tasks twice");
+	for (int i = 0; i < 100; ++i)
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+	unit_check(arg == 100, "all the tasks are done");
+	unit_check(thread_pool_thread_count(p) <= 4, "no extra threads");
+	/*
+	 * A batch is pushed either fully or not at all.
+	 */
+	unit_fail_if(thread_pool_push_task(p, tasks[50]) != 0);
+	unit_check(thread_pool_push_tasks(p, tasks, 100) ==
+		   TPOOL_ERR_TASK_IN_POOL, "one of the tasks is in the pool");
+	unit_fail_if(thread_task_join(tasks[50], &result) != 0);
+	unit_check(arg == 101, "nothing else is pushed");
+	/*
+	 * A task given twice in one batch is caught, and the tasks
+	 * claimed before it are given back as they were.
+	 */
+	struct thread_task *t;
+	unit_fail_if(thread_task_new(&t, task_incr_f, &arg) != 0);
+	struct thread_task *dup[] = {t, t};
+	unit_check(thread_pool_push_tasks(p, dup, 2) ==
+		   TPOOL_ERR_TASK_IN_POOL, "a new task twice in a batch");
+	struct thread_task *dup_joined[] = {tasks[0], t, tasks[0]};
+	unit_check(thread_pool_push_tasks(p, dup_joined, 3) ==
+		   TPOOL_ERR_TASK_IN_POOL, "a joined task twice in a batch");
+	unit_check(thread_task_then(tasks[0], t) == TPOOL_ERR_TASK_NOT_PUSHED,
+		   "the joined task is still joined");
+	unit_check(thread_pool_push_tasks(p, dup_joined, 2) == 0,
+		   "the tasks are given back");
+	unit_fail_if(thread_task_join(tasks[0], &result) != 0);
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_check(arg == 103, "each task is run once");
+	unit_fail_if(thread_task_delete(t) != 0);
+	for (int i = 0; i < 100; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+struct test_range_ctx {
+	struct thread_pool *pool;
+	size_t size;
+	int *hits;
+};
+
+static void
+test_range_f(size_t begin, size_t end, void *arg)
+{
+	struct test_range_ctx *ctx = arg;
+	for (size_t i = begin; i < end; ++i)
+		__atomic_add_fetch(&ctx->hits[i], 1, __ATOMIC_RELAXED);
+}
+
+static bool
+test_range_check(struct test_range_ctx *ctx)
+{
+	for (size_t i = 0; i < ctx->size; ++i) {
+		if (ctx->hits[i] != 1)
+			return false;
+	}
+	return true;
+}
+
+static void *
+task_parallel_for_f(void *arg)
+{
+	struct test_range_ctx *ctx = arg;
+	int rc = thread_pool_parallel_for(ctx->pool, 0, ctx->size, 10,
+					  test_range_f, ctx);
+	return (void *)(intptr_t)rc;
+}
+
+static void
+test_parallel_for(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *t;
+	void *result;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	struct test_range_ctx ctx;
+	ctx.pool = p;
+	ctx.size = 100000;
+	ctx.hits = calloc(ctx.size, sizeof(ctx.hits[0]));
+
+	unit_check(thread_pool_parallel_for(p, 10, 5, 1, test_range_f, &ctx) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "bad range");
+	unit_check(thread_pool_parallel_for(p, 5, 5, 1, test_range_f, &ctx) ==
+		   0, "empty range");
+	unit_check(thread_pool_parallel_for(p, 0, ctx.size, 0, test_range_f,
+					    &ctx) == 0, "parallel for");
+	unit_check(test_range_check(&ctx), "each index is visited once");
+	/*
+	 * A range smaller than the grain is done by the caller.
+	 */
+	memset(ctx.hits, 0, ctx.size * sizeof(ctx.hits[0]));
+	ctx.size = 7;
+	unit_check(thread_pool_parallel_for(p, 0, ctx.size, 100, test_range_f,
+					    &ctx) == 0, "single chunk");
+	unit_check(test_range_check(&ctx), "each index is visited once");
+	/*
+	 * The helpers are done when the call returns, so the pool can be
+	 * deleted right away.
+	 */
+	unit_check(thread_pool_delete(p) == 0, "no helpers are left");
+	/*
+	 * Nested into a task of the same pool, which can't deadlock even
+	 * if the pool has one thread.
+	 */
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	ctx.pool = p;
+	ctx.size = 100000;
+	memset(ctx.hits, 0, ctx.size * sizeof(ctx.hits[0]));
+	unit_fail_if(thread_task_new(&t, task_parallel_for_f, &ctx) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_check(thread_task_join(t, &result) == 0 && result == NULL,
+		   "parallel for from a task");
+	unit_check(test_range_check(&ctx), "each index is visited once");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+	free(ctx.hits);
+	/*
+	 * Nested calls in all the workers at once. Each one runs the
+	 * helpers left in its own deque instead of waiting for them.
+	 */
+	struct test_range_ctx ctxs[8];
+	struct thread_task *tasks[8];
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	for (int i = 0; i < 8; ++i) {
+		ctxs[i].pool = p;
+		ctxs[i].size = 10000;
+		ctxs[i].hits = calloc(ctxs[i].size, sizeof(ctxs[i].hits[0]));
+		unit_fail_if(thread_task_new(&tasks[i], task_parallel_for_f,
+					     &ctxs[i]) != 0);
+	}
+	unit_fail_if(thread_pool_push_tasks(p, tasks, 8) != 0);
+	bool is_ok = true;
+	for (int i = 0; i < 8; ++i) {
+		is_ok = is_ok && thread_task_join(tasks[i], &result) == 0 &&
+			result == NULL && test_range_check(&ctxs[i]);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+		free(ctxs[i].hits);
+	}
+	unit_check(is_ok, "parallel for from all the workers");
+	unit_check(thread_pool_delete(p) == 0, "no nested helpers are left");
+
+	unit_test_finish();
+}
+
+/** Wait until all the tasks sharing the counter are running. */
+static void *
+task_rendezvous_f(void *arg)
+{
+	int *count = arg;
+	__atomic_sub_fetch(count, 1, __ATOMIC_RELAXED);
+	while (__atomic_load_n(count, __ATOMIC_RELAXED) > 0)
+		usleep(100);
+	return NULL;
+}
+
+static void
+test_elastic(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_pool_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.min_thread_count = 2;
+	opts.max_thread_count = 1;
+	unit_check(thread_pool_new_opts(&opts, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "min can't be above max");
+
+	opts.min_thread_count = 1;
+	opts.max_thread_count = 4;
+	opts.idle_timeout = 0.01;
+	unit_fail_if(thread_pool_new_opts(&opts, &p) != 0);
+	unit_check(thread_pool_thread_count(p) == 1, "min threads are started");
+
+	struct thread_task *tasks[4];
+	int count = 4;
+	void *result;
+	for (int i = 0; i < 4; ++i)
+		unit_fail_if(thread_task_new(&tasks[i], task_rendezvous_f,
+					     &count) != 0);
+	unit_fail_if(thread_pool_push_tasks(p, tasks, 4) != 0);
+	for (int i = 0; i < 4; ++i)
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+	/* Only 4 threads running at once can pass the rendezvous. */
+	unit_check(count == 0, "grown to max");
+
+	for (int i = 0; i < 1000 && thread_pool_thread_count(p) > 1; ++i)
+		usleep(1000);
+	unit_check(thread_pool_thread_count(p) == 1, "shrunk to min");
+
+	/* The freed slots are reused. */
+	count = 4;
+	unit_fail_if(thread_pool_push_tasks(p, tasks, 4) != 0);
+	for (int i = 0; i < 4; ++i)
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+	unit_check(count == 0, "grown again");
+
+	for (int i = 0; i < 4; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void *
+task_cpu_f(void *arg)
+{
+	(void)arg;
+	return (void *)(intptr_t)sched_getcpu();
+}
+
+static void
+test_affinity(void)
+{
+	unit_test_start();
+
+	cpu_set_t allowed;
+	unit_fail_if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0);
+	int cpu = 0;
+	while (!CPU_ISSET(cpu, &allowed))
+		++cpu;
+
+	struct thread_pool *p;
+	struct thread_pool_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.max_thread_count = 2;
+	int bad_cpu = -1;
+	opts.cpus = &bad_cpu;
+	opts.cpu_count = 1;
+	unit_check(thread_pool_new_opts(&opts, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "bad cpu");
+
+	opts.cpus = &cpu;
+	unit_fail_if(thread_pool_new_opts(&opts, &p) != 0);
+	struct thread_task *task;
+	void *result;
+	unit_fail_if(thread_task_new(&task, task_cpu_f, NULL) != 0);
+	unit_fail_if(thread_pool_push_task(p, task) != 0);
+	unit_fail_if(thread_task_join(task, &result) != 0);
+	unit_check((intptr_t)result == cpu, "the worker is pinned");
+
+	unit_check(thread_pool_push_task_node(p, task, -2) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "bad node");
+	unit_fail_if(thread_pool_push_task_node(p, task, 0) != 0);
+	unit_fail_if(thread_task_join(task, &result) != 0);
+	unit_check((intptr_t)result == cpu, "pushed to a node");
+	unit_fail_if(thread_pool_push_task_node(p, task, 1000) != 0);
+	unit_fail_if(thread_task_join(task, &result) != 0);
+	unit_check((intptr_t)result == cpu, "unknown node is no hint");
+
+	unit_fail_if(thread_task_delete(task) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
 int
 main(int argc, char **argv)
 {
@@ -384,8 +872,16 @@ main(int argc, char **argv)
 	test_thread_pool_delete();
 	test_thread_pool_max_tasks();
 	test_timed_join();
+	test_timed_join_churn();
 	test_detach_stress();
 	test_detach_long();
+	test_then();
+	test_then_many();
+	test_when();
+	test_push_tasks();
+	test_parallel_for();
+	test_elastic();
+	test_affinity();
 
 	unit_test_finish();
 	return 0;
@@ -1,9 +1,94 @@
+#define _GNU_SOURCE
 #include "thread_pool.h"
 #include <pthread.h>
+#include <sched.h>
+#include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+enum {
+    /** Initial capacity of a worker deque. Must be a power of 2. */
+    TASK_DEQUE_MIN_CAPACITY = 256,
+    /**
+     * Injection queue cells per worker of the pool. The capacity is
+     * rounded up to a power of 2 within the limits below. Tasks
+     * which don't fit go to the queue's overflow list, so it is only
+     * about how big a burst is taken without a lock.
+     */
+    TASK_QUEUE_CELLS_PER_THREAD = 64,
+    TASK_QUEUE_MIN_CAPACITY = 256,
+    TASK_QUEUE_MAX_CAPACITY = 16384,
+    /** Avoid false sharing between hot atomic counters. */
+    CACHE_LINE_SIZE = 64,
+    /** Free tasks a thread keeps for itself. */
+    TASK_CACHE_SIZE = 256,
+    /** Free tasks moved between a thread cache and the depot at once. */
+    TASK_CACHE_BATCH = 64,
+    /** Joiner checks before going to sleep. */
+    TASK_JOIN_SPIN = 100,
+    /** Futex words joiners sleep on. Must be a power of 2. */
+    TASK_JOIN_BUCKETS = 64,
+    /** Checks for new tasks an idle worker makes before parking. */
+    WORKER_PARK_SPIN = 64,
+};
+
+_Static_assert((TASK_QUEUE_MIN_CAPACITY & (TASK_QUEUE_MIN_CAPACITY - 1)) == 0,
+               "injection queue capacity must be a power of 2");
+
+enum task_status {
+    TASK_NEW,
+    /** Not in a queue yet, waits for predecessors to finish. */
+    TASK_WAITING,
+    TASK_PUSHED,
+    TASK_RUNNING,
+    /**
+     * The result is ready but the worker still queues continuations.
+     * Looks finished for everyone except join.
+     */
+    TASK_FINISHING,
+    TASK_FINISHED,
+    TASK_JOINED,
+    TASK_DETACHED
+};
+
+/**
+ * Task state is one atomic word, so each transition is a single CAS
+ * and no per-task lock is needed. It keeps the status, a flag that
+ * somebody sleeps in join, and the number of predecessors a waiting
+ * task still depends on.
+ */
+#define TASK_STATUS_MASK 0xffull
+#define TASK_HAS_WAITERS 0x100ull
+#define TASK_PENDING_ONE (1ull << 32)
+
+static inline enum task_status
+task_state_status(uint64_t state)
+{
+    return (enum task_status)(state & TASK_STATUS_MASK);
+}
+
+static inline uint64_t
+task_state_pending(uint64_t state)
+{
+    return state / TASK_PENDING_ONE;
+}
+
+static inline uint64_t
+task_state_set_status(uint64_t state, enum task_status status)
+{
+    return (state & ~TASK_STATUS_MASK) | status;
+}
+
+/** Successor list of a finished task, nothing can be added to it. */
+#define TASK_EDGES_CLOSED ((struct thread_task_edge *)1)
 
 struct thread_task
 {
@@ -11,144 +96,1213 @@ struct thread_task
     void *arg;
     void *result;
 
-    pthread_mutex_t task_mutex;
-    pthread_cond_t task_cond;
-
-    enum {
-        TASK_NEW,
-        TASK_PUSHED,
-        TASK_RUNNING,
-        TASK_FINISHED,
-        TASK_JOINED,
-        TASK_DETACHED
-    } status;
+    uint64_t state;
+    /** Pool the task was pushed to last time. */
+    struct thread_pool *pool;
+    /** Continuations to submit when the task is finished. */
+    struct thread_task_edge *successors;
+    /**
+     * Link in a free task list, or in the overflow list of an
+     * injection queue.
+     */
+    struct thread_task *next_free;
+};
+
+/**
+ * when_any() group. Only the first finished predecessor of the group
+ * releases the successor, the last one frees the group.
+ */
+struct thread_task_any
+{
+    bool is_fired;
+    int ref_count;
+};
+
+/** Dependency edge stored in the predecessor's successor list. */
+struct thread_task_edge
+{
+    struct thread_task *next;
+    /** NULL for a when_all() or then() edge. */
+    struct thread_task_any *group;
+    struct thread_task_edge *link;
+};
+
+/**
+ * Circular buffer of a Chase-Lev deque. When the deque grows, the
+ * old buffer can still be read by thieves, so it is not freed but
+ * linked into the new one and released together with the deque.
+ */
+struct task_deque_array
+{
+    int64_t capacity;
+    struct task_deque_array *prev;
+    struct thread_task *tasks[];
+};
+
+/**
+ * Chase-Lev work-stealing deque ("Correct and Efficient
+ * Work-Stealing for Weak Memory Models", Le et al., 2013). The owner
+ * pushes and takes at the bottom, any other thread steals from the
+ * top. All the operations are lock-free and O(1) except a rare
+ * buffer growth.
+ */
+struct task_deque
+{
+    _Alignas(CACHE_LINE_SIZE) int64_t top;
+    _Alignas(CACHE_LINE_SIZE) int64_t bottom;
+    struct task_deque_array *array;
+};
+
+/**
+ * Bounded MPMC queue by D. Vyukov. Each cell has a sequence number
+ * telling whether it is ready for a producer or a consumer, so both
+ * push and pop take a single CAS on the fast path.
+ */
+struct task_queue_cell
+{
+    size_t seq;
+    struct thread_task *task;
+};
+
+struct task_queue
+{
+    _Alignas(CACHE_LINE_SIZE) size_t head;
+    _Alignas(CACHE_LINE_SIZE) size_t tail;
+    struct task_queue_cell *cells;
+    /** Cell count - 1, the count is a power of 2. */
+    size_t mask;
+    /**
+     * Tasks which didn't fit into the cells. Continuations are
+     * pushed by finished predecessors without the task limit check,
+     * so the cells can run out. It is rare, so the list is plain and
+     * locked.
+     */
+    _Alignas(CACHE_LINE_SIZE) int overflow_count;
+    struct thread_task *overflow_head;
+    struct thread_task *overflow_tail;
+    pthread_mutex_t overflow_lock;
+};
+
+struct thread_worker
+{
+    struct task_deque deque;
+    struct thread_pool *pool;
+    pthread_t thread;
+    /** State of the xorshift generator choosing a steal victim. */
+    uint32_t rand_state;
+    /** CPU the slot's threads are pinned to, or -1. */
+    int cpu;
+    /** NUMA node of the CPU, 0 when not pinned. */
+    int node;
+    /** A thread runs in the slot. Protected by spawn_lock. */
+    bool is_alive;
+    /** The thread has retired but is not joined yet. */
+    bool is_retired;
+};
+
+/**
+ * Return values of thread_worker_park().
+ */
+enum worker_park_result {
+    WORKER_PARK_RUN,
+    WORKER_PARK_RETIRE,
+    WORKER_PARK_STOP,
 };
 
 struct thread_pool
 {
-    pthread_t *threads;
-    struct thread_task **task_queue;
-    int queue_size;
-    int queue_capacity;
-    volatile int active_threads;
+    /**
+     * Worker slots, allocated lazily. A worker which retires leaves
+     * its slot with an empty deque, and the slot is reused by the
+     * next spawned thread. Slots are never freed before the pool, so
+     * thieves can walk the first @a slot_count of them without a
+     * lock.
+     */
+    struct thread_worker **workers;
+    int slot_count;
+    int min_threads;
     int max_threads;
+    /** Idle time after which an extra worker exits. 0 is never. */
+    uint64_t idle_timeout_ns;
+    /**
+     * CPUs to pin the worker slots to, round robin. Empty when the
+     * workers are not pinned.
+     */
+    int *cpus;
+    int cpu_count;
+    /**
+     * Tasks pushed from outside of the pool's workers, a queue per
+     * NUMA node. Only the nodes having the pool's CPUs have a queue,
+     * the others have NULL cells. A pool without pinning has one.
+     */
+    struct task_queue *injection;
+    int node_count;
+    /** Node for the tasks without a node having a queue. */
+    int home_node;
+
+    /** Tasks pushed but not taken by a worker yet. */
+    _Alignas(CACHE_LINE_SIZE) int task_count;
+    /** Workers executing a task right now. */
+    _Alignas(CACHE_LINE_SIZE) int active_threads;
+    /** Workers sleeping on park_cond. */
+    _Alignas(CACHE_LINE_SIZE) int sleeping_threads;
+    /** Running workers. Changed only under spawn_lock. */
+    int count;
+    bool shutdown;
+
+    /**
+     * Protect only worker parking and thread creation. Neither is
+     * taken on a push or a pop while the pool is busy.
+     */
+    pthread_mutex_t park_lock;
+    pthread_cond_t park_cond;
+    pthread_mutex_t spawn_lock;
+};
+
+/** Worker the current thread is, if it belongs to any pool. */
+static __thread struct thread_worker *current_worker = NULL;
+
+/** NUMA layout of the machine, read once from sysfs. */
+static struct {
+    /** Node of each CPU, 0 if unknown. */
+    int cpu_node[CPU_SETSIZE];
+    /** Highest online node + 1. */
+    int node_count;
+} numa_topology;
 
-    pthread_mutex_t pool_lock;
-    pthread_cond_t pool_cond;
+static pthread_once_t numa_topology_once = PTHREAD_ONCE_INIT;
 
-    volatile bool shutdown;
-    volatile int count;
+/** Read a sysfs list like "0-3,8,10-11" into @a set. */
+static int
+cpu_list_read(const char *path, cpu_set_t *set)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    char buf[4096];
+    char *pos = fgets(buf, sizeof(buf), f);
+    fclose(f);
+    if (pos == NULL)
+        return -1;
+    CPU_ZERO(set);
+    while (*pos >= '0' && *pos <= '9') {
+        long first = strtol(pos, &pos, 10);
+        long last = first;
+        if (*pos == '-')
+            last = strtol(pos + 1, &pos, 10);
+        for (long i = first; i <= last && i < CPU_SETSIZE; ++i)
+            CPU_SET(i, set);
+        if (*pos == ',')
+            pos++;
+    }
+    return 0;
+}
+
+static void
+numa_topology_init(void)
+{
+    numa_topology.node_count = 1;
+    cpu_set_t nodes;
+    if (cpu_list_read("/sys/devices/system/node/online", &nodes) != 0)
+        return;
+    for (int node = 0; node < CPU_SETSIZE; ++node) {
+        if (!CPU_ISSET(node, &nodes))
+            continue;
+        char path[64];
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/node/node%d/cpulist", node);
+        cpu_set_t cpus;
+        if (cpu_list_read(path, &cpus) != 0)
+            continue;
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &cpus))
+                numa_topology.cpu_node[cpu] = node;
+        }
+        if (node >= numa_topology.node_count)
+            numa_topology.node_count = node + 1;
+    }
+}
+
+static int
+numa_cpu_node(int cpu)
+{
+    return cpu >= 0 && cpu < CPU_SETSIZE ? numa_topology.cpu_node[cpu] : 0;
+}
+
+/**
+ * Free task objects. Each thread has its own list, so creating and
+ * deleting tasks is allocation- and lock-free after warm-up. Threads
+ * which free more than they allocate, like workers running detached
+ * tasks, pass the surplus in batches through the shared depot.
+ */
+struct task_cache
+{
+    struct thread_task *head;
+    int size;
+    bool is_registered;
 };
 
-static void*
-worker_thread(void *arg)
+static __thread struct task_cache task_cache;
+
+static struct {
+    pthread_mutex_t lock;
+    struct thread_task *head;
+} task_depot = {PTHREAD_MUTEX_INITIALIZER, NULL};
+
+static pthread_once_t task_cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t task_cache_key;
+
+/** Move up to @a count tasks of the current thread to the depot. */
+static void
+task_cache_flush(int count)
 {
-    struct thread_pool *pool = (struct thread_pool *)arg;
+    struct task_cache *cache = &task_cache;
+    if (cache->head == NULL || count == 0)
+        return;
+    struct thread_task *first = cache->head;
+    struct thread_task *last = first;
+    int moved = 1;
+    while (moved < count && last->next_free != NULL) {
+        last = last->next_free;
+        moved++;
+    }
+    cache->head = last->next_free;
+    cache->size -= moved;
+    pthread_mutex_lock(&task_depot.lock);
+    last->next_free = task_depot.head;
+    task_depot.head = first;
+    pthread_mutex_unlock(&task_depot.lock);
+}
 
-    while (1) {
-        pthread_mutex_lock(&pool->pool_lock);
+static void
+task_cache_thread_exit(void *arg)
+{
+    (void)arg;
+    task_cache_flush(INT_MAX);
+}
 
-        while (pool->queue_size == 0 && !pool->shutdown)
-            pthread_cond_wait(&pool->pool_cond, &pool->pool_lock);
+/**
+ * Give the cached memory back at exit, so leak checkers don't
+ * confuse it with leaked tasks.
+ */
+static void
+task_cache_atexit(void)
+{
+    task_cache_flush(INT_MAX);
+    pthread_mutex_lock(&task_depot.lock);
+    struct thread_task *task = task_depot.head;
+    task_depot.head = NULL;
+    pthread_mutex_unlock(&task_depot.lock);
+    while (task != NULL) {
+        struct thread_task *next = task->next_free;
+        free(task);
+        task = next;
+    }
+}
 
-        if (pool->shutdown) {
-            __atomic_sub_fetch(&pool->count, 1, __ATOMIC_RELEASE);
-            pthread_mutex_unlock(&pool->pool_lock);
-            break;
+static void
+task_cache_init(void)
+{
+    pthread_key_create(&task_cache_key, task_cache_thread_exit);
+    atexit(task_cache_atexit);
+}
+
+static struct thread_task *
+task_alloc(void)
+{
+    struct task_cache *cache = &task_cache;
+    if (!cache->is_registered) {
+        pthread_once(&task_cache_once, task_cache_init);
+        /* Any non-NULL value makes the destructor run at thread exit. */
+        pthread_setspecific(task_cache_key, cache);
+        cache->is_registered = true;
+    }
+    if (cache->head == NULL &&
+        __atomic_load_n(&task_depot.head, __ATOMIC_RELAXED) != NULL) {
+        pthread_mutex_lock(&task_depot.lock);
+        while (cache->size < TASK_CACHE_BATCH && task_depot.head != NULL) {
+            struct thread_task *task = task_depot.head;
+            task_depot.head = task->next_free;
+            task->next_free = cache->head;
+            cache->head = task;
+            cache->size++;
         }
+        pthread_mutex_unlock(&task_depot.lock);
+    }
+    struct thread_task *task = cache->head;
+    if (task == NULL)
+        return malloc(sizeof(*task));
+    cache->head = task->next_free;
+    cache->size--;
+    return task;
+}
 
-        struct thread_task *task = pool->task_queue[0];
-        for (int i = 0; i < pool->queue_size - 1; i++)
-            pool->task_queue[i] = pool->task_queue[i + 1];
-        pool->queue_size--;
-        pool->task_queue[pool->queue_size] = NULL;
+static void
+task_free(struct thread_task *task)
+{
+    struct task_cache *cache = &task_cache;
+    if (!cache->is_registered) {
+        pthread_once(&task_cache_once, task_cache_init);
+        pthread_setspecific(task_cache_key, cache);
+        cache->is_registered = true;
+    }
+    task->next_free = cache->head;
+    cache->head = task;
+    if (++cache->size > TASK_CACHE_SIZE)
+        task_cache_flush(TASK_CACHE_BATCH);
+}
 
-        pthread_mutex_lock(&task->task_mutex);
+/**
+ * Joiners sleep on a futex word picked by the task address, not on
+ * the task itself. Then a worker never touches a task after making
+ * it finished, and the task can be freed right after join returns.
+ */
+static struct {
+    _Alignas(CACHE_LINE_SIZE) uint32_t seq;
+} task_join_buckets[TASK_JOIN_BUCKETS];
+
+static inline uint32_t *
+task_join_futex(const struct thread_task *task)
+{
+    uintptr_t h = (uintptr_t)task / sizeof(*task);
+    return &task_join_buckets[h & (TASK_JOIN_BUCKETS - 1)].seq;
+}
 
-        int status = __atomic_load_n(&task->status, __ATOMIC_ACQUIRE); 
-        bool detached_before_run = (status == TASK_DETACHED);
-        if (!detached_before_run)
-            __atomic_store_n(&task->status, TASK_RUNNING, __ATOMIC_RELEASE);
+static inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
 
-       pthread_mutex_unlock(&task->task_mutex);
+static struct task_deque_array *
+task_deque_array_new(int64_t capacity)
+{
+    struct task_deque_array *a = malloc(sizeof(*a) +
+                                        capacity * sizeof(a->tasks[0]));
+    if (a == NULL)
+        return NULL;
+    a->capacity = capacity;
+    a->prev = NULL;
+    return a;
+}
 
-        __atomic_add_fetch(&pool->active_threads, 1, __ATOMIC_RELEASE);
+static int
+task_deque_create(struct task_deque *d)
+{
+    d->top = 0;
+    d->bottom = 0;
+    d->array = task_deque_array_new(TASK_DEQUE_MIN_CAPACITY);
+    return d->array == NULL ? -1 : 0;
+}
 
-        pthread_mutex_unlock(&pool->pool_lock);
+static void
+task_deque_destroy(struct task_deque *d)
+{
+    struct task_deque_array *a = d->array;
+    while (a != NULL) {
+        struct task_deque_array *prev = a->prev;
+        free(a);
+        a = prev;
+    }
+    d->array = NULL;
+}
 
-        void *result = task->function(task->arg);
-        bool should_free_task = false;
+static inline struct thread_task *
+task_deque_array_get(struct task_deque_array *a, int64_t i)
+{
+    return __atomic_load_n(&a->tasks[i & (a->capacity - 1)],
+                           __ATOMIC_RELAXED);
+}
 
-        pthread_mutex_lock(&task->task_mutex);
+static inline void
+task_deque_array_set(struct task_deque_array *a, int64_t i,
+                     struct thread_task *task)
+{
+    __atomic_store_n(&a->tasks[i & (a->capacity - 1)], task,
+                     __ATOMIC_RELAXED);
+}
 
-        task->result = result;
-        if (task->status == TASK_DETACHED)
-            should_free_task = true;
-        else if (task->status == TASK_RUNNING) {
-            task->status = TASK_FINISHED;
-            pthread_cond_broadcast(&task->task_cond);
-        }
+/** Owner only. Double the buffer keeping the old one for thieves. */
+static struct task_deque_array *
+task_deque_grow(struct task_deque *d, struct task_deque_array *a,
+                int64_t top, int64_t bottom)
+{
+    struct task_deque_array *new_a = task_deque_array_new(a->capacity * 2);
+    if (new_a == NULL)
+        return NULL;
+    for (int64_t i = top; i < bottom; ++i)
+        task_deque_array_set(new_a, i, task_deque_array_get(a, i));
+    new_a->prev = a;
+    __atomic_store_n(&d->array, new_a, __ATOMIC_RELEASE);
+    return new_a;
+}
 
-        pthread_mutex_unlock(&task->task_mutex);
+/** Owner only. */
+static int
+task_deque_push(struct task_deque *d, struct thread_task *task)
+{
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    struct task_deque_array *a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+    if (b - t > a->capacity - 1) {
+        a = task_deque_grow(d, a, t, b);
+        if (a == NULL)
+            return -1;
+    }
+    task_deque_array_set(a, b, task);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return 0;
+}
 
-        if (should_free_task) {
-            pthread_mutex_destroy(&task->task_mutex);
-            pthread_cond_destroy(&task->task_cond);
-            free(task);
+/** Owner only. Take the most recently pushed task. */
+static struct thread_task *
+task_deque_take(struct task_deque *d)
+{
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    struct task_deque_array *a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+    if (t > b) {
+        /* Empty. */
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    struct thread_task *task = task_deque_array_get(a, b);
+    if (t == b) {
+        /* The last task, race with thieves for it. */
+        if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
             task = NULL;
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+/** Any thread. Take the oldest task, NULL if empty or lost a race. */
+static struct thread_task *
+task_deque_steal(struct task_deque *d)
+{
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+        return NULL;
+    struct task_deque_array *a = __atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+    struct thread_task *task = task_deque_array_get(a, t);
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+    return task;
+}
+
+static int
+task_queue_create(struct task_queue *q, size_t capacity)
+{
+    q->cells = malloc(capacity * sizeof(q->cells[0]));
+    if (q->cells == NULL)
+        return -1;
+    for (size_t i = 0; i < capacity; ++i)
+        q->cells[i].seq = i;
+    q->mask = capacity - 1;
+    q->head = 0;
+    q->tail = 0;
+    q->overflow_count = 0;
+    q->overflow_head = NULL;
+    q->overflow_tail = NULL;
+    pthread_mutex_init(&q->overflow_lock, NULL);
+    return 0;
+}
+
+static void
+task_queue_destroy(struct task_queue *q)
+{
+    /* Nodes without the pool's CPUs have no queue. */
+    if (q->cells == NULL)
+        return;
+    free(q->cells);
+    q->cells = NULL;
+    pthread_mutex_destroy(&q->overflow_lock);
+}
+
+static int
+task_queue_try_push(struct task_queue *q, struct thread_task *task)
+{
+    size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    while (true) {
+        struct task_queue_cell *cell =
+            &q->cells[pos & q->mask];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                cell->task = task;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void
+task_queue_push(struct task_queue *q, struct thread_task *task)
+{
+    if (task_queue_try_push(q, task) == 0)
+        return;
+    task->next_free = NULL;
+    pthread_mutex_lock(&q->overflow_lock);
+    if (q->overflow_tail != NULL)
+        q->overflow_tail->next_free = task;
+    else
+        q->overflow_head = task;
+    q->overflow_tail = task;
+    __atomic_add_fetch(&q->overflow_count, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&q->overflow_lock);
+}
+
+static struct thread_task *
+task_queue_try_pop(struct task_queue *q)
+{
+    size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    while (true) {
+        struct task_queue_cell *cell =
+            &q->cells[pos & q->mask];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                struct thread_task *task = cell->task;
+                __atomic_store_n(&cell->seq, pos + q->mask + 1,
+                                 __ATOMIC_RELEASE);
+                return task;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static struct thread_task *
+task_queue_pop(struct task_queue *q)
+{
+    struct thread_task *task = task_queue_try_pop(q);
+    if (task != NULL ||
+        __atomic_load_n(&q->overflow_count, __ATOMIC_ACQUIRE) == 0)
+        return task;
+    pthread_mutex_lock(&q->overflow_lock);
+    task = q->overflow_head;
+    if (task != NULL) {
+        q->overflow_head = task->next_free;
+        if (q->overflow_head == NULL)
+            q->overflow_tail = NULL;
+        __atomic_sub_fetch(&q->overflow_count, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&q->overflow_lock);
+    return task;
+}
+
+static void
+thread_pool_enqueue(struct thread_pool *pool, struct thread_task *task,
+                    int node);
+
+/**
+ * Drop one dependency of a waiting task. The one who drops the last
+ * dependency submits the task to its pool. Bypasses TPOOL_MAX_TASKS
+ * because a finished predecessor can not report an error anywhere,
+ * the injection queues keep the excess in their overflow lists.
+ */
+static void
+thread_task_release(struct thread_task *task, struct thread_pool *pool)
+{
+    if (pool != NULL)
+        __atomic_store_n(&task->pool, pool, __ATOMIC_RELAXED);
+    uint64_t state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+    uint64_t new_state;
+    do {
+        new_state = state - TASK_PENDING_ONE;
+        if (task_state_pending(new_state) == 0 &&
+            task_state_status(new_state) == TASK_WAITING)
+            new_state = task_state_set_status(new_state, TASK_PUSHED);
+    } while (!__atomic_compare_exchange_n(&task->state, &state, new_state,
+                                          false, __ATOMIC_ACQ_REL,
+                                          __ATOMIC_ACQUIRE));
+    if (task_state_pending(new_state) != 0)
+        return;
+    pool = __atomic_load_n(&task->pool, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pool->task_count, 1, __ATOMIC_SEQ_CST);
+    thread_pool_enqueue(pool, task, -1);
+}
+
+/** @retval true The caller is the first to fire the group. */
+static bool
+thread_task_any_fire(struct thread_task_any *group)
+{
+    return !__atomic_exchange_n(&group->is_fired, true, __ATOMIC_ACQ_REL);
+}
+
+static void
+thread_task_any_unref(struct thread_task_any *group)
+{
+    if (__atomic_sub_fetch(&group->ref_count, 1, __ATOMIC_ACQ_REL) == 0)
+        free(group);
+}
+
+/** Follow the edges of a finished task and free them. */
+static void
+thread_task_edges_fire(struct thread_task_edge *edge, struct thread_pool *pool)
+{
+    while (edge != NULL) {
+        struct thread_task_edge *link = edge->link;
+        if (edge->group == NULL || thread_task_any_fire(edge->group))
+            thread_task_release(edge->next, pool);
+        if (edge->group != NULL)
+            thread_task_any_unref(edge->group);
+        free(edge);
+        edge = link;
+    }
+}
+
+/** Wake everyone who sleeps in join on the task's futex word. */
+static void
+thread_task_wake_joiners(const struct thread_task *task)
+{
+    uint32_t *futex = task_join_futex(task);
+    __atomic_add_fetch(futex, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, futex, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static void
+thread_pool_run_task(struct thread_pool *pool, struct thread_task *task)
+{
+    uint64_t state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+    while (task_state_status(state) != TASK_DETACHED &&
+           !__atomic_compare_exchange_n(&task->state, &state,
+                                        task_state_set_status(state,
+                                                              TASK_RUNNING),
+                                        false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE))
+        ;
+
+    task->result = task->function(task->arg);
+
+    state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+    while (task_state_status(state) != TASK_DETACHED &&
+           !__atomic_compare_exchange_n(&task->state, &state,
+                                        task_state_set_status(state,
+                                                              TASK_FINISHING),
+                                        false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE))
+        ;
+    /*
+     * Continuations see the task finished, and are queued before the
+     * worker becomes idle, so the pool never looks empty while a part
+     * of a graph is pending. The worker is idle by the time join
+     * returns, so a push or a delete right after join doesn't see it
+     * busy.
+     */
+    struct thread_task_edge *successors =
+        __atomic_exchange_n(&task->successors, TASK_EDGES_CLOSED,
+                            __ATOMIC_ACQ_REL);
+    thread_task_edges_fire(successors, pool);
+    __atomic_sub_fetch(&pool->active_threads, 1, __ATOMIC_SEQ_CST);
+
+    state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+    do {
+        if (task_state_status(state) == TASK_DETACHED) {
+            task_free(task);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&task->state, &state, TASK_FINISHED,
+                                          false, __ATOMIC_ACQ_REL,
+                                          __ATOMIC_ACQUIRE));
+    /* The task can be already deleted, don't touch it. */
+    if ((state & TASK_HAS_WAITERS) != 0)
+        thread_task_wake_joiners(task);
+}
+
+/**
+ * Try to steal a task from the other workers, starting at random.
+ * Only the workers on the same node if @a is_local, or only the
+ * ones on the other nodes otherwise.
+ */
+static struct thread_task *
+thread_worker_steal(struct thread_worker *worker, bool is_local)
+{
+    struct thread_pool *pool = worker->pool;
+    int count = __atomic_load_n(&pool->slot_count, __ATOMIC_ACQUIRE);
+    if (count < 2)
+        return NULL;
+    uint32_t x = worker->rand_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    worker->rand_state = x;
+    int start = x % count;
+    for (int i = 0; i < count; ++i) {
+        struct thread_worker *victim = pool->workers[(start + i) % count];
+        if (victim == worker || (victim->node == worker->node) != is_local)
+            continue;
+        struct thread_task *task = task_deque_steal(&victim->deque);
+        if (task != NULL)
+            return task;
+    }
+    return NULL;
+}
+
+/**
+ * Look for a task from the nearest place to the farthest: own deque,
+ * own node's queue, the same node's workers, then the other nodes.
+ */
+static struct thread_task *
+thread_worker_find_task(struct thread_worker *worker)
+{
+    struct thread_pool *pool = worker->pool;
+    struct thread_task *task = task_deque_take(&worker->deque);
+    if (task != NULL)
+        return task;
+    task = task_queue_pop(&pool->injection[worker->node]);
+    if (task != NULL)
+        return task;
+    task = thread_worker_steal(worker, true);
+    if (task != NULL || pool->node_count == 1)
+        return task;
+    for (int i = 0; i < pool->node_count; ++i) {
+        if (i == worker->node || pool->injection[i].cells == NULL)
+            continue;
+        task = task_queue_pop(&pool->injection[i]);
+        if (task != NULL)
+            return task;
+    }
+    return thread_worker_steal(worker, false);
+}
+
+/**
+ * Keep looking for a task for a short while before parking. A task
+ * pushed meanwhile is picked up without a wakeup, and the pusher
+ * doesn't even take park_lock, because the worker isn't a sleeper.
+ */
+static struct thread_task *
+thread_worker_spin(struct thread_worker *worker)
+{
+    struct thread_pool *pool = worker->pool;
+    for (int i = 0; i < WORKER_PARK_SPIN; ++i) {
+        cpu_relax();
+        if (__atomic_load_n(&pool->task_count, __ATOMIC_RELAXED) == 0)
+            continue;
+        struct thread_task *task = thread_worker_find_task(worker);
+        if (task != NULL)
+            return task;
+    }
+    return NULL;
+}
+
+/**
+ * Leave the pool if it has more workers than the minimum. Called
+ * under park_lock with no tasks in the pool. The count drops before
+ * the worker stops being a sleeper, so a pusher either finds it in
+ * the sleepers and signals under park_lock, after which the count is
+ * already visible, or sees the smaller count and spawns a new worker.
+ * @retval true The worker is not a part of the pool anymore.
+ */
+static bool
+thread_worker_retire(struct thread_worker *worker)
+{
+    struct thread_pool *pool = worker->pool;
+    bool is_retired = false;
+    pthread_mutex_lock(&pool->spawn_lock);
+    if (pool->count > pool->min_threads) {
+        __atomic_sub_fetch(&pool->count, 1, __ATOMIC_SEQ_CST);
+        worker->is_alive = false;
+        worker->is_retired = true;
+        is_retired = true;
+    }
+    pthread_mutex_unlock(&pool->spawn_lock);
+    return is_retired;
+}
+
+static bool
+thread_pool_can_retire(struct thread_pool *pool)
+{
+    return pool->idle_timeout_ns != 0 &&
+           __atomic_load_n(&pool->count, __ATOMIC_RELAXED) > pool->min_threads;
+}
+
+/**
+ * Sleep until there is a task somewhere in the pool. The sleeper
+ * count is published before task_count is checked, and a pusher
+ * bumps task_count before checking the sleepers. So either the
+ * worker sees the new task, or the pusher sees the sleeper and
+ * signals it under park_lock. A worker idle for longer than the
+ * pool's idle timeout tries to retire.
+ */
+static enum worker_park_result
+thread_worker_park(struct thread_worker *worker)
+{
+    struct thread_pool *pool = worker->pool;
+    struct timespec deadline;
+    if (pool->idle_timeout_ns != 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        uint64_t nsec = deadline.tv_nsec + pool->idle_timeout_ns;
+        deadline.tv_sec += nsec / 1000000000;
+        deadline.tv_nsec = nsec % 1000000000;
+    }
+    enum worker_park_result result = WORKER_PARK_RUN;
+    pthread_mutex_lock(&pool->park_lock);
+    __atomic_add_fetch(&pool->sleeping_threads, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&pool->task_count, __ATOMIC_SEQ_CST) == 0 &&
+           !pool->shutdown) {
+        if (!thread_pool_can_retire(pool)) {
+            pthread_cond_wait(&pool->park_cond, &pool->park_lock);
+            continue;
         }
+        if (pthread_cond_timedwait(&pool->park_cond, &pool->park_lock,
+                                   &deadline) != ETIMEDOUT)
+            continue;
+        if (__atomic_load_n(&pool->task_count, __ATOMIC_SEQ_CST) == 0 &&
+            !pool->shutdown && thread_worker_retire(worker)) {
+            result = WORKER_PARK_RETIRE;
+            break;
+        }
+    }
+    __atomic_sub_fetch(&pool->sleeping_threads, 1, __ATOMIC_SEQ_CST);
+    if (pool->shutdown)
+        result = WORKER_PARK_STOP;
+    pthread_mutex_unlock(&pool->park_lock);
+    return result;
+}
+
+/** Run a task taken from the pool's queues. */
+static void
+thread_worker_run_task(struct thread_worker *worker, struct thread_task *task)
+{
+    struct thread_pool *pool = worker->pool;
+    /*
+     * Become active before the task leaves the counter, so
+     * thread_pool_delete() can't see the task in neither of them.
+     */
+    __atomic_add_fetch(&pool->active_threads, 1, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&pool->task_count, 1, __ATOMIC_SEQ_CST);
+
+    thread_pool_run_task(pool, task);
+}
 
-        __atomic_sub_fetch(&pool->active_threads, 1, __ATOMIC_RELEASE);
+static void*
+worker_thread(void *arg)
+{
+    struct thread_worker *worker = (struct thread_worker *)arg;
+    current_worker = worker;
+
+    while (1) {
+        struct thread_task *task = thread_worker_find_task(worker);
+        if (task == NULL)
+            task = thread_worker_spin(worker);
+        if (task == NULL) {
+            /* A retired worker's slot can be reused at once. */
+            if (thread_worker_park(worker) != WORKER_PARK_RUN)
+                break;
+            continue;
+        }
+        thread_worker_run_task(worker, task);
     }
 
+    current_worker = NULL;
     return NULL;
 }
 
+/**
+ * Find a slot for a new worker: a free one, or a new one if all of
+ * them are taken. Called under spawn_lock.
+ */
+static struct thread_worker *
+thread_pool_take_slot(struct thread_pool *pool)
+{
+    for (int i = 0; i < pool->slot_count; ++i) {
+        struct thread_worker *worker = pool->workers[i];
+        if (worker->is_alive)
+            continue;
+        if (worker->is_retired) {
+            /* The thread has left the pool and is about to exit. */
+            pthread_join(worker->thread, NULL);
+            worker->is_retired = false;
+        }
+        return worker;
+    }
+    if (pool->slot_count == pool->max_threads)
+        return NULL;
+    struct thread_worker *worker =
+        (struct thread_worker *)calloc(1, sizeof(*worker));
+    if (worker == NULL)
+        return NULL;
+    if (task_deque_create(&worker->deque) != 0) {
+        free(worker);
+        return NULL;
+    }
+    worker->pool = pool;
+    worker->rand_state = 2654435761u * (pool->slot_count + 1);
+    if (pool->cpu_count > 0) {
+        worker->cpu = pool->cpus[pool->slot_count % pool->cpu_count];
+        if (pool->node_count > 1)
+            worker->node = numa_cpu_node(worker->cpu);
+    } else {
+        worker->cpu = -1;
+    }
+    worker->is_alive = false;
+    worker->is_retired = false;
+    pool->workers[pool->slot_count] = worker;
+    __atomic_store_n(&pool->slot_count, pool->slot_count + 1,
+                     __ATOMIC_RELEASE);
+    return worker;
+}
+
+/**
+ * Start more workers until at least @a want of them are idle. The
+ * check is lock-free, the lock is taken only when a thread is really
+ * going to be created.
+ */
+static void
+thread_pool_spawn(struct thread_pool *pool, int want)
+{
+    int count = __atomic_load_n(&pool->count, __ATOMIC_SEQ_CST);
+    if (count >= pool->max_threads ||
+        count - __atomic_load_n(&pool->active_threads, __ATOMIC_ACQUIRE) >=
+        want)
+        return;
+
+    pthread_mutex_lock(&pool->spawn_lock);
+    count = pool->count;
+    while (count < pool->max_threads &&
+           count - __atomic_load_n(&pool->active_threads,
+                                   __ATOMIC_ACQUIRE) < want) {
+        struct thread_worker *worker = thread_pool_take_slot(pool);
+        if (worker == NULL)
+            break;
+        /* Pin at creation, so the thread never runs on a wrong CPU. */
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (worker->cpu >= 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(worker->cpu, &cpus);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        }
+        int rc = pthread_create(&worker->thread, &attr, worker_thread,
+                                worker);
+        pthread_attr_destroy(&attr);
+        if (rc != 0)
+            break;
+        worker->is_alive = true;
+        count = __atomic_add_fetch(&pool->count, 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&pool->spawn_lock);
+}
+
+/** Wake up to @a want sleeping workers under one lock. */
+static void
+thread_pool_wake(struct thread_pool *pool, int want)
+{
+    if (__atomic_load_n(&pool->sleeping_threads, __ATOMIC_SEQ_CST) == 0)
+        return;
+    pthread_mutex_lock(&pool->park_lock);
+    if (want >= pool->sleeping_threads) {
+        pthread_cond_broadcast(&pool->park_cond);
+    } else {
+        for (int i = 0; i < want; i++)
+            pthread_cond_signal(&pool->park_cond);
+    }
+    pthread_mutex_unlock(&pool->park_lock);
+}
+
+/**
+ * Make sure @a want new tasks are picked up. The sleepers are woken
+ * first: if a worker retires meanwhile, the spawn check after that
+ * sees it gone, see thread_worker_retire().
+ */
+static void
+thread_pool_notify(struct thread_pool *pool, int want)
+{
+    thread_pool_wake(pool, want);
+    thread_pool_spawn(pool, want);
+}
+
 int
 thread_pool_new(int max_thread_count, struct thread_pool **pool)
 {
-    if (max_thread_count < 1 || max_thread_count > TPOOL_MAX_THREADS)
+    struct thread_pool_opts opts = {
+        .max_thread_count = max_thread_count,
+    };
+    return thread_pool_new_opts(&opts, pool);
+}
+
+/**
+ * Check the CPUs to pin to exist and are allowed for the process,
+ * otherwise a worker would fail to start.
+ */
+static bool
+thread_pool_cpus_are_valid(const int *cpus, int cpu_count)
+{
+    if (cpu_count == 0)
+        return true;
+    if (cpus == NULL || cpu_count < 0)
+        return false;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return false;
+    for (int i = 0; i < cpu_count; ++i) {
+        if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE ||
+            !CPU_ISSET(cpus[i], &allowed))
+            return false;
+    }
+    return true;
+}
+
+/** Create an injection queue for each node the workers run on. */
+static int
+thread_pool_queues_create(struct thread_pool *pool,
+                          const struct thread_pool_opts *opts)
+{
+    pool->node_count = 1;
+    pool->home_node = 0;
+    if (opts->cpu_count > 0) {
+        pthread_once(&numa_topology_once, numa_topology_init);
+        pool->cpus = malloc(opts->cpu_count * sizeof(pool->cpus[0]));
+        if (pool->cpus == NULL)
+            return -1;
+        memcpy(pool->cpus, opts->cpus,
+               opts->cpu_count * sizeof(pool->cpus[0]));
+        pool->cpu_count = opts->cpu_count;
+        pool->node_count = numa_topology.node_count;
+        if (pool->node_count > 1)
+            pool->home_node = numa_cpu_node(pool->cpus[0]);
+    }
+    pool->injection = calloc(pool->node_count, sizeof(pool->injection[0]));
+    if (pool->injection == NULL)
+        goto error;
+    /* Sized for the pool, not for TPOOL_MAX_TASKS. */
+    size_t capacity = TASK_QUEUE_MIN_CAPACITY;
+    while (capacity < TASK_QUEUE_MAX_CAPACITY &&
+           capacity < (size_t)opts->max_thread_count *
+                      TASK_QUEUE_CELLS_PER_THREAD)
+        capacity *= 2;
+    for (int i = 0; i < pool->node_count; ++i) {
+        bool is_used = pool->node_count == 1;
+        for (int j = 0; j < pool->cpu_count && !is_used; ++j)
+            is_used = numa_cpu_node(pool->cpus[j]) == i;
+        if (is_used && task_queue_create(&pool->injection[i], capacity) != 0)
+            goto error;
+    }
+    return 0;
+error:
+    if (pool->injection != NULL) {
+        for (int i = 0; i < pool->node_count; ++i)
+            task_queue_destroy(&pool->injection[i]);
+    }
+    free(pool->injection);
+    free(pool->cpus);
+    return -1;
+}
+
+static void
+thread_pool_queues_destroy(struct thread_pool *pool)
+{
+    for (int i = 0; i < pool->node_count; ++i)
+        task_queue_destroy(&pool->injection[i]);
+    free(pool->injection);
+    free(pool->cpus);
+}
+
+int
+thread_pool_new_opts(const struct thread_pool_opts *opts,
+                     struct thread_pool **pool)
+{
+    if (opts == NULL || opts->max_thread_count < 1 ||
+        opts->max_thread_count > TPOOL_MAX_THREADS ||
+        opts->min_thread_count < 0 ||
+        opts->min_thread_count > opts->max_thread_count ||
+        !(opts->idle_timeout >= 0) ||
+        !thread_pool_cpus_are_valid(opts->cpus, opts->cpu_count))
         return TPOOL_ERR_INVALID_ARGUMENT;
+    int max_thread_count = opts->max_thread_count;
 
     *pool = (struct thread_pool*)calloc(1, sizeof(struct thread_pool));
     if (*pool == NULL)
         return TPOOL_ERR_UNEXPECTED_ERROR;
 
-    (*pool)->threads = (pthread_t*)calloc(max_thread_count, sizeof(pthread_t));
-    if ((*pool)->threads == NULL) {
+    (*pool)->workers = (struct thread_worker**)calloc(max_thread_count,
+                                                      sizeof(struct thread_worker*));
+    if ((*pool)->workers == NULL) {
+        free(*pool);
+        return TPOOL_ERR_UNEXPECTED_ERROR;
+    }
+
+    if (thread_pool_queues_create(*pool, opts) != 0) {
+        free((*pool)->workers);
         free(*pool);
         return TPOOL_ERR_UNEXPECTED_ERROR;
     }
 
-    (*pool)->task_queue = (struct thread_task**)calloc(TPOOL_MAX_TASKS, sizeof(struct thread_task*));
-    if ((*pool)->task_queue == NULL) {
-        free((*pool)->threads);
+    if (pthread_mutex_init(&(*pool)->park_lock, NULL) != 0) {
+        thread_pool_queues_destroy(*pool);
+        free((*pool)->workers);
         free(*pool);
         return TPOOL_ERR_UNEXPECTED_ERROR;
     }
 
-    if (pthread_mutex_init(&(*pool)->pool_lock, NULL) != 0) {
-        free((*pool)->task_queue);
-        free((*pool)->threads);
+    /* Idle timeouts must not jump with the wall clock. */
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    int rc = pthread_cond_init(&(*pool)->park_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    if (rc != 0) {
+        pthread_mutex_destroy(&(*pool)->park_lock);
+        thread_pool_queues_destroy(*pool);
+        free((*pool)->workers);
         free(*pool);
         return TPOOL_ERR_UNEXPECTED_ERROR;
     }
 
-    if (pthread_cond_init(&(*pool)->pool_cond, NULL) != 0) {
-        pthread_mutex_destroy(&(*pool)->pool_lock);
-        free((*pool)->task_queue);
-        free((*pool)->threads);
+    if (pthread_mutex_init(&(*pool)->spawn_lock, NULL) != 0) {
+        pthread_cond_destroy(&(*pool)->park_cond);
+        pthread_mutex_destroy(&(*pool)->park_lock);
+        thread_pool_queues_destroy(*pool);
+        free((*pool)->workers);
         free(*pool);
         return TPOOL_ERR_UNEXPECTED_ERROR;
     }
 
+    (*pool)->slot_count = 0;
+    (*pool)->min_threads = opts->min_thread_count;
     (*pool)->max_threads = max_thread_count;
+    /* Anything longer than a year is as good as never. */
+    if (opts->idle_timeout > 0 && opts->idle_timeout < 365 * 86400.0) {
+        uint64_t ns = (uint64_t)(opts->idle_timeout * 1e9);
+        (*pool)->idle_timeout_ns = ns != 0 ? ns : 1;
+    } else {
+        (*pool)->idle_timeout_ns = 0;
+    }
     (*pool)->active_threads = 0;
-    (*pool)->queue_capacity = TPOOL_MAX_TASKS;
-    (*pool)->queue_size = 0;
+    (*pool)->sleeping_threads = 0;
+    (*pool)->task_count = 0;
     (*pool)->shutdown = false;
     (*pool)->count = 0;
 
+    if ((*pool)->min_threads > 0)
+        thread_pool_spawn(*pool, (*pool)->min_threads);
     return 0;
 }
 
@@ -164,69 +1318,350 @@ thread_pool_delete(struct thread_pool *pool)
     if (pool == NULL)
         return TPOOL_ERR_INVALID_ARGUMENT;
 
-    int threads_to_join = 0;
+    /* The order matters, see worker_thread(). */
+    if (__atomic_load_n(&pool->task_count, __ATOMIC_SEQ_CST) > 0 ||
+        __atomic_load_n(&pool->active_threads, __ATOMIC_SEQ_CST) > 0)
+        return TPOOL_ERR_HAS_TASKS;
 
-    pthread_mutex_lock(&pool->pool_lock);
+    /*
+     * Workers retire under park_lock, so once shutdown is set, no slot
+     * changes anymore.
+     */
+    pthread_mutex_lock(&pool->park_lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->park_cond);
+    pthread_mutex_unlock(&pool->park_lock);
 
-    if (pool->queue_size > 0 || pool->active_threads > 0) {
-        pthread_mutex_unlock(&pool->pool_lock);
-        return TPOOL_ERR_HAS_TASKS;
+    for (int i = 0; i < pool->slot_count; i++) {
+        struct thread_worker *worker = pool->workers[i];
+        if (worker->is_alive || worker->is_retired)
+            pthread_join(worker->thread, NULL);
+    }
+    /* Threads exiting later could still look into the earlier slots. */
+    for (int i = 0; i < pool->slot_count; i++) {
+        task_deque_destroy(&pool->workers[i]->deque);
+        free(pool->workers[i]);
     }
 
-    pool->shutdown = true;
-    pthread_cond_broadcast(&pool->pool_cond);
-    threads_to_join = __atomic_load_n(&pool->count, __ATOMIC_ACQUIRE); 
+    free(pool->workers);
+    thread_pool_queues_destroy(pool);
+    pthread_mutex_destroy(&pool->spawn_lock);
+    pthread_mutex_destroy(&pool->park_lock);
+    pthread_cond_destroy(&pool->park_cond);
+    free(pool);
 
-    pthread_mutex_unlock(&pool->pool_lock);
+    return 0;
+}
 
-    for (int i = 0; i < threads_to_join; i++) {
-        pthread_join(pool->threads[i], NULL);
-    }
+/** Check a task in @a state can be pushed. */
+static inline bool
+task_state_is_pushable(uint64_t state)
+{
+    enum task_status status = task_state_status(state);
+    return status == TASK_NEW || status == TASK_JOINED;
+}
 
-    int size = __atomic_load_n(&pool->queue_size, __ATOMIC_SEQ_CST);
-    bool has_tasks = size > 0;
+/**
+ * Forget the edges of the previous run. Has to be done before the
+ * task gets new continuations, otherwise they would fire at once.
+ */
+static inline void
+thread_task_reopen(struct thread_task *task)
+{
+    struct thread_task_edge *closed = TASK_EDGES_CLOSED;
+    __atomic_compare_exchange_n(&task->successors, &closed, NULL, false,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
 
-    if (has_tasks)
-        return TPOOL_ERR_HAS_TASKS;
+int
+thread_pool_push_task(struct thread_pool *pool, struct thread_task *task)
+{
+    return thread_pool_push_task_node(pool, task, -1);
+}
 
-    free(pool->threads);
-    free(pool->task_queue);
-    pthread_mutex_destroy(&pool->pool_lock);
-    pthread_cond_destroy(&pool->pool_cond);
-    free(pool);
+int
+thread_pool_push_task_node(struct thread_pool *pool, struct thread_task *task,
+                           int node)
+{
+    if (pool == NULL || task == NULL || node < -1)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+
+    uint64_t state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+    if (!task_state_is_pushable(state))
+        return TPOOL_ERR_TASK_IN_POOL;
+
+    if (__atomic_add_fetch(&pool->task_count, 1, __ATOMIC_SEQ_CST) >
+        TPOOL_MAX_TASKS) {
+        __atomic_sub_fetch(&pool->task_count, 1, __ATOMIC_SEQ_CST);
+        return TPOOL_ERR_TOO_MANY_TASKS;
+    }
+
+    task->pool = pool;
+    thread_task_reopen(task);
+    if (!__atomic_compare_exchange_n(&task->state, &state, TASK_PUSHED, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        __atomic_sub_fetch(&pool->task_count, 1, __ATOMIC_SEQ_CST);
+        return TPOOL_ERR_TASK_IN_POOL;
+    }
 
+    thread_pool_enqueue(pool, task, node);
     return 0;
 }
 
+/**
+ * Injection queue for a task pushed from outside of the pool. It
+ * goes to the hinted node, or to the node the pusher runs on, which
+ * likely has the task's data in its memory.
+ */
+static struct task_queue *
+thread_pool_queue(struct thread_pool *pool, int node)
+{
+    if (pool->node_count == 1)
+        return &pool->injection[0];
+    if (node < 0)
+        node = numa_cpu_node(sched_getcpu());
+    if (node >= pool->node_count || pool->injection[node].cells == NULL)
+        node = pool->home_node;
+    return &pool->injection[node];
+}
+
+/**
+ * Put a task into a queue without waking anybody.
+ * @param node NUMA node hint, -1 for none.
+ */
+static void
+thread_pool_put(struct thread_pool *pool, struct thread_task *task, int node)
+{
+    /*
+     * A task pushed by a worker of the same pool goes to its own
+     * deque, where it is likely to be taken while still hot in the
+     * cache, unless it is hinted to another node. Everything else
+     * goes through an injection queue.
+     */
+    struct thread_worker *worker = current_worker;
+    if (worker == NULL || worker->pool != pool ||
+        (node >= 0 && node != worker->node && pool->node_count > 1) ||
+        task_deque_push(&worker->deque, task) != 0)
+        task_queue_push(thread_pool_queue(pool, node), task);
+}
+
+static void
+thread_pool_enqueue(struct thread_pool *pool, struct thread_task *task,
+                    int node)
+{
+    thread_pool_put(pool, task, node);
+    thread_pool_notify(pool, 1);
+}
+
+/**
+ * Give back a task claimed by a batch push which failed. A pushable
+ * task is NEW or JOINED with no flags, and it is JOINED exactly when
+ * its edges are closed: they are closed when the task finishes, and
+ * reopened only after a successful claim.
+ */
+static inline void
+thread_task_unclaim(struct thread_task *task)
+{
+    bool is_joined = __atomic_load_n(&task->successors, __ATOMIC_RELAXED) ==
+                     TASK_EDGES_CLOSED;
+    __atomic_store_n(&task->state, is_joined ? TASK_JOINED : TASK_NEW,
+                     __ATOMIC_RELEASE);
+}
+
 int
-thread_pool_push_task(struct thread_pool *pool, struct thread_task *task)
+thread_pool_push_tasks(struct thread_pool *pool, struct thread_task **tasks,
+                       int count)
 {
-    if (pool == NULL || task == NULL)
+    if (pool == NULL || tasks == NULL || count < 0)
         return TPOOL_ERR_INVALID_ARGUMENT;
+    if (count == 0)
+        return 0;
 
-    pthread_mutex_lock(&pool->pool_lock);
+    for (int i = 0; i < count; i++) {
+        if (tasks[i] == NULL)
+            return TPOOL_ERR_INVALID_ARGUMENT;
+    }
 
-    if (pool->queue_size >= pool->queue_capacity) {
-        pthread_mutex_unlock(&pool->pool_lock);
+    /* The whole batch fits or nothing is pushed. */
+    if (__atomic_add_fetch(&pool->task_count, count, __ATOMIC_SEQ_CST) >
+        TPOOL_MAX_TASKS) {
+        __atomic_sub_fetch(&pool->task_count, count, __ATOMIC_SEQ_CST);
         return TPOOL_ERR_TOO_MANY_TASKS;
     }
-    
-    if (task->status != TASK_NEW && task->status != TASK_JOINED) {
-        pthread_mutex_unlock(&pool->pool_lock);
+
+    /*
+     * Each task is claimed the same way as a single push does, so a
+     * task pushed concurrently, or twice in the batch, is caught.
+     */
+    for (int i = 0; i < count; i++) {
+        uint64_t state = __atomic_load_n(&tasks[i]->state, __ATOMIC_ACQUIRE);
+        if (task_state_is_pushable(state) &&
+            __atomic_compare_exchange_n(&tasks[i]->state, &state, TASK_PUSHED,
+                                        false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE))
+            continue;
+        while (--i >= 0)
+            thread_task_unclaim(tasks[i]);
+        __atomic_sub_fetch(&pool->task_count, count, __ATOMIC_SEQ_CST);
         return TPOOL_ERR_TASK_IN_POOL;
     }
 
-    __atomic_store_n(&task->status, TASK_PUSHED, __ATOMIC_RELEASE);
-    pool->task_queue[pool->queue_size++] = task;
+    for (int i = 0; i < count; i++) {
+        struct thread_task *task = tasks[i];
+        task->pool = pool;
+        thread_task_reopen(task);
+        thread_pool_put(pool, task, -1);
+    }
 
-    if (pool->count < pool->max_threads && pool->active_threads == pool->count) {
-        if (pthread_create(&pool->threads[pool->count], NULL, worker_thread, pool) == 0)
-            __atomic_add_fetch(&pool->count, 1, __ATOMIC_RELEASE); 
+    thread_pool_notify(pool, count);
+    return 0;
+}
+
+/** Shared state of one thread_pool_parallel_for() call. */
+struct parallel_for
+{
+    thread_pool_range_f function;
+    void *arg;
+    size_t end;
+    size_t grain;
+    /** A chunk is this part of the rest of the range. */
+    size_t split;
+    _Alignas(CACHE_LINE_SIZE) size_t next;
+};
+
+/**
+ * Take the next chunk of the range. Each chunk is a share of what is
+ * left, but not smaller than the grain. So the first chunks are big
+ * and cheap to hand out, and the last ones are small and balance the
+ * tail between the threads.
+ */
+static bool
+parallel_for_claim(struct parallel_for *pf, size_t *begin, size_t *end)
+{
+    size_t pos = __atomic_load_n(&pf->next, __ATOMIC_RELAXED);
+    size_t size;
+    do {
+        if (pos >= pf->end)
+            return false;
+        size_t left = pf->end - pos;
+        size = left / pf->split;
+        if (size < pf->grain)
+            size = pf->grain;
+        if (size > left)
+            size = left;
+    } while (!__atomic_compare_exchange_n(&pf->next, &pos, pos + size, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    *begin = pos;
+    *end = pos + size;
+    return true;
+}
+
+static void
+parallel_for_run(struct parallel_for *pf)
+{
+    size_t begin, end;
+    while (parallel_for_claim(pf, &begin, &end))
+        pf->function(begin, end, pf->arg);
+}
+
+static void *
+parallel_for_helper_f(void *arg)
+{
+    parallel_for_run((struct parallel_for *)arg);
+    return NULL;
+}
+
+/**
+ * Push helpers sharing the range with the caller.
+ * @retval Number of pushed helpers, they are in @a helpers.
+ */
+static int
+parallel_for_start_helpers(struct thread_pool *pool, struct parallel_for *pf,
+                           struct thread_task **helpers, int count)
+{
+    int created = 0;
+    while (created < count &&
+           thread_task_new(&helpers[created], parallel_for_helper_f,
+                           pf) == 0)
+        created++;
+
+    if (created > 0 && thread_pool_push_tasks(pool, helpers, created) != 0) {
+        for (int i = 0; i < created; i++)
+            thread_task_delete(helpers[i]);
+        created = 0;
     }
+    return created;
+}
 
-    pthread_cond_signal(&pool->pool_cond);
+/**
+ * Wait until the helpers are done, so the pool doesn't count any of
+ * them when the call returns. A helper can still sit in the caller's
+ * own deque, where nobody else might take it, so a worker of the pool
+ * runs its deque meanwhile.
+ */
+static void
+parallel_for_join_helpers(struct thread_pool *pool,
+                          struct thread_task **helpers, int count)
+{
+    struct thread_worker *worker = current_worker;
+    for (int i = 0; i < count; i++) {
+        struct thread_task *task;
+        while (worker != NULL && worker->pool == pool &&
+               !thread_task_is_finished(helpers[i]) &&
+               (task = task_deque_take(&worker->deque)) != NULL)
+            thread_worker_run_task(worker, task);
+        void *result;
+        thread_task_join(helpers[i], &result);
+        thread_task_delete(helpers[i]);
+    }
+}
 
-    pthread_mutex_unlock(&pool->pool_lock);
+int
+thread_pool_parallel_for(struct thread_pool *pool, size_t begin, size_t end,
+                         size_t grain, thread_pool_range_f function, void *arg)
+{
+    if (pool == NULL || function == NULL || begin > end)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    if (begin == end)
+        return 0;
+    if (grain == 0)
+        grain = 1;
+
+    struct parallel_for pf;
+    pf.function = function;
+    pf.arg = arg;
+    pf.next = begin;
+    pf.end = end;
+    pf.grain = grain;
+
+    /*
+     * The caller works too. A worker of this pool is one of the pool's
+     * threads, an external thread is an extra one.
+     */
+    size_t chunk_count = (end - begin + grain - 1) / grain;
+    size_t helper_count = pool->max_threads;
+    if (current_worker != NULL && current_worker->pool == pool)
+        helper_count--;
+    if (helper_count > chunk_count - 1)
+        helper_count = chunk_count - 1;
+    pf.split = 2 * (helper_count + 1);
+
+    struct thread_task **helpers = NULL;
+    int started = 0;
+    if (helper_count > 0) {
+        helpers = calloc(helper_count, sizeof(*helpers));
+        if (helpers != NULL)
+            started = parallel_for_start_helpers(pool, &pf, helpers,
+                                                 helper_count);
+    }
+
+    /*
+     * Every chunk is taken either by the caller or by a helper, so
+     * once the helpers are joined, the whole range is done.
+     */
+    parallel_for_run(&pf);
+    parallel_for_join_helpers(pool, helpers, started);
+    free(helpers);
 
     return 0;
 }
@@ -237,24 +1672,17 @@ thread_task_new(struct thread_task **task, thread_task_f function, void *arg)
     if (task == NULL)
         return TPOOL_ERR_INVALID_ARGUMENT;
 
-    *task = (struct thread_task*)calloc(1, sizeof(struct thread_task));
+    *task = task_alloc();
     if (*task == NULL)
         return TPOOL_ERR_UNEXPECTED_ERROR;
 
     (*task)->function = function;
     (*task)->arg = arg;
-    (*task)->status = TASK_NEW;
-
-    if (pthread_mutex_init(&(*task)->task_mutex, NULL) != 0) {
-        free(*task);
-        return TPOOL_ERR_UNEXPECTED_ERROR;
-    }
-
-    if (pthread_cond_init(&(*task)->task_cond, NULL) != 0) {
-        pthread_mutex_destroy(&(*task)->task_mutex);
-        free(*task);
-        return TPOOL_ERR_UNEXPECTED_ERROR;
-    }
+    (*task)->result = NULL;
+    (*task)->state = TASK_NEW;
+    (*task)->pool = NULL;
+    (*task)->successors = NULL;
+    (*task)->next_free = NULL;
 
     return 0;
 }
@@ -265,8 +1693,10 @@ thread_task_is_finished(const struct thread_task *task)
     if (task == NULL)
         return false;
 
-    int status = __atomic_load_n(&task->status, __ATOMIC_ACQUIRE);
-    return status == TASK_FINISHED || status == TASK_JOINED;
+    enum task_status status =
+        task_state_status(__atomic_load_n(&task->state, __ATOMIC_ACQUIRE));
+    return status == TASK_FINISHING || status == TASK_FINISHED ||
+           status == TASK_JOINED;
 }
 
 bool
@@ -275,38 +1705,134 @@ thread_task_is_running(const struct thread_task *task)
     if (task == NULL)
         return false;
 
-    int status = __atomic_load_n(&task->status, __ATOMIC_ACQUIRE);
+    enum task_status status =
+        task_state_status(__atomic_load_n(&task->state, __ATOMIC_ACQUIRE));
     return status == TASK_RUNNING;
 }
 
-int
-thread_task_join(struct thread_task *task, void **result)
+static inline bool
+task_state_is_joinable(uint64_t state)
 {
-    if (task == NULL || result == NULL)
-        return TPOOL_ERR_INVALID_ARGUMENT;
+    enum task_status status = task_state_status(state);
+    return status == TASK_FINISHED || status == TASK_JOINED;
+}
 
-    pthread_mutex_lock(&task->task_mutex);
+/**
+ * Wait until @a task is finished or the @a deadline on
+ * CLOCK_MONOTONIC passes. NULL deadline means no limit.
+ * @retval true The task is finished.
+ */
+static bool
+thread_task_wait(struct thread_task *task, const struct timespec *deadline)
+{
+    uint64_t state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+    uint32_t *futex = task_join_futex(task);
+    while (!task_state_is_joinable(state)) {
+        /*
+         * The worker sets the task finished before bumping the futex
+         * word, and the word is read before the flag is set. So the
+         * wakeup can't be missed.
+         */
+        uint32_t seq = __atomic_load_n(futex, __ATOMIC_ACQUIRE);
+        state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+        if (task_state_is_joinable(state))
+            break;
+        if ((state & TASK_HAS_WAITERS) == 0 &&
+            !__atomic_compare_exchange_n(&task->state, &state,
+                                         state | TASK_HAS_WAITERS, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            continue;
+        /*
+         * The bitset flavour takes an absolute deadline, so spurious
+         * and foreign wakeups don't need the remaining time counted.
+         * The waiters flag stays after a timeout, it only costs the
+         * worker a futex wake.
+         */
+        if (syscall(SYS_futex, futex, FUTEX_WAIT_BITSET_PRIVATE, seq,
+                    deadline, NULL, FUTEX_BITSET_MATCH_ANY) != 0 &&
+            errno == ETIMEDOUT) {
+            state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+            return task_state_is_joinable(state);
+        }
+        state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+    }
+    return true;
+}
 
-    if (task->status == TASK_NEW || task->status == TASK_DETACHED) {
-        pthread_mutex_unlock(&task->task_mutex);
+/**
+ * Check @a task can be joined, and spin a bit if it is not finished
+ * yet.
+ * @retval 0 The task is finished.
+ * @retval -1 The task is still running.
+ * @retval > 0 Error code.
+ */
+static int
+thread_task_join_prepare(struct thread_task *task, int spin)
+{
+    uint64_t state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+    enum task_status status = task_state_status(state);
+    if (status == TASK_NEW || status == TASK_DETACHED ||
+        status == TASK_JOINED)
         return TPOOL_ERR_TASK_NOT_PUSHED;
-    }
 
-    if (task->status == TASK_JOINED) {
-        pthread_mutex_unlock(&task->task_mutex);
-        return TPOOL_ERR_TASK_NOT_PUSHED; 
+    /* Short tasks are often done before it is worth to sleep. */
+    for (int i = 0; i < spin && !task_state_is_joinable(state); i++) {
+        cpu_relax();
+        state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
     }
+    return task_state_is_joinable(state) ? 0 : -1;
+}
 
-    while (task->status != TASK_FINISHED && task->status != TASK_JOINED)
-         pthread_cond_wait(&task->task_cond, &task->task_mutex);
+static void
+thread_task_join_finish(struct thread_task *task, void **result)
+{
+    *result = task->result;
+    __atomic_store_n(&task->state, TASK_JOINED, __ATOMIC_RELEASE);
+}
 
-    if (task->status == TASK_FINISHED)
-        task->status = TASK_JOINED;
+int
+thread_task_join(struct thread_task *task, void **result)
+{
+    if (task == NULL || result == NULL)
+        return TPOOL_ERR_INVALID_ARGUMENT;
 
-    *result = task->result;
+    int rc = thread_task_join_prepare(task, TASK_JOIN_SPIN);
+    if (rc > 0)
+        return rc;
+    if (rc < 0)
+        thread_task_wait(task, NULL);
+    thread_task_join_finish(task, result);
+    return 0;
+}
 
-    pthread_mutex_unlock(&task->task_mutex);
+int
+thread_task_timed_join(struct thread_task *task, double timeout, void **result)
+{
+    if (task == NULL || result == NULL)
+        return TPOOL_ERR_INVALID_ARGUMENT;
 
+    /* A finished task is joined without a single syscall. */
+    int rc = thread_task_join_prepare(task, timeout > 0 ? TASK_JOIN_SPIN : 0);
+    if (rc > 0)
+        return rc;
+    if (rc < 0) {
+        if (!(timeout > 0))
+            return TPOOL_ERR_TIMEOUT;
+        /* Anything longer than a year is as good as infinity. */
+        if (timeout < 365 * 86400.0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            uint64_t nsec = deadline.tv_nsec +
+                            (uint64_t)((timeout - (uint64_t)timeout) * 1e9);
+            deadline.tv_sec += (time_t)timeout + nsec / 1000000000;
+            deadline.tv_nsec = nsec % 1000000000;
+            if (!thread_task_wait(task, &deadline))
+                return TPOOL_ERR_TIMEOUT;
+        } else {
+            thread_task_wait(task, NULL);
+        }
+    }
+    thread_task_join_finish(task, result);
     return 0;
 }
 
@@ -316,23 +1842,17 @@ thread_task_delete(struct thread_task *task)
     if (task == NULL)
         return TPOOL_ERR_INVALID_ARGUMENT;
 
-    pthread_mutex_lock(&task->task_mutex);
-
-    if (task->status == TASK_DETACHED) {
-        pthread_mutex_unlock(&task->task_mutex);
+    uint64_t state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+    if (task_state_status(state) == TASK_DETACHED)
         return 0;
-    }
 
-    if (task->status != TASK_NEW && task->status != TASK_JOINED) {
-        pthread_mutex_unlock(&task->task_mutex);
+    struct thread_task_edge *successors =
+        __atomic_load_n(&task->successors, __ATOMIC_ACQUIRE);
+    if (!task_state_is_pushable(state) ||
+        (successors != NULL && successors != TASK_EDGES_CLOSED))
         return TPOOL_ERR_TASK_IN_POOL;
-    }
-
-    pthread_mutex_unlock(&task->task_mutex);
 
-    pthread_mutex_destroy(&task->task_mutex);
-    pthread_cond_destroy(&task->task_cond);
-    free(task);
+    task_free(task);
 
     return 0;
 }
@@ -343,35 +1863,198 @@ thread_task_detach(struct thread_task *task)
     if (task == NULL)
         return TPOOL_ERR_INVALID_ARGUMENT;
 
-    pthread_mutex_lock(&task->task_mutex);
+    uint64_t state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+    while (true) {
+        switch (task_state_status(state)) {
+        case TASK_DETACHED:
+            return 0;
+        case TASK_NEW:
+        case TASK_JOINED:
+            return TPOOL_ERR_TASK_NOT_PUSHED;
+        case TASK_FINISHED:
+            if (__atomic_compare_exchange_n(&task->state, &state,
+                                            TASK_DETACHED, false,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                task_free(task);
+                return 0;
+            }
+            break;
+        default:
+            /* The worker frees it when done. */
+            if (__atomic_compare_exchange_n(&task->state, &state,
+                                            task_state_set_status(state,
+                                                                  TASK_DETACHED),
+                                            false, __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE))
+                return 0;
+            break;
+        }
+    }
+}
 
-    if (task->status == TASK_DETACHED) {
-        pthread_mutex_unlock(&task->task_mutex);
-        return 0;
+/**
+ * Turn @a next into a waiting task with @a count more dependencies.
+ * One extra dependency is held by the caller until all the edges are
+ * linked. Otherwise already finished predecessors could submit
+ * @a next before the rest of them are linked.
+ */
+static int
+thread_task_hold(struct thread_task *next, int count)
+{
+    uint64_t state = __atomic_load_n(&next->state, __ATOMIC_ACQUIRE);
+    uint64_t new_state;
+    do {
+        enum task_status status = task_state_status(state);
+        if (status != TASK_NEW && status != TASK_JOINED &&
+            status != TASK_WAITING)
+            return TPOOL_ERR_TASK_IN_POOL;
+        new_state = task_state_set_status(state, TASK_WAITING) +
+                    (count + 1) * TASK_PENDING_ONE;
+    } while (!__atomic_compare_exchange_n(&next->state, &state, new_state,
+                                          false, __ATOMIC_ACQ_REL,
+                                          __ATOMIC_ACQUIRE));
+    if (task_state_status(state) != TASK_WAITING)
+        thread_task_reopen(next);
+    return 0;
+}
+
+/**
+ * Attach @a edge to @a task. If the task is already finished, the
+ * edge is fired right away.
+ */
+static void
+thread_task_link(struct thread_task *task, struct thread_task_edge *edge)
+{
+    struct thread_task_edge *head =
+        __atomic_load_n(&task->successors, __ATOMIC_ACQUIRE);
+    do {
+        if (head == TASK_EDGES_CLOSED) {
+            edge->link = NULL;
+            thread_task_edges_fire(edge, task->pool);
+            return;
+        }
+        edge->link = head;
+    } while (!__atomic_compare_exchange_n(&task->successors, &head, edge,
+                                          false, __ATOMIC_ACQ_REL,
+                                          __ATOMIC_ACQUIRE));
+}
+
+static int
+thread_task_check_deps(struct thread_task *next, struct thread_task **tasks,
+                       int count)
+{
+    if (next == NULL || tasks == NULL || count < 1)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    for (int i = 0; i < count; i++) {
+        if (tasks[i] == NULL || tasks[i] == next)
+            return TPOOL_ERR_INVALID_ARGUMENT;
     }
+    /*
+     * A joined task still points at its last pool, which can be
+     * deleted already. A continuation of it would be pushed there.
+     */
+    for (int i = 0; i < count; i++) {
+        uint64_t state = __atomic_load_n(&tasks[i]->state, __ATOMIC_ACQUIRE);
+        if (task_state_status(state) == TASK_JOINED)
+            return TPOOL_ERR_TASK_NOT_PUSHED;
+    }
+    return 0;
+}
 
-    if (task->status == TASK_NEW) {
-        pthread_mutex_unlock(&task->task_mutex);
-        return TPOOL_ERR_TASK_NOT_PUSHED;
+static struct thread_task_edge **
+thread_task_edges_new(struct thread_task *next, struct thread_task_any *group,
+                      int count)
+{
+    struct thread_task_edge **edges = calloc(count, sizeof(*edges));
+    if (edges == NULL)
+        return NULL;
+    for (int i = 0; i < count; i++) {
+        edges[i] = malloc(sizeof(*edges[i]));
+        if (edges[i] == NULL) {
+            while (--i >= 0)
+                free(edges[i]);
+            free(edges);
+            return NULL;
+        }
+        edges[i]->next = next;
+        edges[i]->group = group;
+        edges[i]->link = NULL;
     }
+    return edges;
+}
 
-    if (task->status == TASK_JOINED) {
-        pthread_mutex_unlock(&task->task_mutex);
-        return TPOOL_ERR_TASK_NOT_PUSHED;
+static void
+thread_task_edges_delete(struct thread_task_edge **edges, int count)
+{
+    for (int i = 0; i < count; i++)
+        free(edges[i]);
+    free(edges);
+}
+
+int
+thread_task_then(struct thread_task *task, struct thread_task *next)
+{
+    return thread_task_when_all(next, &task, 1);
+}
+
+int
+thread_task_when_all(struct thread_task *next, struct thread_task **tasks,
+                     int count)
+{
+    int rc = thread_task_check_deps(next, tasks, count);
+    if (rc != 0)
+        return rc;
+
+    struct thread_task_edge **edges = thread_task_edges_new(next, NULL, count);
+    if (edges == NULL)
+        return TPOOL_ERR_UNEXPECTED_ERROR;
+
+    rc = thread_task_hold(next, count);
+    if (rc != 0) {
+        thread_task_edges_delete(edges, count);
+        return rc;
     }
 
-    if (task->status == TASK_FINISHED) {
-        pthread_mutex_unlock(&task->task_mutex);
+    for (int i = 0; i < count; i++)
+        thread_task_link(tasks[i], edges[i]);
+    free(edges);
+    thread_task_release(next, NULL);
 
-        __atomic_store_n(&task->status, TASK_DETACHED, __ATOMIC_RELEASE);
-        pthread_mutex_destroy(&task->task_mutex);
-        pthread_cond_destroy(&task->task_cond);
-        free(task);
-        return 0;
+    return 0;
+}
+
+int
+thread_task_when_any(struct thread_task *next, struct thread_task **tasks,
+                     int count)
+{
+    int rc = thread_task_check_deps(next, tasks, count);
+    if (rc != 0)
+        return rc;
+
+    struct thread_task_any *group = malloc(sizeof(*group));
+    if (group == NULL)
+        return TPOOL_ERR_UNEXPECTED_ERROR;
+    group->is_fired = false;
+    group->ref_count = count;
+
+    struct thread_task_edge **edges = thread_task_edges_new(next, group, count);
+    if (edges == NULL) {
+        free(group);
+        return TPOOL_ERR_UNEXPECTED_ERROR;
     }
 
-    __atomic_store_n(&task->status, TASK_DETACHED, __ATOMIC_RELEASE);
-    pthread_mutex_unlock(&task->task_mutex);
+    rc = thread_task_hold(next, 1);
+    if (rc != 0) {
+        thread_task_edges_delete(edges, count);
+        free(group);
+        return rc;
+    }
+
+    for (int i = 0; i < count; i++)
+        thread_task_link(tasks[i], edges[i]);
+    free(edges);
+    thread_task_release(next, NULL);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 /**
  * Here you should specify which features do you want to implement via macros:
@@ -16,15 +17,16 @@
  * used by tests.
  */
 #define NEED_DETACH 1
-#define NEED_TIMED_JOIN 0
+#define NEED_TIMED_JOIN 1
 
 struct thread_pool;
 struct thread_task;
 
 typedef void *(*thread_task_f)(void *);
+typedef void (*thread_pool_range_f)(size_t begin, size_t end, void *arg);
 
 enum {
-	TPOOL_MAX_THREADS = 20,
+	TPOOL_MAX_THREADS = 1024,
 	TPOOL_MAX_TASKS = 100000,
 };
 
@@ -56,8 +58,55 @@ int
 thread_pool_new(int max_thread_count, struct thread_pool **pool);
 
 /**
- * How many threads are created by this pool. Can be less than
- * max.
+ * Thread pool options. Zero-initialized options except for the
+ * maximum mean the defaults.
+ */
+struct thread_pool_opts {
+	/**
+	 * Workers started at once and kept even when idle. From 0 to
+	 * max_thread_count.
+	 */
+	int min_thread_count;
+	/**
+	 * Maximum pool size, from 1 to TPOOL_MAX_THREADS. Workers above
+	 * the minimum are started on demand.
+	 */
+	int max_thread_count;
+	/**
+	 * Seconds a worker above the minimum stays idle before it exits.
+	 * 0 or infinity means it never does, as in thread_pool_new().
+	 */
+	double idle_timeout;
+	/**
+	 * CPUs to pin the workers to, @a cpu_count of them. Each worker
+	 * slot gets the next CPU of the list, round robin. The workers
+	 * are grouped by the NUMA nodes of their CPUs: each node has its
+	 * own task queue, and an idle worker steals on its own node
+	 * before crossing to the others. NULL means no pinning, the
+	 * workers are one group.
+	 */
+	const int *cpus;
+	int cpu_count;
+};
+
+/**
+ * Same as thread_pool_new(), but the pool can shrink back when it is
+ * idle, see struct thread_pool_opts.
+ * @param opts Pool options.
+ * @param[out] Pointer to store result pool object.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - the options are out of range,
+ *       or a CPU is not allowed for the process.
+ */
+int
+thread_pool_new_opts(const struct thread_pool_opts *opts,
+		     struct thread_pool **pool);
+
+/**
+ * How many threads are running in this pool. Can be less than
+ * max, and goes down when idle workers retire.
  * @param pool Thread pool to get thread count of.
  * @retval Thread count.
  */
@@ -87,6 +136,66 @@ thread_pool_delete(struct thread_pool *pool);
 int
 thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
 
+/**
+ * Same as thread_pool_push_task(), but prefer the workers of NUMA
+ * node @a node, for example the one holding the task's data. Without
+ * a hint a task pushed from outside of the pool goes to the node of
+ * the CPU the caller runs on, and a task pushed by a worker stays
+ * with it. The hint only matters for a pool pinned to CPUs of several
+ * nodes, and a node without the pool's workers is the same as no
+ * hint.
+ * @param pool Pool to push into.
+ * @param task Task to push.
+ * @param node NUMA node, or -1 for no hint.
+ *
+ * @retval 0 Success.
+ * @retval != Error code, see thread_pool_push_task().
+ */
+int
+thread_pool_push_task_node(struct thread_pool *pool, struct thread_task *task,
+			   int node);
+
+/**
+ * Push @a count tasks at once. The tasks are queued together and
+ * as many workers are woken up as there are tasks, or all the idle
+ * ones if there are less of them.
+ * @param pool Pool to push into.
+ * @param tasks Tasks to push.
+ * @param count Task count.
+ *
+ * @retval 0 Success, all the tasks are pushed.
+ * @retval != Error code, no task is pushed.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - the tasks don't fit into the pool.
+ *     - TPOOL_ERR_TASK_IN_POOL - one of the tasks is already pushed,
+ *       or is given twice.
+ */
+int
+thread_pool_push_tasks(struct thread_pool *pool, struct thread_task **tasks,
+		       int count);
+
+/**
+ * Call @a function on subranges of [@a begin, @a end) in parallel and
+ * wait until the whole range is done. The calling thread takes part
+ * in the work, so it can be called from a task of the same pool.
+ * Subranges are handed out in shrinking chunks: big ones first, to
+ * make the overhead per element small, and small ones in the end, to
+ * balance the load. When it returns, none of its tasks is left in
+ * the pool, so the pool can be deleted right away.
+ * @param pool Pool to run in.
+ * @param begin Start of the range.
+ * @param end End of the range, not included.
+ * @param grain Minimal chunk size. 0 is the same as 1.
+ * @param function Function to call on each chunk.
+ * @param arg Argument for @a function.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no function, or begin > end.
+ */
+int
+thread_pool_parallel_for(struct thread_pool *pool, size_t begin, size_t end,
+			 size_t grain, thread_pool_range_f function, void *arg);
+
 /** Thread pool task API. */
 
 /**
@@ -175,3 +284,63 @@ int
 thread_task_detach(struct thread_task *task);
 
 #endif
+
+/** Task dependency API. */
+
+/**
+ * Make @a next a continuation of @a task. Once @a task is finished,
+ * @a next is pushed to the same pool automatically, so a pipeline
+ * doesn't need a thread blocked in join between its stages. A task
+ * can have many continuations and many predecessors, which allows to
+ * build an arbitrary DAG. Only its roots need to be pushed manually.
+ *
+ * Until the predecessors are finished @a next is considered to be in
+ * a pool: it can be joined or detached, but not pushed or deleted.
+ * If @a task is already finished, @a next is pushed right away into
+ * the pool @a task ran in, so the pool must not be deleted before
+ * that. A joined task is not in a pool anymore and can't be a
+ * predecessor until it is pushed again. A task having continuations
+ * can't be deleted without being pushed. The graph must not have
+ * cycles.
+ *
+ * @param task Predecessor.
+ * @param next Continuation. Not pushed, or waiting for other tasks.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - a task is NULL or they are the
+ *       same task.
+ *     - TPOOL_ERR_TASK_IN_POOL - @a next is already pushed.
+ *     - TPOOL_ERR_TASK_NOT_PUSHED - @a task is already joined.
+ */
+int
+thread_task_then(struct thread_task *task, struct thread_task *next);
+
+/**
+ * Push @a next when all of @a tasks are finished. The same as
+ * thread_task_then() called for each of them, but @a next can't be
+ * pushed while only a part of the edges are added.
+ * @param next Continuation.
+ * @param tasks Predecessors.
+ * @param count Predecessor count, > 0.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code, see thread_task_then().
+ */
+int
+thread_task_when_all(struct thread_task *next, struct thread_task **tasks,
+		     int count);
+
+/**
+ * Push @a next when any of @a tasks is finished. The rest of them keep
+ * running and need to be joined or detached as usual.
+ * @param next Continuation.
+ * @param tasks Predecessors.
+ * @param count Predecessor count, > 0.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code, see thread_task_then().
+ */
+int
+thread_task_when_any(struct thread_task *next, struct thread_task **tasks,
+		     int count);
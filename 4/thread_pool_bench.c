@@ -0,0 +1,120 @@
+#include "thread_pool.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * Compares three ways to process the same array in chunks: a task
+ * per chunk pushed one by one, the same tasks pushed as one batch,
+ * and thread_pool_parallel_for() with the chunk as the grain.
+ */
+
+enum {
+	BENCH_THREADS = 4,
+	BENCH_SIZE = 1 << 20,
+	BENCH_ROUNDS = 5,
+};
+
+struct bench_chunk {
+	double *data;
+	size_t begin;
+	size_t end;
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+bench_work(double *data, size_t begin, size_t end)
+{
+	for (size_t i = begin; i < end; ++i)
+		data[i] = data[i] * 1.0001 + 1;
+}
+
+static void *
+bench_chunk_f(void *arg)
+{
+	struct bench_chunk *chunk = arg;
+	bench_work(chunk->data, chunk->begin, chunk->end);
+	return NULL;
+}
+
+static void
+bench_range_f(size_t begin, size_t end, void *arg)
+{
+	bench_work(arg, begin, end);
+}
+
+static void
+bench_tasks(struct thread_pool *pool, double *data, size_t grain,
+	    bool is_batch)
+{
+	size_t count = (BENCH_SIZE + grain - 1) / grain;
+	struct bench_chunk *chunks = malloc(sizeof(*chunks) * count);
+	struct thread_task **tasks = malloc(sizeof(*tasks) * count);
+	uint64_t start = bench_now_ns();
+	for (int r = 0; r < BENCH_ROUNDS; ++r) {
+		for (size_t i = 0; i < count; ++i) {
+			chunks[i].data = data;
+			chunks[i].begin = i * grain;
+			chunks[i].end = chunks[i].begin + grain;
+			if (chunks[i].end > BENCH_SIZE)
+				chunks[i].end = BENCH_SIZE;
+			thread_task_new(&tasks[i], bench_chunk_f, &chunks[i]);
+			if (!is_batch)
+				thread_pool_push_task(pool, tasks[i]);
+		}
+		if (is_batch)
+			thread_pool_push_tasks(pool, tasks, count);
+		for (size_t i = 0; i < count; ++i) {
+			void *result;
+			thread_task_join(tasks[i], &result);
+			thread_task_delete(tasks[i]);
+		}
+	}
+	uint64_t duration = bench_now_ns() - start;
+	printf("%s, grain %zu: %.2f ms per pass\n",
+	       is_batch ? "batch push" : "push per task", grain,
+	       duration / 1e6 / BENCH_ROUNDS);
+	free(tasks);
+	free(chunks);
+}
+
+static void
+bench_parallel_for(struct thread_pool *pool, double *data, size_t grain)
+{
+	uint64_t start = bench_now_ns();
+	for (int r = 0; r < BENCH_ROUNDS; ++r)
+		thread_pool_parallel_for(pool, 0, BENCH_SIZE, grain,
+					 bench_range_f, data);
+	uint64_t duration = bench_now_ns() - start;
+	printf("parallel for, grain %zu: %.2f ms per pass\n", grain,
+	       duration / 1e6 / BENCH_ROUNDS);
+}
+
+int
+main(void)
+{
+	struct thread_pool *pool;
+	if (thread_pool_new(BENCH_THREADS, &pool) != 0)
+		return 1;
+	double *data = calloc(BENCH_SIZE, sizeof(*data));
+	size_t grains[] = {64, 1024, 16384};
+	for (size_t i = 0; i < sizeof(grains) / sizeof(grains[0]); ++i) {
+		bench_tasks(pool, data, grains[i], false);
+		bench_tasks(pool, data, grains[i], true);
+		bench_parallel_for(pool, data, grains[i]);
+	}
+	free(data);
+	/* Helpers of the last parallel for might be still finishing. */
+	while (thread_pool_delete(pool) != 0)
+		;
+	return 0;
+}